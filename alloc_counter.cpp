@@ -0,0 +1,27 @@
+#include "alloc_counter.h"
+#include <cstdlib>
+#include <new>
+
+// Per thread, so concurrently running simulators each see only their own
+// allocations and never contend on a shared counter.
+static thread_local uint64_t allocation_count = 0;
+
+uint64_t heap_allocation_count() {
+    return allocation_count;
+}
+
+void* operator new(std::size_t size) {
+    allocation_count++;
+    if (size == 0) size = 1;
+    void* ptr = std::malloc(size);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
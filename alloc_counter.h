@@ -0,0 +1,7 @@
+#pragma once
+#include <cstdint>
+
+// Number of heap allocations made through global operator new by the calling
+// thread since it started. Used by the performance report to show that the
+// steady-state simulation loop does not allocate.
+uint64_t heap_allocation_count();
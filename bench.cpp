@@ -0,0 +1,226 @@
+// Simulator throughput benchmark: how fast the simulator itself runs, not
+// the simulated TPU. Each workload is built once, then simulated from
+// scratch for warmup and timed runs; only the tick loop is timed.
+//
+//   tpu_bench [--workload=NAME]... [--full] [--runs=N] [--warmup=N]
+//             [--baseline=FILE [--threshold=PCT]] [--write-baseline=FILE]
+//
+// The default set is demo, gemm256, gemm1024, mlp1024, membound and
+// compbound; --full adds gemm4096. With --baseline the run fails (exit 1)
+// when a workload's median simulated cycles per host second falls more than
+// --threshold percent (default 10) below the baseline. Baselines are
+// machine-specific; regenerate with --write-baseline on the machine that
+// gates.
+#include "tpu.h"
+#include "program_builder.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct BenchResult {
+    std::string workload;
+    bool correct;
+    uint64_t cycles;
+    uint64_t macs;
+    std::vector<double> seconds;   // timed runs, sorted
+
+    BenchResult() : correct(true), cycles(0), macs(0) {}
+    // Nearest-rank percentile of the run times.
+    double percentile(double p) const {
+        size_t rank = static_cast<size_t>(p / 100.0 * seconds.size() + 0.5);
+        return seconds[std::min(seconds.size() - 1, rank > 0 ? rank - 1 : 0)];
+    }
+    double median() const { return percentile(50.0); }
+    double cycles_per_second() const { return cycles / median(); }
+    double macs_per_second() const { return macs / median(); }
+};
+
+struct BaselineEntry {
+    uint64_t cycles;
+    double cycles_per_second;
+    double macs_per_second;
+};
+
+// Simulates the workload once from a fresh TPU; returns the seconds spent in
+// the tick loop. Checks the first output element, or the whole output when
+// expected is given.
+double simulate(const TPUConfig& config, const ProgramBuilder& builder, const HostMemory::Image& image,
+                uint32_t output_addr, int32_t expected_first, BenchResult& result,
+                const std::vector<int32_t>* expected = nullptr) {
+    TPU tpu(config);
+    tpu.load_program(builder.program());
+    tpu.map_host_image(image);
+    auto start = std::chrono::steady_clock::now();
+    while (!tpu.is_halted()) tpu.tick();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int32_t first = 0;
+    tpu.read_host_memory(output_addr, reinterpret_cast<uint8_t*>(&first), sizeof(first));
+    result.correct = result.correct && first == expected_first;
+    if (expected) {
+        std::vector<int32_t> output(expected->size());
+        tpu.read_host_memory(output_addr, reinterpret_cast<uint8_t*>(output.data()), output.size() * sizeof(int32_t));
+        result.correct = result.correct && output == *expected;
+    }
+    result.cycles = tpu.get_cycle_count();
+    result.macs = tpu.get_mac_count();
+    return seconds;
+}
+
+bool run_workload(const std::string& name, int warmup, int runs, BenchResult& result) {
+    ProgramBuilder builder;
+    int32_t expected_first = 0;
+    uint32_t output_addr = 0;
+    std::vector<int32_t> expected;
+    if (!build_workload(name, builder, &expected_first, &output_addr, 1, &expected)) {
+        std::cerr << "ERROR: Unknown workload: " << name << std::endl;
+        return false;
+    }
+    TPUConfig config;
+    config.verbose = false;
+    config.host_memory_mb = std::max(config.host_memory_mb, builder.host_memory_mb());
+    HostMemory::Image image = builder.image();
+
+    // Small workloads finish in microseconds, below timer and scheduler
+    // noise, so each sample repeats the simulation until it covers at least
+    // MIN_SAMPLE_SECONDS. An untimed first run, which counts as one of the
+    // warmup runs, picks the repeat count.
+    const double MIN_SAMPLE_SECONDS = 0.02;
+    double first_run = simulate(config, builder, image, output_addr, expected_first, result);
+    int repeats = static_cast<int>(std::min(1e6, std::max(1.0, MIN_SAMPLE_SECONDS / std::max(first_run, 1e-9))));
+
+    result.workload = name;
+    for (int run = 1; run < std::max(warmup, 1) + runs; ++run) {
+        double seconds = 0.0;
+        // The last run, after warmup, checks the whole output.
+        bool last = run + 1 == std::max(warmup, 1) + runs;
+        for (int i = 0; i < repeats; ++i) {
+            seconds += simulate(config, builder, image, output_addr, expected_first, result,
+                                last && i + 1 == repeats ? &expected : nullptr);
+        }
+        if (run >= warmup) result.seconds.push_back(seconds / repeats);
+    }
+    std::sort(result.seconds.begin(), result.seconds.end());
+    return true;
+}
+
+bool load_baseline(const std::string& filepath, std::map<std::string, BaselineEntry>& baseline) {
+    std::ifstream file(filepath);
+    if (!file.is_open()) { std::cerr << "ERROR: Bad baseline file: " << filepath << std::endl; return false; }
+    std::string line;
+    while (std::getline(file, line)) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        std::string name;
+        BaselineEntry entry;
+        if (!(fields >> name)) continue;
+        if (!(fields >> entry.cycles >> entry.cycles_per_second >> entry.macs_per_second)) {
+            std::cerr << "ERROR: " << filepath << ": expected workload cycles cycles_per_sec macs_per_sec" << std::endl;
+            return false;
+        }
+        baseline[name] = entry;
+    }
+    return true;
+}
+
+bool write_baseline(const std::string& filepath, const std::vector<BenchResult>& results) {
+    std::ofstream file(filepath);
+    if (!file) { std::cerr << "ERROR: Cannot write " << filepath << std::endl; return false; }
+    file << "# tpu_bench baseline: workload, simulated cycles, median cycles/s, median MACs/s\n";
+    file << std::setprecision(6);
+    for (const auto& r : results) {
+        file << r.workload << " " << r.cycles << " " << r.cycles_per_second() << " " << r.macs_per_second() << "\n";
+    }
+    return file.good();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::vector<std::string> workloads;
+    bool full = false;
+    int runs = 5, warmup = 1;
+    double threshold = 10.0;
+    std::string baseline_path, write_baseline_path;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool ok = true;
+        try {
+            if (arg.rfind("--workload=", 0) == 0) {
+                workloads.push_back(arg.substr(11));
+            } else if (arg == "--full") {
+                full = true;
+            } else if (arg.rfind("--runs=", 0) == 0) {
+                runs = std::stoi(arg.substr(7));
+                ok = runs > 0;
+            } else if (arg.rfind("--warmup=", 0) == 0) {
+                warmup = std::stoi(arg.substr(9));
+                ok = warmup >= 0;
+            } else if (arg.rfind("--baseline=", 0) == 0) {
+                baseline_path = arg.substr(11);
+            } else if (arg.rfind("--threshold=", 0) == 0) {
+                threshold = std::stod(arg.substr(12));
+            } else if (arg.rfind("--write-baseline=", 0) == 0) {
+                write_baseline_path = arg.substr(17);
+            } else {
+                ok = false;
+            }
+        } catch (const std::exception&) {
+            ok = false;
+        }
+        if (!ok) {
+            std::cerr << "Usage: " << argv[0] << " [--workload=NAME]... [--full] [--runs=N] [--warmup=N]"
+                      << " [--baseline=FILE [--threshold=PCT]] [--write-baseline=FILE]" << std::endl;
+            return 1;
+        }
+    }
+    if (workloads.empty()) {
+        workloads = {"demo", "gemm256", "gemm1024", "mlp1024", "membound", "compbound"};
+        if (full) workloads.push_back("gemm4096");
+    }
+    std::map<std::string, BaselineEntry> baseline;
+    if (!baseline_path.empty() && !load_baseline(baseline_path, baseline)) return 1;
+
+    std::vector<BenchResult> results;
+    bool failed = false;
+    std::cout << std::left << std::setw(12) << "workload" << std::right << std::setw(12) << "sim cycles"
+              << std::setw(11) << "median ms" << std::setw(10) << "p10 ms" << std::setw(10) << "p90 ms"
+              << std::setw(12) << "Mcycles/s" << std::setw(10) << "GMAC/s" << "  check" << std::endl;
+    for (const auto& name : workloads) {
+        results.emplace_back();
+        BenchResult& r = results.back();
+        if (!run_workload(name, warmup, runs, r)) return 1;
+        std::cout << std::left << std::setw(12) << name << std::right << std::setw(12) << r.cycles
+                  << std::fixed << std::setprecision(2) << std::setw(11) << r.median() * 1e3
+                  << std::setw(10) << r.percentile(10) * 1e3 << std::setw(10) << r.percentile(90) * 1e3
+                  << std::setw(12) << r.cycles_per_second() / 1e6 << std::setw(10) << r.macs_per_second() / 1e9
+                  << "  " << (r.correct ? "OK" : "MISMATCH");
+        failed |= !r.correct;
+
+        auto base = baseline.find(name);
+        if (base != baseline.end()) {
+            double ratio = r.cycles_per_second() / base->second.cycles_per_second;
+            std::cout << std::setprecision(1) << "  " << (ratio - 1.0) * 100.0 << " % vs baseline";
+            if (ratio < 1.0 - threshold / 100.0) {
+                std::cout << " REGRESSION";
+                failed = true;
+            }
+            if (r.cycles != base->second.cycles) std::cout << " (simulated cycles were " << base->second.cycles << ")";
+        } else if (!baseline_path.empty()) {
+            std::cout << "  (not in baseline)";
+        }
+        std::cout << std::endl;
+    }
+
+    if (!write_baseline_path.empty() && !write_baseline(write_baseline_path, results)) return 1;
+    return failed ? 1 : 0;
+}
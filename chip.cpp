@@ -0,0 +1,153 @@
+#include "chip.h"
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+Chip::Chip(size_t num_cores, const TPUConfig& core_config, uint32_t port_bytes_per_cycle)
+    : config(core_config), host_memory(core_config.host_memory_mb * 1024 * 1024), port(port_bytes_per_cycle),
+      barrier(static_cast<uint32_t>(num_cores)), running(num_cores), cycle(0), fast_forward(true) {
+    // Per-instruction messages would interleave without saying which core
+    // they came from; the chip prints its own.
+    TPUConfig quiet = core_config;
+    quiet.verbose = false;
+    for (size_t i = 0; i < num_cores; ++i) {
+        cores.emplace_back(new TPU(quiet));
+        cores.back()->attach_to_chip(host_memory, port, barrier);
+        cores.back()->set_fast_forward(false);
+    }
+    if (config.verbose) std::cout << "--- Booting C++ TPU Simulator: " << num_cores << " cores ---" << std::endl;
+}
+
+void Chip::map_host_image(const HostMemory::Image& image) {
+    if (image->size() > host_memory.size()) { std::cerr << "ERROR: Memory image too big!" << std::endl; return; }
+    host_memory.map_image(image);
+}
+
+void Chip::read_host_memory(uint64_t addr, uint8_t* out, size_t length) const {
+    host_memory.read(addr, out, length);
+}
+
+void Chip::tick() {
+    cycle++;
+    const size_t n = cores.size();
+    for (size_t i = 0; i < n; ++i) {
+        size_t index = (cycle + i) % n;
+        TPU& core = *cores[index];
+        if (core.is_halted()) continue;
+        core.tick();
+        if (core.is_halted()) {
+            running--;
+            barrier.cores--;
+            if (config.verbose) std::cout << "CYCLE " << cycle << ": core " << index << " halted" << std::endl;
+        }
+    }
+    // Waiting cores see a release next cycle, whichever order they ticked in.
+    if (barrier.end_cycle() || !fast_forward) return;
+
+    // Nothing can change until the earliest busy unit on any core completes;
+    // a core with nothing busy is waiting at SYNC for those that are.
+    int skip = -1;
+    for (const auto& core : cores) {
+        if (core->is_halted()) continue;
+        int ahead = core->stalled_cycles_ahead();
+        if (ahead == 0) return;
+        if (ahead > 0 && (skip < 0 || ahead < skip)) skip = ahead;
+    }
+    if (skip <= 0) return;
+    for (auto& core : cores) {
+        if (!core->is_halted()) core->skip_cycles(skip);
+    }
+    cycle += skip;
+}
+
+void Chip::print_performance_report() const {
+    std::cout << "\n--- CHIP PERFORMANCE REPORT ---" << std::endl;
+    if (cycle == 0) {
+        std::cout << "No operations performed." << std::endl;
+        return;
+    }
+    const double array_pes = static_cast<double>(config.array_size) * config.array_size;
+    uint64_t instructions = 0, macs = 0, skipped_macs = 0, mxu_busy = 0, host_bytes = 0, arbitration = 0, sync_wait = 0;
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "Chip: " << cores.size() << " cores, host port ";
+    if (port.get_bytes_per_cycle()) {
+        std::cout << port.get_bytes_per_cycle() << " B/cycle";
+    } else {
+        std::cout << "unlimited";
+    }
+    std::cout << std::endl;
+    std::cout << "  Total Cycles:       " << cycle << std::endl;
+
+    std::cout << "\nPer Core:" << std::endl;
+    std::cout << "  core    cycles  instrs  stall %  MXU %   PE %  host bytes  arb delay  sync wait" << std::endl;
+    for (size_t i = 0; i < cores.size(); ++i) {
+        const TPU& core = *cores[i];
+        const TPU::PerformanceStats& s = core.get_stats();
+        uint64_t sync = s.unit_stall_cycles[static_cast<int>(StallUnit::SYNC)];
+        std::cout << "  " << std::setw(4) << i << std::setw(10) << s.total_cycles << std::setw(8) << s.instruction_count
+                  << std::setw(9) << (s.total_cycles ? 100.0 * s.stall_cycles / s.total_cycles : 0.0)
+                  << std::setw(7) << 100.0 * s.mxu_busy_cycles / cycle
+                  << std::setw(7) << 100.0 * core.get_mac_count() / (array_pes * cycle)
+                  << std::setw(12) << core.get_dma_bytes() << std::setw(11) << core.get_dma_arbitration_cycles()
+                  << std::setw(11) << sync << std::endl;
+        instructions += s.instruction_count;
+        macs += core.get_mac_count();
+        skipped_macs += core.get_skipped_mac_count();
+        mxu_busy += s.mxu_busy_cycles;
+        host_bytes += core.get_dma_bytes();
+        arbitration += core.get_dma_arbitration_cycles();
+        sync_wait += sync;
+    }
+
+    const double core_cycles = static_cast<double>(cycle) * cores.size();
+    std::cout << "\nAggregate:" << std::endl;
+    std::cout << "  Instructions Exec:  " << instructions << std::endl;
+    std::cout << "  MXU Utilization:    " << 100.0 * mxu_busy / core_cycles << " % of core-cycles" << std::endl;
+    std::cout << "  PE Utilization:     " << 100.0 * macs / (array_pes * core_cycles) << " % of core-cycles" << std::endl;
+    if (skipped_macs) {
+        std::cout << "  MACs Skipped:       " << skipped_macs << " (zero weight blocks, "
+                  << 100.0 * skipped_macs / (macs + skipped_macs) << " % of dense)" << std::endl;
+    }
+    std::cout << "  Sync Wait:          " << sync_wait << " core-cycles" << std::endl;
+
+    double achieved_bw = static_cast<double>(host_bytes) / cycle;
+    std::cout << "\nHost Port Arbitration:" << std::endl;
+    std::cout << "  Transfers Granted:  " << port.get_grants() << std::endl;
+    std::cout << "  Bytes Transferred:  " << host_bytes << " (" << achieved_bw << " B/cycle)" << std::endl;
+    if (port.get_bytes_per_cycle()) {
+        std::cout << "  Port Busy:          " << port.get_busy_cycles() << " cycles ("
+                  << 100.0 * port.get_busy_cycles() / cycle << " %)" << std::endl;
+    }
+    std::cout << "  Arbitration Delay:  " << arbitration << " transfer-cycles";
+    if (port.get_grants()) std::cout << ", " << static_cast<double>(arbitration) / port.get_grants() << " per transfer";
+    std::cout << std::endl;
+
+    double total_time_sec = cycle / (config.clock_mhz * 1e6);
+    std::cout << "\nPerformance (Assuming " << config.clock_mhz << " MHz Clock):" << std::endl;
+    std::cout << "  Total Operations (MACs): " << static_cast<double>(macs) << std::endl;
+    std::cout << "  Total Time:          " << total_time_sec * 1e6 << " us" << std::endl;
+    std::cout << "  Effective GOPS:      " << macs * 2.0 / total_time_sec / 1e9 << std::endl;
+    std::cout << "--- END OF REPORT ---" << std::endl;
+}
+
+bool Chip::write_stats_json(const std::string& filepath) const {
+    std::ofstream out(filepath);
+    if (!out) {
+        std::cerr << "ERROR: Cannot write " << filepath << std::endl;
+        return false;
+    }
+    out << "{\n  \"cycles\": " << cycle << ",\n  \"host_port\": {\"bytes_per_cycle\": " << port.get_bytes_per_cycle()
+        << ", \"busy_cycles\": " << port.get_busy_cycles() << ", \"grants\": " << port.get_grants()
+        << ", \"arbitration_cycles\": " << port.get_wait_cycles() << "},\n  \"cores\": [";
+    for (size_t i = 0; i < cores.size(); ++i) {
+        const TPU& core = *cores[i];
+        const TPU::PerformanceStats& s = core.get_stats();
+        out << (i ? "," : "") << "\n    {\"cycles\": " << s.total_cycles << ", \"instructions\": " << s.instruction_count
+            << ", \"stall_cycles\": " << s.stall_cycles << ", \"mxu_busy_cycles\": " << s.mxu_busy_cycles
+            << ", \"macs\": " << core.get_mac_count() << ", \"host_bytes\": " << core.get_dma_bytes()
+            << ", \"arbitration_cycles\": " << core.get_dma_arbitration_cycles()
+            << ", \"sync_cycles\": " << s.unit_stall_cycles[static_cast<int>(StallUnit::SYNC)] << "}";
+    }
+    out << "\n  ]\n}\n";
+    return out.good();
+}
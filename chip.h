@@ -0,0 +1,45 @@
+#pragma once
+#include "tpu.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// Several TPU cores on one chip. Each core has its own controller, program,
+// UB, weight FIFO, MXU, accumulator and DMA engine. They share host memory
+// through one HostPort and meet at SYNC instructions on a common barrier.
+// Cores tick in lockstep, and the core that ticks first rotates every
+// cycle, so port requests made in the same cycle are granted round robin.
+class Chip {
+public:
+    // port_bytes_per_cycle == 0: the shared port never limits, only each
+    // core's own DMA channel does.
+    Chip(size_t num_cores, const TPUConfig& core_config, uint32_t port_bytes_per_cycle);
+    size_t size() const { return cores.size(); }
+    TPU& core(size_t index) { return *cores[index]; }
+    const TPU& core(size_t index) const { return *cores[index]; }
+    // The shared host memory image, mapped copy-on-write as for one TPU.
+    void map_host_image(const HostMemory::Image& image);
+    void read_host_memory(uint64_t addr, uint8_t* out, size_t length) const;
+
+    void tick();
+    bool is_halted() const { return running == 0; }
+    uint64_t get_cycle_count() const { return cycle; }
+    // Skips cycles in which every running core is stalled, by the fewest
+    // any of them could skip alone. Cores never fast-forward on their own:
+    // they would fall out of lockstep.
+    void set_fast_forward(bool enabled) { fast_forward = enabled; }
+    // Per-core and aggregate utilization, and time lost to arbitration for
+    // the host port and waiting at SYNC.
+    void print_performance_report() const;
+    bool write_stats_json(const std::string& filepath) const;
+
+private:
+    TPUConfig config;
+    HostMemory host_memory;
+    HostPort port;
+    SyncBarrier barrier;
+    std::vector<std::unique_ptr<TPU>> cores;
+    size_t running;
+    uint64_t cycle;
+    bool fast_forward;
+};
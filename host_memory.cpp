@@ -0,0 +1,149 @@
+#include "host_memory.h"
+#include "alloc_counter.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const uint8_t zero_page[HostMemory::PAGE_BYTES] = {};
+
+HostImage::HostImage() : base(nullptr), length(0), mapping(nullptr) {}
+
+HostImage::HostImage(std::vector<uint8_t> data)
+    : bytes(std::move(data)), base(bytes.data()), length(bytes.size()), mapping(nullptr) {}
+
+HostImage::~HostImage() {
+    if (mapping) munmap(mapping, length);
+}
+
+std::shared_ptr<const HostImage> HostImage::map_file(const std::string& filepath) {
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) { std::cerr << "ERROR: Bad memory file: " << filepath << std::endl; return nullptr; }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        std::cerr << "ERROR: Failed to read memory file." << std::endl;
+        return nullptr;
+    }
+    std::shared_ptr<HostImage> image(new HostImage());
+    image->length = static_cast<size_t>(info.st_size);
+    if (image->length > 0) {
+        // Private and read-only: the file is never written, and every
+        // process mapping it shares the same page cache.
+        void* mapped = mmap(nullptr, image->length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            close(fd);
+            std::cerr << "ERROR: Cannot map memory file: " << filepath << std::endl;
+            return nullptr;
+        }
+        image->mapping = mapped;
+        image->base = static_cast<const uint8_t*>(mapped);
+    }
+    close(fd);
+    return image;
+}
+
+HostMemory::HostMemory(size_t size_bytes) : size_bytes(0), image_pages(0), copy_allocations(0) {
+    resize(size_bytes);
+}
+
+void HostMemory::resize(size_t new_size) {
+    size_bytes = new_size;
+    image.reset();
+    image_pages = 0;
+    image_tail.reset();
+    copies.clear();
+}
+
+void HostMemory::map_image(const Image& new_image) {
+    image = new_image;
+    image_pages = image->size() / PAGE_BYTES;
+    image_tail.reset();
+    copies.clear();
+    size_t tail = image->size() % PAGE_BYTES;
+    if (tail) {
+        image_tail.reset(new uint8_t[PAGE_BYTES]());
+        std::memcpy(image_tail.get(), image->data() + image_pages * PAGE_BYTES, tail);
+    }
+}
+
+const uint8_t* HostMemory::page(uint64_t index) const {
+    if (!copies.empty()) {
+        auto it = copies.find(index);
+        if (it != copies.end()) return it->second.get();
+    }
+    if (index < image_pages) return image->data() + index * PAGE_BYTES;
+    if (index == image_pages && image_tail) return image_tail.get();
+    return zero_page;
+}
+
+uint8_t* HostMemory::writable_page(uint64_t index) {
+    auto it = copies.find(index);
+    if (it != copies.end()) return it->second.get();
+    uint64_t allocations_before = heap_allocation_count();
+    std::unique_ptr<uint8_t[]> copy(new uint8_t[PAGE_BYTES]);
+    std::memcpy(copy.get(), page(index), PAGE_BYTES);
+    uint8_t* writable = copy.get();
+    copies.emplace(index, std::move(copy));
+    copy_allocations += heap_allocation_count() - allocations_before;
+    return writable;
+}
+
+void HostMemory::read(uint64_t addr, uint8_t* out, size_t length) const {
+    size_t in_range = addr < size_bytes ? std::min<uint64_t>(length, size_bytes - addr) : 0;
+    size_t done = 0;
+    while (done < in_range) {
+        uint64_t a = addr + done;
+        size_t offset = a % PAGE_BYTES;
+        size_t chunk = std::min(in_range - done, PAGE_BYTES - offset);
+        std::memcpy(out + done, page(a / PAGE_BYTES) + offset, chunk);
+        done += chunk;
+    }
+    if (length > in_range) std::memset(out + in_range, 0, length - in_range);
+}
+
+void HostMemory::write(uint64_t addr, const uint8_t* data, size_t length) {
+    size_t in_range = addr < size_bytes ? std::min<uint64_t>(length, size_bytes - addr) : 0;
+    size_t done = 0;
+    while (done < in_range) {
+        uint64_t a = addr + done;
+        size_t offset = a % PAGE_BYTES;
+        size_t chunk = std::min(in_range - done, PAGE_BYTES - offset);
+        std::memcpy(writable_page(a / PAGE_BYTES) + offset, data + done, chunk);
+        done += chunk;
+    }
+}
+
+void HostMemory::save(SnapshotWriter& out) const {
+    std::vector<uint64_t> dirty;
+    dirty.reserve(copies.size());
+    for (const auto& entry : copies) dirty.push_back(entry.first);
+    std::sort(dirty.begin(), dirty.end());
+    out.pod(static_cast<uint64_t>(size_bytes));
+    out.pod(static_cast<uint64_t>(dirty.size()));
+    for (uint64_t p : dirty) {
+        out.pod(p);
+        out.raw(copies.at(p).get(), PAGE_BYTES);
+    }
+}
+
+void HostMemory::load(SnapshotReader& in) {
+    if (in.get<uint64_t>() != size_bytes) {
+        in.fail();
+        return;
+    }
+    copies.clear();
+    uint64_t dirty = in.get<uint64_t>();
+    const uint64_t page_count = (size_bytes + PAGE_BYTES - 1) / PAGE_BYTES;
+    for (uint64_t i = 0; i < dirty && in.ok(); ++i) {
+        uint64_t p = in.get<uint64_t>();
+        if (p >= page_count) {
+            in.fail();
+            return;
+        }
+        in.raw(writable_page(p), PAGE_BYTES);
+    }
+}
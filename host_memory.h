@@ -0,0 +1,72 @@
+#pragma once
+#include "snapshot.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A read-only host memory image that any number of TPUs can share. The
+// bytes are either held in memory or come from a file mapped with mmap.
+// A mapped file is read from disk only as its pages are touched, so
+// opening a multi-GB model image costs nothing up front.
+class HostImage {
+public:
+    explicit HostImage(std::vector<uint8_t> bytes);
+    ~HostImage();
+    HostImage(const HostImage&) = delete;
+    HostImage& operator=(const HostImage&) = delete;
+    // Maps the file read-only. Prints an error and returns null on failure.
+    static std::shared_ptr<const HostImage> map_file(const std::string& filepath);
+
+    const uint8_t* data() const { return base; }
+    size_t size() const { return length; }
+
+private:
+    HostImage();
+    std::vector<uint8_t> bytes;
+    const uint8_t* base;
+    size_t length;
+    void* mapping;   // mmap'ed region, or null
+};
+
+// Host DRAM as fixed-size pages, allocated only when first written. Until
+// then a page reads from the mapped image, if any, or as zero. The image is
+// never modified: a write copies the page first. Sizing the memory, mapping
+// an image and reading untouched pages are all independent of the memory
+// size. Bytes past the end of the image read as zero; accesses past the end
+// of memory read as zero and drop writes, as the original host bus did.
+class HostMemory {
+public:
+    static const size_t PAGE_BYTES = 4096;
+    typedef std::shared_ptr<const HostImage> Image;
+
+    HostMemory(size_t size_bytes = 0);
+    void resize(size_t size_bytes);     // all zero, no image
+    void map_image(const Image& image); // shared, copy-on-write
+    size_t size() const { return size_bytes; }
+
+    void read(uint64_t addr, uint8_t* out, size_t length) const;
+    void write(uint64_t addr, const uint8_t* data, size_t length);
+    size_t private_pages() const { return copies.size(); }
+    // Heap allocations made by copy-on-write page copies, so the report's
+    // allocation counters can leave them out.
+    uint64_t page_copy_allocations() const { return copy_allocations; }
+
+    // A checkpoint holds only the pages written since resize or map_image.
+    // load expects the same resize or map_image to have been done.
+    void save(SnapshotWriter& out) const;
+    void load(SnapshotReader& in);
+
+private:
+    size_t size_bytes;
+    Image image;
+    uint64_t image_pages;   // whole pages read straight from the image
+    // The image's last page when it ends partway through one, zero-padded.
+    std::unique_ptr<uint8_t[]> image_tail;
+    std::unordered_map<uint64_t, std::unique_ptr<uint8_t[]>> copies;
+    uint64_t copy_allocations;
+
+    const uint8_t* page(uint64_t index) const;
+    uint8_t* writable_page(uint64_t index);
+};
@@ -5,14 +5,90 @@ enum class OpCode : uint8_t {
     RHM = 0x01,
     WHM = 0x02,
     RW  = 0x03,
-    MMC = 0x04,
+    MMC = 0x04,   // length = input bytes; any whole number of array rows
     ACT = 0x05,
+    CFG = 0x06,   // control register data_addr = host_addr (as int32)
+    SYNC = 0x07,  // waits for everything in flight, then for every core of the chip
+    CONV = 0x08,  // MMC whose input rows are patches of a UB feature map (CFG_CONV_*)
     HLT = 0xFF
 };
 
+// Bits of Instruction::flags.
+enum : uint8_t {
+    // MMC adds its result to the int32 values already at the accumulator
+    // address (read-modify-write) instead of overwriting them.
+    FLAG_MMC_ACCUMULATE = 0x01,
+    // MMC keeps the weights already latched in the MXU instead of popping
+    // the next tile from the weight FIFO.
+    FLAG_MMC_REUSE_WEIGHTS = 0x02,
+    // RW reads a compressed tile of length bytes (see compress_weight_tile):
+    // a mask of the tile's nonzero row blocks, then only their rows.
+    FLAG_RW_COMPRESSED = 0x04,
+    // ACT: the low bits pick an ActFunc.
+    ACT_FUNC_MASK = 0x0F,
+    // ACT requantizes to int8 and writes length bytes to the UB at host_addr
+    // instead of leaving int32 results in the accumulator.
+    FLAG_ACT_TO_UB = 0x80
+};
+
+// Activation functions, applied to the int32 accumulator values. ACT_RELU
+// is 0 so older binaries keep their in-place ReLU. The sigmoid and tanh
+// tables take the requantized value as a real number q/16 and return int8
+// with scale 1/256, zero point -128 (sigmoid) or scale 1/128 (tanh).
+enum ActFunc : uint8_t {
+    ACT_RELU = 0,
+    ACT_NONE = 1,
+    ACT_RELU6 = 2,       // clamp to [0, CFG_ACT_RELU6_MAX]
+    ACT_CLIP = 3,        // clamp to [CFG_ACT_CLIP_MIN, CFG_ACT_CLIP_MAX]
+    ACT_LEAKY_RELU = 4,  // negative values times CFG_ACT_LEAKY_SLOPE
+    ACT_SIGMOID = 5,
+    ACT_TANH = 6,
+    ACT_FUNC_COUNT
+};
+
+// Control registers written by CFG. An ACT uses the values set by the CFGs
+// before it in program order. Requantization to int8 is
+// clamp(round(x * multiplier / 2^shift) + zero_point, -128, 127).
+enum ConfigRegister : uint32_t {
+    CFG_ACT_MULTIPLIER = 0,   // default 1
+    CFG_ACT_SHIFT = 1,        // 0..31, default 0
+    CFG_ACT_ZERO_POINT = 2,   // default 0
+    CFG_ACT_CLIP_MIN = 3,     // accumulator units, default -128
+    CFG_ACT_CLIP_MAX = 4,     // default 127
+    CFG_ACT_RELU6_MAX = 5,    // 6.0 in accumulator units, default 6
+    CFG_ACT_LEAKY_SLOPE = 6,  // Q16, default 655 (0.01)
+    // Convolution geometry for CONV. The input is one int8 NHWC feature map;
+    // all default to 0 except kernel size and stride, which default to 1.
+    CFG_CONV_HEIGHT = 7,
+    CFG_CONV_WIDTH = 8,
+    CFG_CONV_CHANNELS = 9,     // a multiple of the array size
+    CFG_CONV_KERNEL_H = 10,
+    CFG_CONV_KERNEL_W = 11,
+    CFG_CONV_STRIDE = 12,
+    CFG_CONV_PAD = 13,         // zero padding on every side
+    CFG_CONV_FIRST_PIXEL = 14, // output pixel (row-major) of CONV's first input row
+    CFG_REGISTER_COUNT
+};
+
+// 16 bytes, little endian. flags and host_addr_hi occupy what used to be
+// padding after the opcode, so older binaries decode with flags == 0 and
+// 32-bit host addresses.
+//
+// CONV is laid out like MMC: data_addr is the feature map's UB address,
+// host_addr the accumulator address, length the bytes of input rows (one
+// array row per output pixel) and flags the MMC flags. host_addr_hi picks
+// the array-size-wide slice of each kernel_h x kernel_w x channels patch,
+// taken in (kh, kw, c) order, that this CONV multiplies by its weight tile.
 struct Instruction {
     OpCode opcode;
+    uint8_t flags;
+    uint16_t host_addr_hi;   // RHM, RW, WHM: host address bits 32..47; CONV: patch slice
     uint32_t data_addr;
     uint32_t host_addr;
     uint32_t length;
 };
+
+// The 48-bit host address of an RHM, RW or WHM.
+inline uint64_t host_address(const Instruction& instr) {
+    return static_cast<uint64_t>(instr.host_addr_hi) << 32 | instr.host_addr;
+}
@@ -1,35 +1,413 @@
 #include "tpu.h"
+#include "chip.h"
+#include "program_builder.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
-#include <cstdlib>
+#include <stdexcept>
+#include <string>
 
-int main() {
-    std::cout << "--- Running Python Compiler ---" << std::endl;
-    int compiler_ret = std::system("python3 compiler.py");
-    if (compiler_ret != 0) {
-        std::cerr << "FATAL: Python compiler script failed!" << std::endl;
-        return 1;
+namespace {
+
+// Each core has its own UB, accumulator and issue queue.
+const uint64_t MAX_CORES = 256;
+// The trace ring buffer is allocated up front, 48 bytes a span.
+const uint64_t MAX_TRACE_SPANS = uint64_t(1) << 26;
+// Keeps the --sample instruction counts' sums from wrapping.
+const uint64_t MAX_SAMPLE_INSTRUCTIONS = uint64_t(1) << 40;
+// Each window's drain is counted in its CPI; shorter windows overestimate.
+const uint64_t MIN_SAMPLE_WINDOW = 50;
+
+// --cores=N: the workload split across a chip's cores, cycle-accurate.
+int run_chip(const TPUConfig& config, size_t num_cores, uint32_t port_bandwidth, const ProgramBuilder& builder,
+             bool fast_forward, uint64_t max_cycles, const std::string& stats_json_path) {
+    Chip chip(num_cores, config, port_bandwidth);
+    chip.set_fast_forward(fast_forward);
+    chip.map_host_image(builder.image());
+    const std::vector<Instruction> none;
+    for (size_t c = 0; c < num_cores; ++c) {
+        const std::vector<Instruction>& program = static_cast<int>(c) < builder.cores() ? builder.program(static_cast<int>(c)) : none;
+        chip.core(c).load_program(program);
+        std::cout << "Core " << c << ": " << program.size() << " instructions" << std::endl;
     }
-    std::cout << "--- Compiler finished ---\n" << std::endl;
-    
-    TPU my_tpu;
-    
-    my_tpu.load_program("program.bin");
-    my_tpu.load_host_memory("memory.bin");
 
-    std::cout << "\n--- RUNNING CYCLE-ACCURATE SIMULATION ---" << std::endl;
-    
-    while (!my_tpu.is_halted()) {
-        my_tpu.tick();
-        
-        if (my_tpu.get_cycle_count() > 5000000) { 
-            std::cout << "ERROR: Simulation timed out!" << std::endl;
-            break;
+    std::cout << "\n--- RUNNING CYCLE-ACCURATE SIMULATION (" << num_cores << " cores) ---" << std::endl;
+    try {
+        while (!chip.is_halted()) {
+            chip.tick();
+            if (chip.get_cycle_count() > max_cycles) {
+                std::cout << "ERROR: Simulation timed out!" << std::endl;
+                break;
+            }
         }
+    } catch (const std::out_of_range& e) {
+        std::cerr << "FATAL: " << e.what() << std::endl;
+        return 1;
     }
-    
     std::cout << "--- SIMULATION HALTED ---" << std::endl;
-    
-    my_tpu.print_performance_report();
+    chip.print_performance_report();
+    if (!stats_json_path.empty() && !chip.write_stats_json(stats_json_path)) return 1;
+    return 0;
+}
+
+// Nearest-rank percentile of sorted values.
+uint64_t percentile(const std::vector<uint64_t>& sorted, double p) {
+    size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+    return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+// --serve=FILE: one warm TPU answers a stream of requests read from FILE
+// ("-" for stdin) as they arrive. A request is the workload's input bytes;
+// each overwrites the input in host memory and reruns the program, whose
+// result goes to output_path if given. Latency runs from the request's
+// first cycle until its last host write has landed.
+int run_serve(TPUConfig config, const ProgramBuilder& builder, const std::string& input_path,
+              const std::string& output_path, bool fast_forward, uint64_t max_cycles,
+              const std::string& stats_json_path) {
+    std::ifstream input_file;
+    std::istream* input = &std::cin;
+    if (input_path != "-") {
+        input_file.open(input_path, std::ios::binary);
+        if (!input_file) { std::cerr << "ERROR: Cannot open " << input_path << std::endl; return 1; }
+        input = &input_file;
+    }
+    std::ofstream output;
+    if (!output_path.empty()) {
+        output.open(output_path, std::ios::binary);
+        if (!output) { std::cerr << "ERROR: Cannot write " << output_path << std::endl; return 1; }
+    }
+
+    // Per-instruction messages for every request would bury the report.
+    config.verbose = false;
+    TPU tpu(config);
+    tpu.set_fast_forward(fast_forward);
+    const std::vector<Instruction>& program = builder.program();
+    tpu.load_program(program);
+    tpu.map_host_image(builder.image());
+    // Registers set by leading CFGs persist, so only the first request runs
+    // them. A program with a serve entry also keeps its weights in the MXU.
+    uint32_t entry = builder.serve_entry();
+    if (entry == 0) {
+        while (entry < program.size() && program[entry].opcode == OpCode::CFG) entry++;
+    }
+
+    std::vector<uint8_t> request(builder.input_bytes()), result(builder.output_bytes());
+    std::vector<uint64_t> latencies;
+    std::cout << "\n--- SERVING (" << request.size() << " bytes in, " << result.size() << " bytes out per request) ---"
+              << std::endl;
+    auto host_start = std::chrono::steady_clock::now();
+    try {
+        while (input->read(reinterpret_cast<char*>(request.data()), request.size())) {
+            tpu.write_host_memory(builder.input_addr(), request.data(), request.size());
+            if (!latencies.empty()) tpu.restart(entry);
+            uint64_t begin = tpu.get_cycle_count();
+            while (!tpu.is_idle()) {
+                tpu.tick();
+                if (tpu.get_cycle_count() - begin > max_cycles) {
+                    std::cout << "ERROR: Request " << latencies.size() << " timed out!" << std::endl;
+                    return 1;
+                }
+            }
+            latencies.push_back(tpu.get_cycle_count() - begin);
+            if (output.is_open()) {
+                tpu.read_host_memory(builder.output_addr(), result.data(), result.size());
+                output.write(reinterpret_cast<const char*>(result.data()), result.size());
+                output.flush();
+            }
+        }
+    } catch (const std::out_of_range& e) {
+        std::cerr << "FATAL: " << e.what() << std::endl;
+        return 1;
+    }
+    double host_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - host_start).count();
+    if (input->gcount() > 0) {
+        std::cerr << "ERROR: Input ends with a partial request of " << input->gcount() << " bytes" << std::endl;
+    }
+    if (output.is_open() && !output) {
+        std::cerr << "ERROR: Cannot write " << output_path << std::endl;
+        return 1;
+    }
+    if (latencies.empty()) {
+        std::cout << "No requests." << std::endl;
+        return 0;
+    }
+
+    tpu.print_performance_report();
+    std::vector<uint64_t> sorted = latencies;
+    std::sort(sorted.begin(), sorted.end());
+    uint64_t total = 0;
+    for (uint64_t l : latencies) total += l;
+    const double cycle_us = 1.0 / config.clock_mhz;
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "\n--- SERVING REPORT ---" << std::endl;
+    std::cout << "  Requests:           " << latencies.size() << std::endl;
+    std::cout << "  Latency (cycles):   mean " << static_cast<double>(total) / latencies.size() << ", p50 "
+              << percentile(sorted, 0.50) << ", p99 " << percentile(sorted, 0.99) << ", max " << sorted.back() << std::endl;
+    std::cout << "  Latency (us):       p50 " << percentile(sorted, 0.50) * cycle_us << ", p99 "
+              << percentile(sorted, 0.99) * cycle_us << " (at " << config.clock_mhz << " MHz)" << std::endl;
+    std::cout << "  First Request:      " << latencies.front() << " cycles" << std::endl;
+    std::cout << "  Throughput:         " << latencies.size() / (total * cycle_us * 1e-6) << " requests/s simulated" << std::endl;
+    std::cout << "  Host Time:          " << host_seconds * 1e3 << " ms (" << host_seconds * 1e6 / latencies.size()
+              << " us per request)" << std::endl;
+    std::cout << "--- END OF REPORT ---" << std::endl;
+    if (!stats_json_path.empty() && !tpu.write_stats_json(stats_json_path)) return 1;
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bool fast_forward = true;
+    bool use_binaries = false;
+    bool emit_binaries = false;
+    std::string workload = "demo";
+    std::string trace_path;
+    std::string stats_json_path;
+    size_t trace_spans = 1 << 20;
+    uint64_t max_cycles = 5000000;
+    bool functional = false;
+    uint64_t sample_interval = 0, sample_window = 100, sample_warmup = 20;
+    std::string checkpoint_path, restore_path;
+    uint64_t checkpoint_at = 0;
+    size_t num_cores = 1;
+    int64_t port_bandwidth = -1;   // default: one core's DMA bandwidth
+    std::string serve_path, serve_output_path;
+    TPUConfig config;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool ok = true;
+        if (arg == "--no-fast-forward") {
+            fast_forward = false;
+        } else if (arg == "--no-compile") {
+            use_binaries = true;
+        } else if (arg == "--emit-bins") {
+            emit_binaries = true;
+        } else if (arg.rfind("--workload=", 0) == 0) {
+            workload = arg.substr(11);
+        } else if (arg.rfind("--config=", 0) == 0) {
+            ok = load_config_file(arg.substr(9), config);
+        } else if (arg.rfind("--set=", 0) == 0) {
+            size_t eq = arg.find('=', 6);
+            ok = eq != std::string::npos && set_config_value(config, arg.substr(6, eq - 6), arg.substr(eq + 1));
+        } else if (arg.rfind("--mxu-model=", 0) == 0) {
+            ok = set_config_value(config, "mxu_timing", arg.substr(12));
+        } else if (arg == "--zero-skip") {
+            config.mxu_zero_skip = true;
+        } else if (arg == "--in-order") {
+            config.issue_queue_depth = 0;
+        } else if (arg.rfind("--issue-queue=", 0) == 0) {
+            ok = set_config_value(config, "issue_queue_depth", arg.substr(14));
+        } else if (arg == "--dma=flat") {
+            config.dma = DmaConfig(100, 0, 0, 1);
+        } else if (arg.rfind("--dma-latency=", 0) == 0) {
+            ok = set_config_value(config, "dma_base_latency", arg.substr(14));
+        } else if (arg.rfind("--dma-bandwidth=", 0) == 0) {
+            ok = set_config_value(config, "dma_bytes_per_cycle", arg.substr(16));
+        } else if (arg.rfind("--dma-burst=", 0) == 0) {
+            ok = set_config_value(config, "dma_burst_bytes", arg.substr(12));
+        } else if (arg.rfind("--dma-outstanding=", 0) == 0) {
+            ok = set_config_value(config, "dma_max_outstanding", arg.substr(18));
+        } else if (arg.rfind("--trace=", 0) == 0) {
+            trace_path = arg.substr(8);
+        } else if (arg.rfind("--stats-json=", 0) == 0) {
+            stats_json_path = arg.substr(13);
+        } else if (arg.rfind("--trace-spans=", 0) == 0) {
+            uint64_t n = 0;
+            ok = parse_count(arg.substr(14), MAX_TRACE_SPANS, n) && n > 0;
+            trace_spans = static_cast<size_t>(n);
+        } else if (arg == "--functional") {
+            functional = true;
+        } else if (arg.rfind("--sample=", 0) == 0) {
+            // INTERVAL[:WINDOW[:WARMUP]], in instructions.
+            std::string spec = arg.substr(9);
+            size_t colon = spec.find(':');
+            ok = parse_count(spec.substr(0, colon), MAX_SAMPLE_INSTRUCTIONS, sample_interval);
+            if (ok && colon != std::string::npos) {
+                spec = spec.substr(colon + 1);
+                colon = spec.find(':');
+                ok = parse_count(spec.substr(0, colon), MAX_SAMPLE_INSTRUCTIONS, sample_window);
+                if (ok && colon != std::string::npos) ok = parse_count(spec.substr(colon + 1), MAX_SAMPLE_INSTRUCTIONS, sample_warmup);
+            }
+            if (ok && sample_window < MIN_SAMPLE_WINDOW) {
+                std::cerr << "ERROR: --sample WINDOW must be at least " << MIN_SAMPLE_WINDOW << " instructions" << std::endl;
+                ok = false;
+            }
+            ok = ok && sample_interval > 0;
+        } else if (arg.rfind("--checkpoint=", 0) == 0) {
+            checkpoint_path = arg.substr(13);
+        } else if (arg.rfind("--checkpoint-at=", 0) == 0) {
+            ok = parse_count(arg.substr(16), UINT64_MAX, checkpoint_at);
+        } else if (arg.rfind("--restore=", 0) == 0) {
+            restore_path = arg.substr(10);
+        } else if (arg.rfind("--cores=", 0) == 0) {
+            uint64_t n = 0;
+            ok = parse_count(arg.substr(8), MAX_CORES, n) && n > 0;
+            num_cores = static_cast<size_t>(n);
+        } else if (arg.rfind("--host-port-bandwidth=", 0) == 0) {
+            uint64_t b = 0;
+            ok = parse_count(arg.substr(22), UINT32_MAX, b);
+            port_bandwidth = static_cast<int64_t>(b);
+        } else if (arg.rfind("--serve=", 0) == 0) {
+            serve_path = arg.substr(8);
+        } else if (arg.rfind("--serve-output=", 0) == 0) {
+            serve_output_path = arg.substr(15);
+        } else if (arg.rfind("--max-cycles=", 0) == 0) {
+            ok = parse_count(arg.substr(13), UINT64_MAX, max_cycles);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            std::cerr << "Usage: " << argv[0] << " [--workload=demo [--emit-bins] | --no-compile]"
+                      << " [--config=FILE] [--set=key=value]..."
+                      << " [--no-fast-forward] [--mxu-model=fixed|wavefront] [--zero-skip]"
+                      << " [--in-order | --issue-queue=N] [--trace=FILE [--trace-spans=N]] [--stats-json=FILE] [--max-cycles=N]"
+                      << " [--functional | --sample=INTERVAL[:WINDOW[:WARMUP]]]"
+                      << " [--restore=FILE] [--checkpoint=FILE [--checkpoint-at=CYCLE]]"
+                      << " [--cores=N [--host-port-bandwidth=B]] [--serve=FILE|- [--serve-output=FILE]]"
+                      << " [--dma=flat | --dma-latency=N --dma-bandwidth=B --dma-burst=B --dma-outstanding=N]" << std::endl;
+            return 1;
+        }
+    }
+    if (num_cores > 1 && (use_binaries || emit_binaries || functional || sample_interval || !trace_path.empty() ||
+                          !checkpoint_path.empty() || !restore_path.empty())) {
+        std::cerr << "ERROR: --cores runs built-in workloads cycle-accurately only; it does not combine with"
+                  << " --no-compile, --emit-bins, --functional, --sample, --trace or checkpoints" << std::endl;
+        return 1;
+    }
+    if (!checkpoint_path.empty() && (functional || sample_interval)) {
+        std::cerr << "ERROR: --checkpoint saves cycle-accurate state; it does not combine with --functional or --sample"
+                  << std::endl;
+        return 1;
+    }
+    if (!serve_path.empty() && (use_binaries || num_cores > 1 || functional || sample_interval || !trace_path.empty() ||
+                                !checkpoint_path.empty() || !restore_path.empty())) {
+        std::cerr << "ERROR: --serve runs a built-in workload on one core, cycle-accurately; it does not combine with"
+                  << " --no-compile, --cores, --functional, --sample, --trace or checkpoints" << std::endl;
+        return 1;
+    }
+
+    ProgramBuilder builder;
+    int32_t expected_first = 0;
+    if (!use_binaries) {
+        if (!check_builtin_array_size(config.array_size, workload)) return 1;
+        std::cout << "--- Building Program: " << workload << " ---" << std::endl;
+        if (!build_workload(workload, builder, &expected_first, nullptr, static_cast<int>(num_cores))) {
+            std::cerr << "FATAL: Unknown workload: " << workload << std::endl;
+            return 1;
+        }
+        if (emit_binaries && !builder.write_files("program.bin", "memory.bin")) return 1;
+        config.host_memory_mb = std::max(config.host_memory_mb, builder.host_memory_mb());
+    }
+    if (!serve_path.empty()) {
+        return run_serve(config, builder, serve_path, serve_output_path, fast_forward, max_cycles, stats_json_path);
+    }
+    if (num_cores > 1) {
+        std::cout << "Reference result: first output element -> " << expected_first << std::endl;
+        uint32_t port = port_bandwidth < 0 ? config.dma.bytes_per_cycle : static_cast<uint32_t>(port_bandwidth);
+        return run_chip(config, num_cores, port, builder, fast_forward, max_cycles, stats_json_path);
+    }
+
+    TPU my_tpu(config);
+    my_tpu.set_fast_forward(fast_forward);
+    if (!trace_path.empty()) my_tpu.enable_trace(trace_spans);
+
+    if (use_binaries) {
+        // Run whatever compiler.py (or --emit-bins) last wrote.
+        my_tpu.load_program("program.bin");
+        my_tpu.load_host_memory("memory.bin");
+    } else {
+        my_tpu.load_program(builder.program());
+        my_tpu.map_host_image(builder.image());
+        std::cout << "Built " << builder.program().size() << " instructions, "
+                  << builder.memory().size() << " bytes of host memory image" << std::endl;
+        std::cout << "Reference result: first output element -> " << expected_first << std::endl;
+    }
+
+    // The restoring run rebuilds the same program and image, then picks up
+    // where the checkpoint left off under its own timing config.
+    if (!restore_path.empty()) {
+        if (!my_tpu.load_checkpoint(restore_path)) return 1;
+        std::cout << "Restored checkpoint " << restore_path << " at cycle " << my_tpu.get_cycle_count() << std::endl;
+    }
+
+    if (functional || sample_interval) {
+        std::cout << "\n--- RUNNING " << (functional ? "FUNCTIONAL SIMULATION (no timing)" : "SAMPLED SIMULATION")
+                  << " ---" << std::endl;
+        TPU::SampledTiming sampled = {};
+        try {
+            if (functional) {
+                my_tpu.run_functional();
+            } else {
+                sampled = my_tpu.run_sampled(sample_interval, sample_window, sample_warmup, max_cycles);
+            }
+        } catch (const std::out_of_range& e) {
+            std::cerr << "FATAL: " << e.what() << std::endl;
+            return 1;
+        }
+        std::cout << "--- SIMULATION HALTED ---" << std::endl;
+        if (functional) {
+            std::cout << "\nFunctional Run: " << my_tpu.get_stats().instruction_count << " instructions, "
+                      << my_tpu.get_mac_count() << " MACs" << std::endl;
+        } else {
+            if (!sampled.complete) std::cout << "ERROR: Simulation timed out!" << std::endl;
+            std::cout << std::fixed << std::setprecision(2);
+            std::cout << "\nSampled Timing (every " << sample_interval << " instructions, " << sample_warmup
+                      << " warmup + " << sample_window << " measured):" << std::endl;
+            std::cout << "  Windows:            " << sampled.windows << " (" << sampled.measured_instructions << " of "
+                      << sampled.instructions << " instructions measured)" << std::endl;
+            std::cout << "  CPI:                " << sampled.cpi;
+            if (sampled.cpi_error > 0.0) std::cout << " +/- " << sampled.cpi_error * 100.0 << " % (95 %)";
+            if (sampled.exact) std::cout << " (exact: ran in full detail)";
+            std::cout << std::endl;
+            if (!sampled.exact && sampled.windows < 2) {
+                std::cout << "  Warning: " << sampled.windows << " window, no confidence interval" << std::endl;
+            }
+            std::cout << "  Estimated Cycles:   " << sampled.estimated_cycles << std::endl;
+            std::cout << "  Cycles Simulated in Detail: " << sampled.detailed_cycles << std::endl;
+        }
+    } else {
+        std::cout << "\n--- RUNNING CYCLE-ACCURATE SIMULATION ---" << std::endl;
+
+        try {
+            while (!my_tpu.is_halted()) {
+                // Fast-forward can step over checkpoint_at; save at the first
+                // cycle boundary at or after it.
+                if (!checkpoint_path.empty() && my_tpu.get_cycle_count() >= checkpoint_at) {
+                    if (!my_tpu.save_checkpoint(checkpoint_path)) return 1;
+                    std::cout << "Checkpoint written to " << checkpoint_path << " at cycle "
+                              << my_tpu.get_cycle_count() << std::endl;
+                    checkpoint_path.clear();
+                }
+                my_tpu.tick();
+
+                if (my_tpu.get_cycle_count() > max_cycles) {
+                    std::cout << "ERROR: Simulation timed out!" << std::endl;
+                    break;
+                }
+            }
+        } catch (const std::out_of_range& e) {
+            std::cerr << "FATAL: " << e.what() << std::endl;
+            return 1;
+        }
+
+        std::cout << "--- SIMULATION HALTED ---" << std::endl;
+
+        my_tpu.print_performance_report();
+        if (!checkpoint_path.empty()) {
+            std::cerr << "ERROR: Run stopped at cycle " << my_tpu.get_cycle_count() << ", before --checkpoint-at="
+                      << checkpoint_at << "; no checkpoint written" << std::endl;
+            return 1;
+        }
+    }
+
+    if (!stats_json_path.empty() && !my_tpu.write_stats_json(stats_json_path)) return 1;
+    if (!trace_path.empty()) {
+        if (!my_tpu.write_trace(trace_path)) return 1;
+        std::cout << "Trace written to " << trace_path << std::endl;
+    }
     
     return 0;
 }
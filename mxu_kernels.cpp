@@ -0,0 +1,299 @@
+#include "mxu_kernels.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TPU_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+void gemm_s8s32_reference(const int8_t* inputs, const int8_t* weights, int32_t* results, int rows, int size) {
+    for (int i = 0; i < rows; ++i) {
+        for (int j = 0; j < size; ++j) {
+            int32_t sum = 0;
+            for (int k = 0; k < size; ++k) {
+                sum += static_cast<int32_t>(inputs[i * size + k]) * static_cast<int32_t>(weights[k * size + j]);
+            }
+            std::memcpy(results + i * size + j, &sum, sizeof(int32_t));
+        }
+    }
+}
+
+namespace {
+
+// --- Portable: row-at-a-time outer products the compiler can auto-vectorize.
+
+void pack_portable(const int8_t* weights, uint8_t* packed, int size) {
+    std::memcpy(packed, weights, static_cast<size_t>(size) * size);
+}
+
+// Every specialized size has 4-row blocks, which line up with the AVX2 row
+// pairs and the VNNI row quads.
+const int BLOCK_ROWS = 4;
+
+template <int N, bool SKIP>
+void multiply_portable(const int8_t* inputs, const uint8_t* packed, int32_t* results, int rows, int, uint64_t blocks) {
+    const int8_t* weights = reinterpret_cast<const int8_t*>(packed);
+    for (int i = 0; i < rows; ++i) {
+        int32_t acc[N] = {};
+        for (int k = 0; k < N; ++k) {
+            if (SKIP && !(blocks >> (k / BLOCK_ROWS) & 1)) continue;
+            int32_t a = inputs[i * N + k];
+            const int8_t* w_row = weights + k * N;
+            for (int j = 0; j < N; ++j) acc[j] += a * static_cast<int32_t>(w_row[j]);
+        }
+        std::memcpy(results + i * N, acc, sizeof(acc));
+    }
+}
+
+void multiply_portable_any(const int8_t* inputs, const uint8_t* packed, int32_t* results, int rows, int size) {
+    gemm_s8s32_reference(inputs, reinterpret_cast<const int8_t*>(packed), results, rows, size);
+}
+
+void multiply_portable_any_blocks(const int8_t* inputs, const uint8_t* packed, int32_t* results, int rows, int size,
+                                  uint64_t blocks) {
+    const int8_t* weights = reinterpret_cast<const int8_t*>(packed);
+    const int block_rows = sparse_block_rows(size);
+    std::memset(results, 0, static_cast<size_t>(rows) * size * sizeof(int32_t));
+    for (int k = 0; k < size; ++k) {
+        if (!(blocks >> (k / block_rows) & 1)) continue;
+        for (int i = 0; i < rows; ++i) {
+            int32_t a = inputs[i * size + k];
+            for (int j = 0; j < size; ++j) results[i * size + j] += a * static_cast<int32_t>(weights[k * size + j]);
+        }
+    }
+}
+
+#ifdef TPU_X86_KERNELS
+
+// --- AVX2: pmaddubsw saturates its int16 pair sums ((-128)*(-128) * 2
+// overflows), so weights are sign-extended to int16 and multiplied with
+// pmaddwd instead, which is exact. Packed layout: for every pair of weight rows
+// (k, k+1) and every 16-column block, two registers of interleaved
+// (w[k][j], w[k+1][j]) int16 pairs for columns {0-3, 8-11} and {4-7, 12-15}.
+
+__attribute__((target("avx2")))
+void pack_avx2(const int8_t* weights, uint8_t* packed, int size) {
+    __m256i* out = reinterpret_cast<__m256i*>(packed);
+    for (int k = 0; k < size; k += 2) {
+        for (int jb = 0; jb < size; jb += 16) {
+            __m256i w0 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(weights + k * size + jb)));
+            __m256i w1 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(weights + (k + 1) * size + jb)));
+            _mm256_storeu_si256(out++, _mm256_unpacklo_epi16(w0, w1));
+            _mm256_storeu_si256(out++, _mm256_unpackhi_epi16(w0, w1));
+        }
+    }
+}
+
+template <int N, bool SKIP>
+__attribute__((target("avx2")))
+void multiply_avx2(const int8_t* inputs, const uint8_t* packed, int32_t* results, int rows, int, uint64_t blocks) {
+    constexpr int COLS = N < 64 ? N : 64;   // columns per register block
+    constexpr int BLOCKS = COLS / 16;
+    const __m256i* wp = reinterpret_cast<const __m256i*>(packed);
+    for (int i = 0; i < rows; ++i) {
+        const int8_t* a_row = inputs + i * N;
+        for (int jc = 0; jc < N; jc += COLS) {
+            __m256i lo[BLOCKS], hi[BLOCKS];
+            for (int b = 0; b < BLOCKS; ++b) { lo[b] = _mm256_setzero_si256(); hi[b] = _mm256_setzero_si256(); }
+            for (int k = 0; k < N; k += 2) {
+                if (SKIP && !(blocks >> (k / BLOCK_ROWS) & 1)) continue;
+                uint32_t pair = static_cast<uint16_t>(a_row[k]) | (static_cast<uint32_t>(static_cast<uint16_t>(a_row[k + 1])) << 16);
+                __m256i a = _mm256_set1_epi32(static_cast<int32_t>(pair));
+                const __m256i* w = wp + ((k / 2) * (N / 16) + jc / 16) * 2;
+                for (int b = 0; b < BLOCKS; ++b) {
+                    lo[b] = _mm256_add_epi32(lo[b], _mm256_madd_epi16(a, _mm256_loadu_si256(w + 2 * b)));
+                    hi[b] = _mm256_add_epi32(hi[b], _mm256_madd_epi16(a, _mm256_loadu_si256(w + 2 * b + 1)));
+                }
+            }
+            int32_t* out = results + i * N + jc;
+            for (int b = 0; b < BLOCKS; ++b) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 16 * b), _mm256_permute2x128_si256(lo[b], hi[b], 0x20));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 16 * b + 8), _mm256_permute2x128_si256(lo[b], hi[b], 0x31));
+            }
+        }
+    }
+}
+
+// --- AVX-512 VNNI: vpdpbusd multiplies unsigned by signed bytes, so inputs
+// are biased by +128 and the bias is removed again by starting each column at
+// -128 * sum_k(w[k][j]). Packed layout: for every group of four weight rows
+// and every 16-column block, 64 bytes holding (w[k..k+3][j]) per int32 lane,
+// followed by the N int32 bias terms.
+
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+void pack_vnni(const int8_t* weights, uint8_t* packed, int size) {
+    __m128i* out = reinterpret_cast<__m128i*>(packed);
+    for (int k = 0; k < size; k += 4) {
+        for (int jb = 0; jb < size; jb += 16) {
+            const int8_t* w = weights + k * size + jb;
+            __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(w));
+            __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(w + size));
+            __m128i r2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(w + 2 * size));
+            __m128i r3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(w + 3 * size));
+            __m128i r01_lo = _mm_unpacklo_epi8(r0, r1), r01_hi = _mm_unpackhi_epi8(r0, r1);
+            __m128i r23_lo = _mm_unpacklo_epi8(r2, r3), r23_hi = _mm_unpackhi_epi8(r2, r3);
+            _mm_storeu_si128(out++, _mm_unpacklo_epi16(r01_lo, r23_lo));
+            _mm_storeu_si128(out++, _mm_unpackhi_epi16(r01_lo, r23_lo));
+            _mm_storeu_si128(out++, _mm_unpacklo_epi16(r01_hi, r23_hi));
+            _mm_storeu_si128(out++, _mm_unpackhi_epi16(r01_hi, r23_hi));
+        }
+    }
+    int32_t* bias = reinterpret_cast<int32_t*>(out);
+    for (int j = 0; j < size; ++j) bias[j] = 0;
+    for (int k = 0; k < size; ++k) {
+        for (int j = 0; j < size; ++j) bias[j] -= 128 * static_cast<int32_t>(weights[k * size + j]);
+    }
+}
+
+template <int N, bool SKIP>
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+void multiply_vnni(const int8_t* inputs, const uint8_t* packed, int32_t* results, int rows, int, uint64_t blocks) {
+    constexpr int COLS = N < 128 ? N : 128;
+    constexpr int BLOCKS = COLS / 16;
+    const __m512i* wp = reinterpret_cast<const __m512i*>(packed);
+    const int32_t* bias = reinterpret_cast<const int32_t*>(packed + static_cast<size_t>(N) * N);
+    for (int i = 0; i < rows; ++i) {
+        const int8_t* a_row = inputs + i * N;
+        for (int jc = 0; jc < N; jc += COLS) {
+            __m512i acc[BLOCKS];
+            for (int b = 0; b < BLOCKS; ++b) acc[b] = _mm512_loadu_si512(bias + jc + 16 * b);
+            for (int k = 0; k < N; k += 4) {
+                if (SKIP && !(blocks >> (k / BLOCK_ROWS) & 1)) continue;
+                uint32_t quad;
+                std::memcpy(&quad, a_row + k, sizeof(quad));
+                __m512i a = _mm512_set1_epi32(static_cast<int32_t>(quad ^ 0x80808080u));
+                const __m512i* w = wp + (k / 4) * (N / 16) + jc / 16;
+                for (int b = 0; b < BLOCKS; ++b) acc[b] = _mm512_dpbusd_epi32(acc[b], a, _mm512_loadu_si512(w + b));
+            }
+            for (int b = 0; b < BLOCKS; ++b) _mm512_storeu_si512(results + i * N + jc + 16 * b, acc[b]);
+        }
+    }
+}
+
+#endif // TPU_X86_KERNELS
+
+typedef void (*MultiplyBlocks)(const int8_t*, const uint8_t*, int32_t*, int, int, uint64_t);
+
+// The dense multiply: a kernel instantiated without block skipping.
+template <MultiplyBlocks F>
+void multiply_all(const int8_t* inputs, const uint8_t* packed, int32_t* results, int rows, int size) {
+    F(inputs, packed, results, rows, size, ~uint64_t(0));
+}
+
+template <int N>
+GemmKernel make_kernel(GemmIsa isa) {
+#ifdef TPU_X86_KERNELS
+    if (isa == GemmIsa::AVX512_VNNI) {
+        return GemmKernel{isa, N, static_cast<size_t>(N) * N + N * sizeof(int32_t), pack_vnni,
+                          multiply_all<multiply_vnni<N, false>>, multiply_vnni<N, true>};
+    }
+    if (isa == GemmIsa::AVX2) {
+        return GemmKernel{isa, N, static_cast<size_t>(N) * N * 2, pack_avx2,
+                          multiply_all<multiply_avx2<N, false>>, multiply_avx2<N, true>};
+    }
+#endif
+    return GemmKernel{GemmIsa::PORTABLE, N, static_cast<size_t>(N) * N, pack_portable,
+                      multiply_all<multiply_portable<N, false>>, multiply_portable<N, true>};
+}
+
+} // namespace
+
+GemmIsa detect_gemm_isa() {
+#ifdef TPU_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vnni")) {
+        return GemmIsa::AVX512_VNNI;
+    }
+    if (__builtin_cpu_supports("avx2")) return GemmIsa::AVX2;
+#endif
+    return GemmIsa::PORTABLE;
+}
+
+const char* gemm_isa_name(GemmIsa isa) {
+    switch (isa) {
+        case GemmIsa::AVX512_VNNI: return "avx512-vnni";
+        case GemmIsa::AVX2:        return "avx2";
+        default:                   return "portable";
+    }
+}
+
+GemmKernel select_gemm_kernel(int size, GemmIsa max_isa) {
+    static const GemmIsa host_isa = detect_gemm_isa();
+    GemmIsa isa = static_cast<int>(max_isa) < static_cast<int>(host_isa) ? max_isa : host_isa;
+    switch (size) {
+        case 16:  return make_kernel<16>(isa);
+        case 32:  return make_kernel<32>(isa);
+        case 64:  return make_kernel<64>(isa);
+        case 128: return make_kernel<128>(isa);
+        case 256: return make_kernel<256>(isa);
+        default:
+            return GemmKernel{GemmIsa::PORTABLE, size, static_cast<size_t>(size) * size,
+                              pack_portable, multiply_portable_any, multiply_portable_any_blocks};
+    }
+}
+
+int sparse_block_rows(int size) {
+    return std::max(4, (size + 63) / 64);
+}
+
+int sparse_blocks(int size) {
+    return (size + sparse_block_rows(size) - 1) / sparse_block_rows(size);
+}
+
+uint64_t nonzero_weight_blocks(const int8_t* weights, int size) {
+    const int block_rows = sparse_block_rows(size);
+    uint64_t blocks = 0;
+    for (int k = 0; k < size; ++k) {
+        const int8_t* row = weights + static_cast<size_t>(k) * size;
+        if (blocks >> (k / block_rows) & 1) continue;
+        for (int j = 0; j < size; ++j) {
+            if (row[j]) {
+                blocks |= uint64_t(1) << (k / block_rows);
+                break;
+            }
+        }
+    }
+    return blocks;
+}
+
+int nonzero_weight_rows(uint64_t blocks, int size) {
+    const int block_rows = sparse_block_rows(size);
+    int rows = 0;
+    for (int b = 0; b < sparse_blocks(size); ++b) {
+        if (blocks >> b & 1) rows += std::min(block_rows, size - b * block_rows);
+    }
+    return rows;
+}
+
+void compress_weight_tile(const int8_t* weights, int size, std::vector<uint8_t>& out) {
+    const uint64_t blocks = nonzero_weight_blocks(weights, size);
+    const size_t row_bytes = static_cast<size_t>(size);
+    out.resize(sizeof(blocks) + nonzero_weight_rows(blocks, size) * row_bytes);
+    std::memcpy(out.data(), &blocks, sizeof(blocks));
+    uint8_t* next = out.data() + sizeof(blocks);
+    for (int k = 0; k < size; ++k) {
+        if (!(blocks >> (k / sparse_block_rows(size)) & 1)) continue;
+        std::memcpy(next, weights + k * row_bytes, row_bytes);
+        next += row_bytes;
+    }
+}
+
+bool expand_weight_tile(const uint8_t* data, size_t length, int size, std::vector<uint8_t>& tile) {
+    uint64_t blocks;
+    if (length < sizeof(blocks)) return false;
+    std::memcpy(&blocks, data, sizeof(blocks));
+    const int block_count = sparse_blocks(size);
+    if (block_count < 64 && blocks >> block_count) return false;
+    const size_t row_bytes = static_cast<size_t>(size);
+    if (length != sizeof(blocks) + nonzero_weight_rows(blocks, size) * row_bytes) return false;
+    tile.assign(row_bytes * size, 0);
+    const uint8_t* next = data + sizeof(blocks);
+    for (int k = 0; k < size; ++k) {
+        if (!(blocks >> (k / sparse_block_rows(size)) & 1)) continue;
+        std::memcpy(tile.data() + k * row_bytes, next, row_bytes);
+        next += row_bytes;
+    }
+    return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Functional int8 x int8 -> int32 GEMM kernels behind the MXU model.
+//
+// A kernel multiplies `rows` x size int8 inputs (row-major) by a size x size
+// int8 weight tile and writes rows x size int32 results. Weights are first
+// repacked into the kernel's preferred layout with pack_weights(), so a tile
+// that stays in the array is only repacked when it changes. Every kernel is
+// bit-exact with the scalar reference.
+//
+// Pruned weights are handled in row blocks of sparse_block_rows(size) rows (4
+// for every specialized size, so a tile has at most 64 blocks). Bit b of a
+// block mask is set when block b holds a nonzero weight; multiply_blocks
+// skips the rows of the blocks that are clear, which must be all zero.
+
+enum class GemmIsa { PORTABLE, AVX2, AVX512_VNNI };
+
+struct GemmKernel {
+    GemmIsa isa;
+    int size;
+    size_t packed_weight_bytes;
+    void (*pack_weights)(const int8_t* weights, uint8_t* packed, int size);
+    void (*multiply)(const int8_t* inputs, const uint8_t* packed, int32_t* results, int rows, int size);
+    void (*multiply_blocks)(const int8_t* inputs, const uint8_t* packed, int32_t* results, int rows, int size,
+                            uint64_t blocks);
+};
+
+// Best ISA the host CPU supports.
+GemmIsa detect_gemm_isa();
+const char* gemm_isa_name(GemmIsa isa);
+
+// Kernels are specialized at compile time for 16, 32, 64, 128 and 256 wide
+// arrays; any other size gets a portable kernel. `max_isa` caps the dispatch
+// (e.g. to compare paths); it is further limited by detect_gemm_isa().
+GemmKernel select_gemm_kernel(int size, GemmIsa max_isa = GemmIsa::AVX512_VNNI);
+
+void gemm_s8s32_reference(const int8_t* inputs, const int8_t* weights, int32_t* results, int rows, int size);
+
+int sparse_block_rows(int size);
+int sparse_blocks(int size);
+uint64_t nonzero_weight_blocks(const int8_t* weights, int size);
+// Weight rows in the blocks set in blocks.
+int nonzero_weight_rows(uint64_t blocks, int size);
+
+// Compressed weight tile, as RW with FLAG_RW_COMPRESSED reads it: the
+// 8-byte little-endian block mask, then the rows of the nonzero blocks in
+// order. expand_weight_tile returns false unless length is exactly that.
+void compress_weight_tile(const int8_t* weights, int size, std::vector<uint8_t>& out);
+bool expand_weight_tile(const uint8_t* data, size_t length, int size, std::vector<uint8_t>& tile);
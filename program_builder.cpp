@@ -0,0 +1,563 @@
+#include "program_builder.h"
+#include "tpu_components.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+void ProgramBuilder::place(uint32_t host_addr, const void* data, size_t length) {
+    if (image_bytes.size() < host_addr + length) image_bytes.resize(host_addr + length, 0);
+    if (length > 0) std::memcpy(image_bytes.data() + host_addr, data, length);
+}
+
+void ProgramBuilder::place_matrix(uint32_t host_addr, const std::vector<int8_t>& values) {
+    place(host_addr, values.data(), values.size());
+}
+
+ProgramBuilder& ProgramBuilder::emit(OpCode opcode, uint32_t data_addr, uint64_t host_addr, uint32_t length,
+                                     uint8_t flags) {
+    Instruction instr;
+    std::memset(&instr, 0, sizeof(instr));
+    instr.opcode = opcode;
+    instr.flags = flags;
+    instr.data_addr = data_addr;
+    instr.host_addr_hi = static_cast<uint16_t>(host_addr >> 32);
+    instr.host_addr = static_cast<uint32_t>(host_addr);
+    instr.length = length;
+    programs[core].push_back(instr);
+    return *this;
+}
+
+void ProgramBuilder::set_core(int new_core) {
+    core = static_cast<size_t>(new_core);
+    if (programs.size() <= core) programs.resize(core + 1);
+}
+
+ProgramBuilder& ProgramBuilder::rhm(uint32_t ub_addr, uint64_t host_addr, uint32_t length) {
+    return emit(OpCode::RHM, ub_addr, host_addr, length);
+}
+
+ProgramBuilder& ProgramBuilder::rw(uint64_t host_addr, uint32_t length, uint8_t flags) {
+    return emit(OpCode::RW, 0, host_addr, length, flags);
+}
+
+ProgramBuilder& ProgramBuilder::mmc(uint32_t ub_addr, uint32_t acc_addr, uint32_t length, uint8_t flags) {
+    return emit(OpCode::MMC, ub_addr, acc_addr, length, flags);
+}
+
+ProgramBuilder& ProgramBuilder::act(uint32_t acc_addr, uint32_t num_elements, uint8_t func) {
+    return emit(OpCode::ACT, acc_addr, 0, num_elements, func);
+}
+
+ProgramBuilder& ProgramBuilder::act_to_ub(uint32_t acc_addr, uint32_t ub_addr, uint32_t num_elements, uint8_t func) {
+    return emit(OpCode::ACT, acc_addr, ub_addr, num_elements, func | FLAG_ACT_TO_UB);
+}
+
+ProgramBuilder& ProgramBuilder::cfg(ConfigRegister reg, int32_t value) {
+    return emit(OpCode::CFG, reg, static_cast<uint32_t>(value), 0);
+}
+
+ProgramBuilder& ProgramBuilder::whm(uint32_t acc_addr, uint64_t host_addr, uint32_t length) {
+    return emit(OpCode::WHM, acc_addr, host_addr, length);
+}
+
+// The patch slice rides in the host_addr_hi bits, which CONV does not use
+// for an address.
+ProgramBuilder& ProgramBuilder::conv(uint32_t fmap_addr, uint32_t acc_addr, uint32_t length, uint16_t slice, uint8_t flags) {
+    return emit(OpCode::CONV, fmap_addr, static_cast<uint64_t>(slice) << 32 | acc_addr, length, flags);
+}
+
+ProgramBuilder& ProgramBuilder::sync() {
+    return emit(OpCode::SYNC, 0, 0, 0);
+}
+
+ProgramBuilder& ProgramBuilder::hlt() {
+    return emit(OpCode::HLT, 0, 0, 0);
+}
+
+void ProgramBuilder::reserve_host(uint64_t end) {
+    reserved_bytes = std::max(reserved_bytes, end);
+}
+
+void ProgramBuilder::set_io(uint64_t input_addr, uint64_t input_bytes, uint64_t output_addr, uint64_t output_bytes) {
+    in_addr = input_addr;
+    in_bytes = input_bytes;
+    out_addr = output_addr;
+    out_bytes = output_bytes;
+}
+
+size_t ProgramBuilder::host_memory_mb() const {
+    uint64_t bytes = std::max<uint64_t>(reserved_bytes, image_bytes.size());
+    return static_cast<size_t>((bytes + (1 << 20) - 1) >> 20);
+}
+
+HostMemory::Image ProgramBuilder::image() const {
+    return HostMemory::Image(new HostImage(image_bytes));
+}
+
+bool ProgramBuilder::write_files(const std::string& program_path, const std::string& memory_path) const {
+    std::ofstream program_file(program_path, std::ios::binary);
+    std::ofstream memory_file(memory_path, std::ios::binary);
+    if (!program_file || !memory_file) {
+        std::cerr << "ERROR: Cannot write " << program_path << " / " << memory_path << std::endl;
+        return false;
+    }
+    program_file.write(reinterpret_cast<const char*>(programs[0].data()), programs[0].size() * sizeof(Instruction));
+    memory_file.write(reinterpret_cast<const char*>(image_bytes.data()), image_bytes.size());
+    return program_file.good() && memory_file.good();
+}
+
+namespace {
+
+const int T = BUILTIN_ARRAY_SIZE;
+const uint32_t TILE = T * T;
+const uint32_t ACC_TILE = TILE * sizeof(int32_t);
+const int M_GROUP = 8;
+// Row groups are sized to fit the default 256 KB UB.
+const uint32_t UB_BYTES = 256 * 1024;
+
+} // namespace
+
+bool check_builtin_array_size(int array_size, const std::string& workload) {
+    if (array_size == BUILTIN_ARRAY_SIZE) return true;
+    std::cerr << "ERROR: Built-in workload " << workload << " is tiled for array_size=" << BUILTIN_ARRAY_SIZE
+              << ", not " << array_size << std::endl;
+    return false;
+}
+
+int32_t build_demo_layer(ProgramBuilder& builder, std::vector<int32_t>* expected) {
+    const uint32_t ADDR_INPUT = 1000;
+    const uint32_t ADDR_WEIGHTS = 2000;
+    const uint32_t ADDR_RESULT = 3000;
+
+    std::vector<int8_t> input_data(TILE), weight_data(TILE, 0);
+    for (int i = 0; i < T; ++i) {
+        std::fill(input_data.begin() + i * T, input_data.begin() + (i + 1) * T, static_cast<int8_t>(i + 1));
+        weight_data[i * T + i] = -1;
+    }
+    builder.place_matrix(ADDR_INPUT, input_data);
+    builder.place_matrix(ADDR_WEIGHTS, weight_data);
+
+    builder.set_io(ADDR_INPUT, TILE, ADDR_RESULT, ACC_TILE);
+
+    builder.rhm(0, ADDR_INPUT, TILE)
+           .rw(ADDR_WEIGHTS, TILE)
+           .mmc(0, 0, TILE)
+           .act(0, TILE)
+           .whm(0, ADDR_RESULT, ACC_TILE)
+           .hlt();
+    // Its one weight tile stays latched, so a warm request skips the RW.
+    builder.set_serve_entry(static_cast<uint32_t>(builder.program().size()));
+    builder.rhm(0, ADDR_INPUT, TILE)
+           .mmc(0, 0, TILE, FLAG_MMC_REUSE_WEIGHTS)
+           .act(0, TILE)
+           .whm(0, ADDR_RESULT, ACC_TILE)
+           .hlt();
+
+    std::vector<int32_t> out(TILE, 0);
+    for (int r = 0; r < T; ++r)
+        for (int c = 0; c < T; ++c) {
+            for (int k = 0; k < T; ++k) out[r * T + c] += input_data[r * T + k] * weight_data[k * T + c];
+            out[r * T + c] = std::max(0, out[r * T + c]);
+        }
+    if (expected) *expected = out;
+    return out[0];
+}
+
+namespace {
+
+// Row tiles per group when each row tile needs tiles_per_row UB tiles.
+int group_size(int tiles_per_row) {
+    return std::max(1, std::min<int>(M_GROUP, UB_BYTES / (tiles_per_row * TILE)));
+}
+
+// Element [r][c] of a x w for row-major a (rows x k) and w (k x n).
+int32_t dot(const std::vector<int8_t>& a, const std::vector<int8_t>& w, int k, int n, int r, int c) {
+    int32_t sum = 0;
+    for (int kk = 0; kk < k; ++kk) sum += a[static_cast<size_t>(r) * k + kk] * w[static_cast<size_t>(kk) * n + c];
+    return sum;
+}
+
+std::vector<int8_t> random_matrix(size_t elements, uint32_t& state) {
+    std::vector<int8_t> m(elements);
+    for (auto& v : m) {
+        state = state * 1664525u + 1013904223u;
+        v = static_cast<int8_t>(state >> 24);
+    }
+    return m;
+}
+
+// Stores a rows x cols row-major matrix tile by tile, [row tile][col tile].
+void place_tiles(ProgramBuilder& builder, const std::vector<int8_t>& src, int rows, int cols, uint32_t addr) {
+    std::vector<int8_t> tile(TILE);
+    for (int rt = 0; rt < rows / T; ++rt)
+        for (int ct = 0; ct < cols / T; ++ct) {
+            for (int r = 0; r < T; ++r)
+                for (int c = 0; c < T; ++c) tile[r * T + c] = src[static_cast<size_t>(rt * T + r) * cols + ct * T + c];
+            builder.place_matrix(addr + (rt * (cols / T) + ct) * TILE, tile);
+        }
+}
+
+// A layer's W tiles in host memory, [kt][nt]: dense, TILE bytes apart, or
+// compressed (see compress_weight_tile) and packed back to back.
+struct WeightTiles {
+    uint32_t addr;
+    uint32_t bytes;
+    int n_tiles;
+    std::vector<uint32_t> offsets;   // compressed: tile i spans [offsets[i], offsets[i + 1])
+
+    void rw(ProgramBuilder& builder, int kt, int nt) const {
+        int i = kt * n_tiles + nt;
+        if (offsets.empty()) {
+            builder.rw(addr + i * TILE, TILE);
+        } else {
+            builder.rw(addr + offsets[i], offsets[i + 1] - offsets[i], FLAG_RW_COMPRESSED);
+        }
+    }
+};
+
+// Stores row-major w (k x n) at addr as W tiles.
+WeightTiles place_weights(ProgramBuilder& builder, const std::vector<int8_t>& w, int k, int n, uint32_t addr,
+                          bool compressed = false) {
+    WeightTiles tiles = {addr, static_cast<uint32_t>(k) * n, n / T, {}};
+    if (!compressed) {
+        place_tiles(builder, w, k, n, addr);
+        return tiles;
+    }
+    std::vector<int8_t> tile(TILE);
+    std::vector<uint8_t> packed;
+    tiles.offsets.push_back(0);
+    for (int kt = 0; kt < k / T; ++kt)
+        for (int nt = 0; nt < n / T; ++nt) {
+            for (int r = 0; r < T; ++r)
+                for (int c = 0; c < T; ++c) tile[r * T + c] = w[static_cast<size_t>(kt * T + r) * n + nt * T + c];
+            compress_weight_tile(tile.data(), T, packed);
+            builder.place(addr + tiles.offsets.back(), packed.data(), packed.size());
+            tiles.offsets.push_back(tiles.offsets.back() + static_cast<uint32_t>(packed.size()));
+        }
+    tiles.bytes = tiles.offsets.back();
+    return tiles;
+}
+
+// Zeroes each row block (sparse_block_rows rows of one W tile's columns) of
+// row-major w (k x n) with probability sparsity_pct / 100.
+void prune_blocks(std::vector<int8_t>& w, int k, int n, int sparsity_pct, uint32_t& state) {
+    const int block_rows = sparse_block_rows(T);
+    for (int kb = 0; kb < k / block_rows; ++kb)
+        for (int nt = 0; nt < n / T; ++nt) {
+            state = state * 1664525u + 1013904223u;
+            if (static_cast<int>((state >> 8) % 100) >= sparsity_pct) continue;
+            for (int r = kb * block_rows; r < (kb + 1) * block_rows; ++r)
+                std::fill_n(&w[static_cast<size_t>(r) * n + nt * T], T, 0);
+        }
+}
+
+// Row-major int32 product of a (rows x k) and w (k x n).
+std::vector<int32_t> matmul(const std::vector<int8_t>& a, const std::vector<int8_t>& w, int rows, int k, int n) {
+    std::vector<int32_t> out(static_cast<size_t>(rows) * n, 0);
+    for (int r = 0; r < rows; ++r)
+        for (int kk = 0; kk < k; ++kk)
+            for (int c = 0; c < n; ++c) out[static_cast<size_t>(r) * n + c] += a[static_cast<size_t>(r) * k + kk] * w[static_cast<size_t>(kk) * n + c];
+    return out;
+}
+
+// ReLU of a row-major matrix, reordered into the tile-by-tile output layout.
+std::vector<int32_t> relu_tiles(const std::vector<int32_t>& m, int rows, int n) {
+    std::vector<int32_t> out;
+    out.reserve(m.size());
+    for (int mt = 0; mt < rows / T; ++mt)
+        for (int nt = 0; nt < n / T; ++nt)
+            for (int r = 0; r < T; ++r)
+                for (int c = 0; c < T; ++c) out.push_back(std::max(0, m[static_cast<size_t>(mt * T + r) * n + nt * T + c]));
+    return out;
+}
+
+// Multiplies a row group whose A tiles sit in the UB at ub_a, stored K slice
+// by K slice ([kt][g]), by output columns [nt_begin, nt_end) of w.
+// Each column accumulates into one of two sets of accumulator tiles, so one
+// column can drain while the next one accumulates; finish(nt, acc_base)
+// emits what happens to a finished column.
+template <typename Finish>
+void emit_group_matmul(ProgramBuilder& builder, uint32_t ub_a, int group, int k_tiles, int n_tiles,
+                       const WeightTiles& w, bool batch_mmc, Finish finish, int nt_begin = 0, int nt_end = -1) {
+    if (nt_end < 0) nt_end = n_tiles;
+    for (int nt = nt_begin; nt < nt_end; ++nt) {
+        uint32_t acc_base = (nt % 2) * group * ACC_TILE;
+        for (int kt = 0; kt < k_tiles; ++kt) {
+            w.rw(builder, kt, nt);
+            uint8_t accumulate = kt > 0 ? FLAG_MMC_ACCUMULATE : 0;
+            if (batch_mmc) {
+                builder.mmc(ub_a + kt * group * TILE, acc_base, group * TILE, accumulate);
+                continue;
+            }
+            for (int g = 0; g < group; ++g) {
+                uint8_t flags = accumulate | (g > 0 ? FLAG_MMC_REUSE_WEIGHTS : 0);
+                builder.mmc(ub_a + (kt * group + g) * TILE, acc_base + g * ACC_TILE, TILE, flags);
+            }
+        }
+        finish(nt, acc_base);
+    }
+}
+
+// Loads a row group's A tiles from host (stored [m][k]) into the UB at ub_a
+// in the [kt][g] order emit_group_matmul expects.
+void load_group(ProgramBuilder& builder, uint32_t a_addr, int m0, int group, int k_tiles, uint32_t ub_a) {
+    for (int g = 0; g < group; ++g)
+        for (int kt = 0; kt < k_tiles; ++kt)
+            builder.rhm(ub_a + (kt * group + g) * TILE, a_addr + ((m0 + g) * k_tiles + kt) * TILE, TILE);
+}
+
+// ReLU in place and write-back of a finished column as int32 output tiles.
+void emit_relu_writeback(ProgramBuilder& builder, int m0, int group, int nt, int n_tiles, uint32_t acc_base,
+                         uint32_t output_addr, bool batch_mmc) {
+    if (batch_mmc) builder.act(acc_base, group * TILE);
+    for (int g = 0; g < group; ++g) {
+        if (!batch_mmc) builder.act(acc_base + g * ACC_TILE, TILE);
+        builder.whm(acc_base + g * ACC_TILE, output_addr + ((m0 + g) * n_tiles + nt) * ACC_TILE, ACC_TILE);
+    }
+}
+
+// Row tiles per group when rows are split across cores: small enough that
+// every core gets a group if there are at least as many row tiles as cores.
+int core_group_size(int max_group, int m_tiles, int cores) {
+    return cores > 1 ? std::max(1, std::min(max_group, m_tiles / cores)) : max_group;
+}
+
+// Ends every core's program. With several cores, SYNC first, so the layer
+// completes on all of them together.
+void finish_cores(ProgramBuilder& builder, int cores) {
+    for (int c = 0; c < cores; ++c) {
+        builder.set_core(c);
+        if (cores > 1) builder.sync();
+        builder.hlt();
+    }
+    builder.set_core(0);
+}
+
+// ReLU(a * w) for row-major a (rows x k) and w (k x n): the program and
+// host layout build_gemm_layer describes, W optionally compressed.
+int32_t emit_gemm(ProgramBuilder& builder, const std::vector<int8_t>& a, const std::vector<int8_t>& w, int rows, int k,
+                  int n, uint32_t& output_addr, bool batch_mmc, std::vector<int32_t>* expected, int cores,
+                  bool compress_weights = false) {
+    int m_tiles = rows / T, k_tiles = k / T, n_tiles = n / T;
+
+    // Host layout: A tiles [m][k], then W tiles [k][n], then the output.
+    const uint32_t a_addr = 0x1000;
+    place_tiles(builder, a, rows, k, a_addr);
+    WeightTiles w_tiles = place_weights(builder, w, k, n, a_addr + m_tiles * k_tiles * TILE, compress_weights);
+    output_addr = w_tiles.addr + w_tiles.bytes;
+    builder.reserve_host(output_addr + static_cast<uint64_t>(rows) * n * sizeof(int32_t));
+    builder.set_io(a_addr, static_cast<uint64_t>(rows) * k, output_addr, static_cast<uint64_t>(rows) * n * sizeof(int32_t));
+
+    const int max_group = core_group_size(group_size(k_tiles), m_tiles, cores);
+    const int groups = (m_tiles + max_group - 1) / max_group;
+    // Splitting rows costs no extra host traffic (every group streams all
+    // of W anyway); splitting columns has each core read all of A.
+    const bool split_rows = groups >= cores;
+    for (int c = 0; c < cores; ++c) {
+        builder.set_core(c);
+        int g_begin = split_rows ? c * groups / cores : 0, g_end = split_rows ? (c + 1) * groups / cores : groups;
+        int nt_begin = split_rows ? 0 : c * n_tiles / cores, nt_end = split_rows ? n_tiles : (c + 1) * n_tiles / cores;
+        if (nt_begin == nt_end) continue;
+        for (int group_index = g_begin; group_index < g_end; ++group_index) {
+            int m0 = group_index * max_group;
+            int group = std::min(max_group, m_tiles - m0);
+            // The group's A tiles stay in the UB for every output column.
+            load_group(builder, a_addr, m0, group, k_tiles, 0);
+            emit_group_matmul(builder, 0, group, k_tiles, n_tiles, w_tiles, batch_mmc, [&](int nt, uint32_t acc_base) {
+                emit_relu_writeback(builder, m0, group, nt, n_tiles, acc_base, output_addr, batch_mmc);
+            }, nt_begin, nt_end);
+        }
+    }
+    finish_cores(builder, cores);
+    if (expected) *expected = relu_tiles(matmul(a, w, rows, k, n), rows, n);
+    return std::max(0, dot(a, w, k, n, 0, 0));
+}
+
+
+} // namespace
+
+int32_t build_gemm_layer(ProgramBuilder& builder, int rows, int k, int n, uint32_t seed, uint32_t& output_addr,
+                         bool batch_mmc, std::vector<int32_t>* expected, int cores) {
+    uint32_t state = seed;
+    std::vector<int8_t> a = random_matrix(static_cast<size_t>(rows) * k, state);
+    std::vector<int8_t> w = random_matrix(static_cast<size_t>(k) * n, state);
+    return emit_gemm(builder, a, w, rows, k, n, output_addr, batch_mmc, expected, cores);
+}
+
+int32_t build_sparse_gemm_layer(ProgramBuilder& builder, int rows, int k, int n, int sparsity_pct, uint32_t seed,
+                                uint32_t& output_addr, bool compressed, std::vector<int32_t>* expected, int cores) {
+    uint32_t state = seed;
+    std::vector<int8_t> a = random_matrix(static_cast<size_t>(rows) * k, state);
+    std::vector<int8_t> w = random_matrix(static_cast<size_t>(k) * n, state);
+    prune_blocks(w, k, n, sparsity_pct, state);
+    return emit_gemm(builder, a, w, rows, k, n, output_addr, true, expected, cores, compressed);
+}
+
+int32_t build_mlp_layers(ProgramBuilder& builder, int rows, int k, int hidden, int n, uint32_t seed,
+                         uint32_t& output_addr, bool batch_mmc, std::vector<int32_t>* expected, int cores) {
+    int m_tiles = rows / T, k_tiles = k / T, h_tiles = hidden / T, n_tiles = n / T;
+    uint32_t state = seed;
+    std::vector<int8_t> a = random_matrix(static_cast<size_t>(rows) * k, state);
+    std::vector<int8_t> w1 = random_matrix(static_cast<size_t>(k) * hidden, state);
+    std::vector<int8_t> w2 = random_matrix(static_cast<size_t>(hidden) * n, state);
+
+    const uint32_t a_addr = 0x1000;
+    place_tiles(builder, a, rows, k, a_addr);
+    WeightTiles w1_tiles = place_weights(builder, w1, k, hidden, a_addr + m_tiles * k_tiles * TILE);
+    WeightTiles w2_tiles = place_weights(builder, w2, hidden, n, w1_tiles.addr + w1_tiles.bytes);
+    output_addr = w2_tiles.addr + w2_tiles.bytes;
+    builder.reserve_host(output_addr + static_cast<uint64_t>(rows) * n * sizeof(int32_t));
+    builder.set_io(a_addr, static_cast<uint64_t>(rows) * k, output_addr, static_cast<uint64_t>(rows) * n * sizeof(int32_t));
+
+    // Hidden activations: ReLU, then scaled down by 2^10 into int8.
+    ActivationParams requant;
+    requant.shift = 10;
+
+    const int max_group = core_group_size(group_size(k_tiles + h_tiles), m_tiles, cores);
+    const int groups = (m_tiles + max_group - 1) / max_group;
+    const uint32_t hidden_ub = max_group * k_tiles * TILE;
+    for (int c = 0; c < cores; ++c) {
+        builder.set_core(c);
+        builder.cfg(CFG_ACT_SHIFT, requant.shift);
+        for (int group_index = c * groups / cores; group_index < (c + 1) * groups / cores; ++group_index) {
+            int m0 = group_index * max_group;
+            int group = std::min(max_group, m_tiles - m0);
+            load_group(builder, a_addr, m0, group, k_tiles, 0);
+            // Layer 1 leaves its int8 output in the UB in exactly the [kt][g]
+            // order layer 2 reads its A tiles in.
+            emit_group_matmul(builder, 0, group, k_tiles, h_tiles, w1_tiles, batch_mmc, [&](int ht, uint32_t acc_base) {
+                if (batch_mmc) {
+                    builder.act_to_ub(acc_base, hidden_ub + ht * group * TILE, group * TILE);
+                    return;
+                }
+                for (int g = 0; g < group; ++g)
+                    builder.act_to_ub(acc_base + g * ACC_TILE, hidden_ub + (ht * group + g) * TILE, TILE);
+            });
+            emit_group_matmul(builder, hidden_ub, group, h_tiles, n_tiles, w2_tiles, batch_mmc, [&](int nt, uint32_t acc_base) {
+                emit_relu_writeback(builder, m0, group, nt, n_tiles, acc_base, output_addr, batch_mmc);
+            });
+        }
+    }
+    finish_cores(builder, cores);
+
+    if (expected) {
+        std::vector<int32_t> h32 = matmul(a, w1, rows, k, hidden);
+        std::vector<int8_t> h(h32.size());
+        for (size_t i = 0; i < h32.size(); ++i) h[i] = activate_to_int8(h32[i], ACT_RELU, requant);
+        *expected = relu_tiles(matmul(h, w2, rows, hidden, n), rows, n);
+    }
+    std::vector<int8_t> h_row(hidden);
+    for (int j = 0; j < hidden; ++j) h_row[j] = activate_to_int8(dot(a, w1, k, hidden, 0, j), ACT_RELU, requant);
+    return std::max(0, dot(h_row, w2, hidden, n, 0, 0));
+}
+
+int32_t build_conv_layer(ProgramBuilder& builder, int height, int width, int channels, int kernel, int stride, int pad,
+                         int filters, uint32_t seed, uint32_t& output_addr, bool on_chip,
+                         std::vector<int32_t>* expected, int cores) {
+    ConvParams conv;
+    conv.height = height;
+    conv.width = width;
+    conv.channels = channels;
+    conv.kernel_h = conv.kernel_w = kernel;
+    conv.stride = stride;
+    conv.pad = pad;
+    const int pixels = static_cast<int>(conv.out_pixels()), k = static_cast<int>(conv.patch_bytes());
+    uint32_t state = seed;
+    std::vector<int8_t> fmap = random_matrix(conv.feature_map_bytes(), state);
+    std::vector<int8_t> w = random_matrix(static_cast<size_t>(k) * filters, state);
+
+    // The im2col matrix: row p is output pixel p's patch.
+    std::vector<int8_t> patches(static_cast<size_t>(pixels) * k, 0);
+    for (int p = 0; p < pixels; ++p)
+        for (int kh = 0; kh < kernel; ++kh)
+            for (int kw = 0; kw < kernel; ++kw) {
+                int y = p / conv.out_width() * stride - pad + kh, x = p % conv.out_width() * stride - pad + kw;
+                if (y < 0 || y >= height || x < 0 || x >= width) continue;
+                std::memcpy(&patches[static_cast<size_t>(p) * k + (kh * kernel + kw) * channels],
+                            &fmap[(static_cast<size_t>(y) * width + x) * channels], channels);
+            }
+    if (expected) *expected = relu_tiles(matmul(patches, w, pixels, k, filters), pixels, filters);
+    if (!on_chip) return emit_gemm(builder, patches, w, pixels, k, filters, output_addr, true, nullptr, cores);
+
+    // Host layout: the feature map, then W tiles [k][n], then the output.
+    const int p_tiles = pixels / T, k_tiles = k / T, n_tiles = filters / T;
+    const uint32_t fmap_addr = 0x1000;
+    const uint64_t output_bytes = static_cast<uint64_t>(pixels) * filters * sizeof(int32_t);
+    builder.place(fmap_addr, fmap.data(), fmap.size());
+    WeightTiles w_tiles = place_weights(builder, w, k, filters, fmap_addr + static_cast<uint32_t>(fmap.size()));
+    output_addr = w_tiles.addr + w_tiles.bytes;
+    builder.reserve_host(output_addr + output_bytes);
+    builder.set_io(fmap_addr, fmap.size(), output_addr, output_bytes);
+
+    // Every core loads the whole feature map and computes its share of the
+    // output pixels, a row group at a time, as build_gemm_layer does.
+    const int max_group = core_group_size(M_GROUP, p_tiles, cores);
+    const int groups = (p_tiles + max_group - 1) / max_group;
+    const int32_t geometry[][2] = {{CFG_CONV_HEIGHT, height}, {CFG_CONV_WIDTH, width}, {CFG_CONV_CHANNELS, channels},
+                                   {CFG_CONV_KERNEL_H, kernel}, {CFG_CONV_KERNEL_W, kernel},
+                                   {CFG_CONV_STRIDE, stride}, {CFG_CONV_PAD, pad}};
+    for (int c = 0; c < cores; ++c) {
+        builder.set_core(c);
+        if (c * groups / cores == (c + 1) * groups / cores) continue;
+        for (const auto& reg : geometry) builder.cfg(static_cast<ConfigRegister>(reg[0]), reg[1]);
+        builder.rhm(0, fmap_addr, static_cast<uint32_t>(fmap.size()));
+        for (int group_index = c * groups / cores; group_index < (c + 1) * groups / cores; ++group_index) {
+            int m0 = group_index * max_group;
+            int group = std::min(max_group, p_tiles - m0);
+            builder.cfg(CFG_CONV_FIRST_PIXEL, m0 * T);
+            for (int nt = 0; nt < n_tiles; ++nt) {
+                uint32_t acc_base = (nt % 2) * group * ACC_TILE;
+                for (int kt = 0; kt < k_tiles; ++kt) {
+                    w_tiles.rw(builder, kt, nt);
+                    builder.conv(0, acc_base, group * TILE, static_cast<uint16_t>(kt), kt > 0 ? FLAG_MMC_ACCUMULATE : 0);
+                }
+                emit_relu_writeback(builder, m0, group, nt, n_tiles, acc_base, output_addr, true);
+            }
+        }
+    }
+    finish_cores(builder, cores);
+    return std::max(0, dot(patches, w, k, filters, 0, 0));
+}
+
+bool build_workload(const std::string& name, ProgramBuilder& builder, int32_t* expected_first,
+                    uint32_t* output_addr, int cores, std::vector<int32_t>* expected_output) {
+    int32_t expected;
+    uint32_t output = 3000;
+    if (name == "demo") {
+        expected = build_demo_layer(builder, expected_output);
+    } else if (name == "gemm512") {
+        expected = build_gemm_layer(builder, 16, 512, 512, 1, output, true, expected_output, cores);
+    } else if (name == "batch1024") {
+        expected = build_gemm_layer(builder, 1024, 128, 128, 2, output, true, expected_output, cores);
+    } else if (name == "batch1024-tiled") {
+        expected = build_gemm_layer(builder, 1024, 128, 128, 2, output, false, expected_output, cores);
+    } else if (name == "mlp") {
+        expected = build_mlp_layers(builder, 256, 128, 128, 128, 3, output, true, expected_output, cores);
+    } else if (name == "gemm256") {
+        expected = build_gemm_layer(builder, 256, 256, 256, 4, output, true, expected_output, cores);
+    } else if (name == "gemm1024") {
+        expected = build_gemm_layer(builder, 1024, 1024, 1024, 5, output, true, expected_output, cores);
+    } else if (name == "gemm4096") {
+        expected = build_gemm_layer(builder, 4096, 4096, 4096, 6, output, true, expected_output, cores);
+    } else if (name == "mlp1024") {
+        expected = build_mlp_layers(builder, 1024, 256, 256, 256, 7, output, true, expected_output, cores);
+    } else if (name == "membound") {
+        expected = build_gemm_layer(builder, 16, 1024, 1024, 8, output, true, expected_output, cores);
+    } else if (name == "compbound") {
+        expected = build_gemm_layer(builder, 2048, 256, 256, 9, output, true, expected_output, cores);
+    } else if (name == "pruned") {
+        expected = build_sparse_gemm_layer(builder, 512, 512, 512, 75, 11, output, true, expected_output, cores);
+    } else if (name == "pruned-uncompressed") {
+        expected = build_sparse_gemm_layer(builder, 512, 512, 512, 75, 11, output, false, expected_output, cores);
+    } else if (name == "conv") {
+        expected = build_conv_layer(builder, 32, 32, 32, 3, 1, 1, 64, 10, output, true, expected_output, cores);
+    } else if (name == "conv-im2col") {
+        expected = build_conv_layer(builder, 32, 32, 32, 3, 1, 1, 64, 10, output, false, expected_output, cores);
+    } else {
+        return false;
+    }
+    if (expected_first) *expected_first = expected;
+    if (output_addr) *output_addr = output;
+    return true;
+}
@@ -0,0 +1,162 @@
+#pragma once
+#include "isa.h"
+#include "host_memory.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Builds a TPU program and its initial host-memory image in process, in
+// place of compiler.py writing program.bin and memory.bin. The image only
+// extends to the last byte placed; everything after it is zero. For a
+// multi-core chip it builds one program per core, all sharing the image.
+class ProgramBuilder {
+public:
+    ProgramBuilder() : programs(1), core(0), reserved_bytes(0), in_addr(0), in_bytes(0), out_addr(0), out_bytes(0),
+                       serve_at(0) {}
+
+    void place(uint32_t host_addr, const void* data, size_t length);
+    void place_matrix(uint32_t host_addr, const std::vector<int8_t>& values);
+    // Notes that the program writes host memory up to (not including) end,
+    // beyond what is placed.
+    void reserve_host(uint64_t end);
+    // The host bytes the program reads as its input and writes as its
+    // output. Serving (--serve) overwrites the input for every request and
+    // runs the program again.
+    void set_io(uint64_t input_addr, uint64_t input_bytes, uint64_t output_addr, uint64_t output_bytes);
+    uint64_t input_addr() const { return in_addr; }
+    uint64_t input_bytes() const { return in_bytes; }
+    uint64_t output_addr() const { return out_addr; }
+    uint64_t output_bytes() const { return out_bytes; }
+    // Where later serving requests start in core 0's program. 0 (the
+    // default) reruns it from the top, skipping only its leading CFGs. A
+    // program whose weights stay latched in the MXU ends its first run with
+    // HLT and continues with a warm copy that leaves out the RWs.
+    void set_serve_entry(uint32_t index) { serve_at = index; }
+    uint32_t serve_entry() const { return serve_at; }
+    // Host memory the program needs, in whole MB.
+    size_t host_memory_mb() const;
+
+    // Operand order follows the instruction fields: on-chip address first,
+    // then host address, then length.
+    ProgramBuilder& rhm(uint32_t ub_addr, uint64_t host_addr, uint32_t length);
+    ProgramBuilder& rw(uint64_t host_addr, uint32_t length, uint8_t flags = 0);
+    ProgramBuilder& mmc(uint32_t ub_addr, uint32_t acc_addr, uint32_t length, uint8_t flags = 0);
+    ProgramBuilder& act(uint32_t acc_addr, uint32_t num_elements, uint8_t func = ACT_RELU);
+    // ACT with FLAG_ACT_TO_UB: writes num_elements int8 values at ub_addr.
+    ProgramBuilder& act_to_ub(uint32_t acc_addr, uint32_t ub_addr, uint32_t num_elements, uint8_t func = ACT_RELU);
+    ProgramBuilder& cfg(ConfigRegister reg, int32_t value);
+    ProgramBuilder& whm(uint32_t acc_addr, uint64_t host_addr, uint32_t length);
+    // MMC on length bytes of rows the UB builds from the patches of the
+    // feature map at fmap_addr (geometry from the CFG_CONV_* registers).
+    ProgramBuilder& conv(uint32_t fmap_addr, uint32_t acc_addr, uint32_t length, uint16_t slice, uint8_t flags = 0);
+    ProgramBuilder& sync();
+    ProgramBuilder& hlt();
+
+    // Instructions go to the program of the selected core (0 by default);
+    // selecting a core past the last adds empty programs up to it.
+    void set_core(int core);
+    int cores() const { return static_cast<int>(programs.size()); }
+    const std::vector<Instruction>& program(int core = 0) const { return programs[core]; }
+    const std::vector<uint8_t>& memory() const { return image_bytes; }
+    HostMemory::Image image() const;
+    bool write_files(const std::string& program_path, const std::string& memory_path) const;
+
+private:
+    std::vector<std::vector<Instruction>> programs;
+    size_t core;
+    std::vector<uint8_t> image_bytes;
+    uint64_t reserved_bytes;
+    uint64_t in_addr, in_bytes, out_addr, out_bytes;
+    uint32_t serve_at;
+
+    ProgramBuilder& emit(OpCode opcode, uint32_t data_addr, uint64_t host_addr, uint32_t length, uint8_t flags = 0);
+};
+
+// Every built-in workload is tiled for an MXU this wide; run them only on a
+// TPU with that array_size. check_builtin_array_size prints an error and
+// returns false for any other size.
+const int BUILTIN_ARRAY_SIZE = 16;
+bool check_builtin_array_size(int array_size, const std::string& workload);
+
+// The 16x16 layer compiler.py builds: inputs row i = i + 1, weights = -I,
+// then MMC, ReLU and write-back to host address 3000. After its HLT comes
+// the serving entry: the same layer with the weights already in the MXU. Returns the expected
+// first output element; expected, if given, receives the whole output tile.
+int32_t build_demo_layer(ProgramBuilder& builder, std::vector<int32_t>* expected = nullptr);
+
+// ReLU(A * W) for int8 A (rows x k) and W (k x n), all multiples of 16, with
+// deterministic pseudo-random values. K is tiled: each 16-wide K slice is one
+// RW + MMC, and every slice after the first accumulates into the same
+// accumulator tile, so only finished output tiles go back to the host. Rows
+// are processed in groups of up to 8 tiles (fewer if their A tiles would not
+// fit in a 256 KB UB) that share each weight tile: one RW, then a single
+// batched MMC streaming all the group's row tiles through it (or, without
+// batch_mmc, one MMC per row tile with the rest reusing the latched
+// weights). A and W are stored tile by tile (16x16 row-major blocks); the
+// output starts at output_addr, also tile by tile, each tile 16x16 int32.
+// Returns the expected first output element; expected, if given, receives
+// the whole expected output in that layout.
+//
+// With cores > 1 the work is split across that many core programs, each
+// ending in SYNC so the layer finishes on every core together. Rows are
+// split when there are at least as many row tiles as cores (groups shrink
+// so every core gets some); otherwise each core computes all rows for its
+// own slice of the output columns.
+int32_t build_gemm_layer(ProgramBuilder& builder, int rows, int k, int n, uint32_t seed, uint32_t& output_addr,
+                         bool batch_mmc = true, std::vector<int32_t>* expected = nullptr, int cores = 1);
+
+// build_gemm_layer (batched) with pruned weights: every 4-row block of a W
+// tile (see sparse_block_rows) is zero with probability sparsity_pct / 100.
+// compressed stores W as compressed tiles that RW reads with
+// FLAG_RW_COMPRESSED, so only nonzero blocks cross the host bus; the output
+// follows the (smaller) W.
+int32_t build_sparse_gemm_layer(ProgramBuilder& builder, int rows, int k, int n, int sparsity_pct, uint32_t seed,
+                                uint32_t& output_addr, bool compressed = true,
+                                std::vector<int32_t>* expected = nullptr, int cores = 1);
+
+// Two layers, ReLU(ReLU(A * W1) * W2), with A rows x k, W1 k x hidden and W2
+// hidden x n, all multiples of 16. The hidden activations never leave the
+// chip: ACT requantizes them to int8 (ReLU, then divided by 2^10 via CFG)
+// straight into the UB, where the second layer's MMCs read them. Host
+// layout, return value and expected are as for build_gemm_layer. Across
+// cores only rows are split, since the second layer needs whole hidden rows.
+int32_t build_mlp_layers(ProgramBuilder& builder, int rows, int k, int hidden, int n, uint32_t seed,
+                         uint32_t& output_addr, bool batch_mmc = true, std::vector<int32_t>* expected = nullptr,
+                         int cores = 1);
+
+// ReLU(conv(F, W)) for a random height x width x channels NHWC int8
+// feature map F and filters square kernel x kernel windows at the given
+// stride and zero padding, channels and filters multiples of 16 and the
+// output pixel count a multiple of 16. The output is the im2col GEMM's:
+// pixels x filters, tile by tile as for build_gemm_layer. on_chip loads F
+// into the UB once and lowers each K slice of each row group to a CONV that
+// builds its patches there. Otherwise the host does im2col and the layer
+// runs as build_gemm_layer on the patch matrix, which is kernel^2 / stride^2
+// times larger than F. F must fit in the UB.
+int32_t build_conv_layer(ProgramBuilder& builder, int height, int width, int channels, int kernel, int stride, int pad,
+                         int filters, uint32_t seed, uint32_t& output_addr, bool on_chip = true,
+                         std::vector<int32_t>* expected = nullptr, int cores = 1);
+
+// Builds a named built-in workload and, if given, stores the expected first
+// output element, the host address it is written to and the whole expected
+// output in its host layout (computed on the host, slow for gemm4096). The GEMM and MLP
+// workloads are split across cores core programs; demo always runs on core
+// 0 alone. Returns false for unknown names. Workloads:
+//   demo             the compiler.py layer
+//   gemm512          16x512 inputs times 512x512 weights
+//   batch1024        1024x128 times 128x128
+//   batch1024-tiled  the same with one MMC per 16-row tile
+//   mlp              256x128 through two 128x128 layers
+//   gemm256, gemm1024, gemm4096  square GEMMs of that size
+//   mlp1024          1024x256 through two 256x256 layers
+//   membound         16x1024 times 1024x1024: every weight tile used once
+//   compbound        2048x256 times 256x256: each weight tile feeds 128 rows
+//   pruned           512x512 times 512x512 with 3/4 of W's row blocks zero,
+//                    compressed (run with --zero-skip to skip them in the MXU)
+//   pruned-uncompressed  the same weights stored dense
+//   conv             3x3 convolution, 32x32x32 to 32x32x64, stride 1, pad 1
+//   conv-im2col      the same convolution with im2col on the host
+// Larger workloads need more than the default 4 MB of host memory; see
+// ProgramBuilder::host_memory_mb.
+bool build_workload(const std::string& name, ProgramBuilder& builder, int32_t* expected_first = nullptr,
+                    uint32_t* output_addr = nullptr, int cores = 1, std::vector<int32_t>* expected = nullptr);
@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+// Binary checkpoint encoding: fields are appended in a fixed order as raw
+// host-endian bytes, vectors as a 64-bit length followed by their bytes. A
+// snapshot is only read back by the same build on the same kind of host.
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(std::vector<uint8_t>& out) : out(out) {}
+
+    template <typename T>
+    void pod(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "snapshot fields must be trivially copyable");
+        raw(&value, sizeof(T));
+    }
+    void bytes(const std::vector<uint8_t>& data) {
+        pod(static_cast<uint64_t>(data.size()));
+        raw(data.data(), data.size());
+    }
+    void raw(const void* data, size_t length) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        out.insert(out.end(), p, p + length);
+    }
+
+private:
+    std::vector<uint8_t>& out;
+};
+
+// Reads what SnapshotWriter wrote. Running off the end marks the reader
+// failed; later reads then return zeros, so callers can check ok() once at
+// the end.
+class SnapshotReader {
+public:
+    SnapshotReader(const uint8_t* data, size_t length) : p(data), end(data + length), failed(false) {}
+
+    template <typename T>
+    void pod(T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "snapshot fields must be trivially copyable");
+        raw(&value, sizeof(T));
+    }
+    template <typename T>
+    T get() {
+        T value;
+        pod(value);
+        return value;
+    }
+    void bytes(std::vector<uint8_t>& data) {
+        uint64_t length = get<uint64_t>();
+        if (length > static_cast<uint64_t>(end - p)) {
+            failed = true;
+            length = 0;
+        }
+        data.resize(length);
+        raw(data.data(), length);
+    }
+    void raw(void* data, size_t length) {
+        if (failed || length > static_cast<size_t>(end - p)) {
+            failed = true;
+            if (length) std::memset(data, 0, length);
+            return;
+        }
+        if (length) std::memcpy(data, p, length);
+        p += length;
+    }
+    void fail() { failed = true; }
+    bool ok() const { return !failed; }
+    bool at_end() const { return p == end; }
+    size_t remaining() const { return static_cast<size_t>(end - p); }
+
+private:
+    const uint8_t* p;
+    const uint8_t* end;
+    bool failed;
+};
@@ -0,0 +1,342 @@
+// Design-space sweep: runs every combination of workload and configuration
+// values on a pool of threads and writes one result row per design point.
+//
+//   tpu_sweep [--base=FILE] [--set=key=value]... [--grid=FILE] [--axis=key=v1,v2,...]...
+//             [--workload=builtin | --workload=name:program.bin:memory.bin]... [--threads=N]
+//             [--max-cycles=N] [--csv=FILE] [--json=FILE]
+//
+// A grid file holds one axis per line, "key = v1, v2, ..." with the same keys
+// as a config file. Each workload's program and memory image are loaded once
+// and shared read-only by all the TPUs that run it.
+#include "tpu.h"
+#include "work_pool.h"
+#include "program_builder.h"
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <chrono>
+#include <iomanip>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+// --threads=0 means one per hardware thread.
+const uint64_t MAX_THREADS = 1024;
+
+struct Workload {
+    std::string name;
+    std::vector<Instruction> program;
+    HostMemory::Image image;
+    size_t host_memory_mb;   // at least this much, whatever the config says
+    bool builtin;
+
+    Workload() : host_memory_mb(0), builtin(false) {}
+};
+
+struct Axis {
+    std::string key;
+    std::vector<std::string> values;
+};
+
+struct RunResult {
+    std::string status;
+    TPU::PerformanceStats stats;
+    uint64_t macs;
+    uint64_t dma_bytes;
+    double clock_mhz;
+
+    RunResult() : macs(0), dma_bytes(0), clock_mhz(1.0) {}
+};
+
+std::string trim(const std::string& s) {
+    size_t begin = s.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) return "";
+    size_t end = s.find_last_not_of(" \t\r");
+    return s.substr(begin, end - begin + 1);
+}
+
+bool read_file(const std::string& filepath, std::vector<uint8_t>& out) {
+    std::ifstream file(filepath, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) { std::cerr << "ERROR: Cannot open " << filepath << std::endl; return false; }
+    std::streamsize size = file.tellg();
+    file.seekg(0, std::ios::beg);
+    out.resize(size);
+    if (!file.read(reinterpret_cast<char*>(out.data()), size)) {
+        std::cerr << "ERROR: Failed to read " << filepath << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool load_workload(const std::string& spec, Workload& workload) {
+    if (spec.find(':') == std::string::npos) {
+        ProgramBuilder builder;
+        if (!build_workload(spec, builder)) {
+            std::cerr << "ERROR: Unknown built-in workload: " << spec << std::endl;
+            return false;
+        }
+        workload.name = spec;
+        workload.builtin = true;
+        workload.program = builder.program();
+        workload.image = builder.image();
+        workload.host_memory_mb = builder.host_memory_mb();
+        return true;
+    }
+    size_t first = spec.find(':');
+    size_t second = first == std::string::npos ? std::string::npos : spec.find(':', first + 1);
+    if (second == std::string::npos) {
+        std::cerr << "ERROR: Workload must be name:program.bin:memory.bin, got " << spec << std::endl;
+        return false;
+    }
+    workload.name = spec.substr(0, first);
+    std::vector<uint8_t> program_bytes;
+    if (!read_file(spec.substr(first + 1, second - first - 1), program_bytes)) return false;
+    HostMemory::Image image = HostImage::map_file(spec.substr(second + 1));
+    if (!image) return false;
+    if (program_bytes.size() % sizeof(Instruction) != 0) {
+        std::cerr << "ERROR: Program file size is wrong for workload " << workload.name << std::endl;
+        return false;
+    }
+    workload.program.resize(program_bytes.size() / sizeof(Instruction));
+    if (!program_bytes.empty()) std::memcpy(workload.program.data(), program_bytes.data(), program_bytes.size());
+    workload.image = image;
+    return true;
+}
+
+bool parse_axis(const std::string& line, std::vector<Axis>& axes) {
+    size_t eq = line.find('=');
+    if (eq == std::string::npos) {
+        std::cerr << "ERROR: Axis must be key = v1, v2, ..., got " << line << std::endl;
+        return false;
+    }
+    Axis axis;
+    axis.key = trim(line.substr(0, eq));
+    std::stringstream values(line.substr(eq + 1));
+    std::string value;
+    while (std::getline(values, value, ',')) {
+        value = trim(value);
+        if (!value.empty()) axis.values.push_back(value);
+    }
+    // Check every value once up front rather than failing inside the workers.
+    TPUConfig probe;
+    for (const auto& v : axis.values) {
+        if (!set_config_value(probe, axis.key, v)) return false;
+    }
+    if (axis.values.empty()) {
+        std::cerr << "ERROR: Axis " << axis.key << " has no values" << std::endl;
+        return false;
+    }
+    axes.push_back(axis);
+    return true;
+}
+
+bool load_grid(const std::string& filepath, std::vector<Axis>& axes) {
+    std::ifstream file(filepath);
+    if (!file.is_open()) { std::cerr << "ERROR: Bad grid file: " << filepath << std::endl; return false; }
+    std::string line;
+    while (std::getline(file, line)) {
+        line = trim(line.substr(0, line.find('#')));
+        if (!line.empty() && !parse_axis(line, axes)) return false;
+    }
+    return true;
+}
+
+RunResult run_point(TPUConfig config, const Workload& workload, uint64_t max_cycles) {
+    RunResult result;
+    result.clock_mhz = config.clock_mhz;
+    config.host_memory_mb = std::max(config.host_memory_mb, workload.host_memory_mb);
+    // A design point that fails, even while building its TPU (e.g. bad_alloc
+    // for a huge array), reports the error as its status; the rest still run.
+    try {
+        TPU tpu(config);
+        tpu.load_program(workload.program);
+        tpu.map_host_image(workload.image);
+        try {
+            while (!tpu.is_halted() && tpu.get_cycle_count() <= max_cycles) tpu.tick();
+            result.status = tpu.is_halted() ? "ok" : "timeout";
+        } catch (const std::exception& e) {
+            result.status = std::string("error: ") + e.what();
+        }
+        result.stats = tpu.get_stats();
+        result.macs = tpu.get_mac_count();
+        result.dma_bytes = tpu.get_dma_bytes();
+    } catch (const std::exception& e) {
+        result.status = std::string("error: ") + e.what();
+    }
+    return result;
+}
+
+std::string json_string(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+std::string csv_field(const std::string& s) {
+    if (s.find_first_of(",\"") == std::string::npos) return s;
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"') out += '"';
+        out += c;
+    }
+    return out + "\"";
+}
+
+// Derived metrics, in the same units as the performance report.
+std::vector<std::pair<std::string, double>> metrics(const RunResult& r) {
+    const TPU::PerformanceStats& s = r.stats;
+    double cycles = s.total_cycles ? (double)s.total_cycles : 1.0;
+    double seconds = cycles / (r.clock_mhz * 1e6);
+    return {
+        {"cycles", (double)s.total_cycles},
+        {"instructions", (double)s.instruction_count},
+        {"cpi", s.instruction_count ? s.total_cycles / (double)s.instruction_count : 0.0},
+        {"stall_pct", s.stall_cycles / cycles * 100.0},
+        {"host_util_pct", s.host_mem_busy_cycles / cycles * 100.0},
+        {"ub_util_pct", s.ub_busy_cycles / cycles * 100.0},
+        {"acc_util_pct", s.acc_busy_cycles / cycles * 100.0},
+        {"mxu_util_pct", s.mxu_busy_cycles / cycles * 100.0},
+        {"gops", r.macs * 2.0 / seconds / 1e9},
+        {"dma_gbps", r.dma_bytes / seconds / 1e9},
+    };
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    TPUConfig base;
+    std::vector<Axis> axes;
+    std::vector<Workload> workloads;
+    size_t threads = 0;
+    uint64_t max_cycles = 5000000;
+    std::string csv_path, json_path;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool ok = true;
+        if (arg.rfind("--base=", 0) == 0) {
+            ok = load_config_file(arg.substr(7), base);
+        } else if (arg.rfind("--set=", 0) == 0) {
+            size_t eq = arg.find('=', 6);
+            ok = eq != std::string::npos && set_config_value(base, arg.substr(6, eq - 6), arg.substr(eq + 1));
+        } else if (arg.rfind("--grid=", 0) == 0) {
+            ok = load_grid(arg.substr(7), axes);
+        } else if (arg.rfind("--axis=", 0) == 0) {
+            ok = parse_axis(arg.substr(7), axes);
+        } else if (arg.rfind("--workload=", 0) == 0) {
+            workloads.emplace_back();
+            ok = load_workload(arg.substr(11), workloads.back());
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            uint64_t n = 0;
+            ok = parse_count(arg.substr(10), MAX_THREADS, n);
+            threads = static_cast<size_t>(n);
+        } else if (arg.rfind("--max-cycles=", 0) == 0) {
+            ok = parse_count(arg.substr(13), UINT64_MAX, max_cycles);
+        } else if (arg.rfind("--csv=", 0) == 0) {
+            csv_path = arg.substr(6);
+        } else if (arg.rfind("--json=", 0) == 0) {
+            json_path = arg.substr(7);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            std::cerr << "Usage: " << argv[0] << " [--base=FILE] [--set=key=value]... [--grid=FILE]"
+                      << " [--axis=key=v1,v2,...]... [--workload=demo|name:program.bin:memory.bin]..."
+                      << " [--threads=N] [--max-cycles=N] [--csv=FILE] [--json=FILE]" << std::endl;
+            return 1;
+        }
+    }
+    if (workloads.empty()) {
+        workloads.emplace_back();
+        if (!load_workload("demo", workloads.back())) return 1;
+    }
+    base.verbose = false;
+    // Built-in workloads only fit the array size they were tiled for, so
+    // check every array size the sweep will try.
+    std::vector<int> array_sizes;
+    for (const auto& axis : axes) {
+        if (axis.key != "array_size") continue;
+        for (const auto& v : axis.values) {
+            TPUConfig probe;
+            set_config_value(probe, axis.key, v);
+            array_sizes.push_back(probe.array_size);
+        }
+    }
+    if (array_sizes.empty()) array_sizes.push_back(base.array_size);
+    for (const auto& workload : workloads) {
+        if (!workload.builtin) continue;
+        for (int size : array_sizes) {
+            if (!check_builtin_array_size(size, workload.name)) return 1;
+        }
+    }
+
+    // Design points are numbered workload-major, then by each axis in turn
+    // with the last axis varying fastest.
+    size_t configs_per_workload = 1;
+    for (const auto& axis : axes) configs_per_workload *= axis.values.size();
+    size_t total = workloads.size() * configs_per_workload;
+    auto value_index = [&](size_t point, size_t axis) {
+        size_t rest = point % configs_per_workload;
+        for (size_t a = axes.size(); a-- > axis + 1;) rest /= axes[a].values.size();
+        return rest % axes[axis].values.size();
+    };
+
+    std::vector<RunResult> results(total);
+    WorkStealingPool pool(threads);
+    auto start = std::chrono::steady_clock::now();
+    pool.run(total, [&](size_t point) {
+        TPUConfig config = base;
+        for (size_t a = 0; a < axes.size(); ++a) {
+            set_config_value(config, axes[a].key, axes[a].values[value_index(point, a)]);
+        }
+        results[point] = run_point(config, workloads[point / configs_per_workload], max_cycles);
+    });
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "Ran " << total << " design points on " << pool.size() << " threads in "
+              << std::fixed << std::setprecision(2) << seconds << " s" << std::endl;
+
+    if (csv_path.empty() && json_path.empty()) csv_path = "-";
+    if (!csv_path.empty()) {
+        std::ofstream file;
+        if (csv_path != "-") file.open(csv_path);
+        std::ostream& out = csv_path == "-" ? std::cout : file;
+        if (!out) { std::cerr << "ERROR: Cannot write " << csv_path << std::endl; return 1; }
+        out << "workload";
+        for (const auto& axis : axes) out << "," << axis.key;
+        out << ",status";
+        for (const auto& m : metrics(RunResult())) out << "," << m.first;
+        out << "\n" << std::fixed << std::setprecision(2);
+        for (size_t p = 0; p < total; ++p) {
+            out << csv_field(workloads[p / configs_per_workload].name);
+            for (size_t a = 0; a < axes.size(); ++a) out << "," << csv_field(axes[a].values[value_index(p, a)]);
+            out << "," << csv_field(results[p].status);
+            for (const auto& m : metrics(results[p])) out << "," << m.second;
+            out << "\n";
+        }
+    }
+    if (!json_path.empty()) {
+        std::ofstream file;
+        if (json_path != "-") file.open(json_path);
+        std::ostream& out = json_path == "-" ? std::cout : file;
+        if (!out) { std::cerr << "ERROR: Cannot write " << json_path << std::endl; return 1; }
+        out << "[\n" << std::fixed << std::setprecision(2);
+        for (size_t p = 0; p < total; ++p) {
+            out << "  {\"workload\": " << json_string(workloads[p / configs_per_workload].name);
+            for (size_t a = 0; a < axes.size(); ++a) {
+                out << ", " << json_string(axes[a].key) << ": " << json_string(axes[a].values[value_index(p, a)]);
+            }
+            out << ", \"status\": " << json_string(results[p].status);
+            for (const auto& m : metrics(results[p])) out << ", \"" << m.first << "\": " << m.second;
+            out << "}" << (p + 1 < total ? "," : "") << "\n";
+        }
+        out << "]\n";
+    }
+    return 0;
+}
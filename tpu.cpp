@@ -1,17 +1,170 @@
 #include "tpu.h"
+#include "alloc_counter.h"
 #include <iostream>
 #include <fstream>
 #include <cstring>
 #include <iomanip>
+#include <algorithm>
+#include <cmath>
+#include <random>
 
-int LATENCY_HOST_MEM_READ = 100;
-int LATENCY_HOST_MEM_WRITE = 100;
+int opcode_index(OpCode opcode) {
+    switch (opcode) {
+        case OpCode::RHM: return 0;
+        case OpCode::WHM: return 1;
+        case OpCode::RW:  return 2;
+        case OpCode::MMC: return 3;
+        case OpCode::ACT: return 4;
+        case OpCode::CFG: return 5;
+        case OpCode::HLT: return 6;
+        case OpCode::SYNC: return 7;
+        case OpCode::CONV: return 8;
+    }
+    return -1;
+}
+
+const char* opcode_name(OpCode opcode) {
+    switch (opcode) {
+        case OpCode::RHM: return "RHM";
+        case OpCode::WHM: return "WHM";
+        case OpCode::RW:  return "RW";
+        case OpCode::MMC: return "MMC";
+        case OpCode::ACT: return "ACT";
+        case OpCode::CFG: return "CFG";
+        case OpCode::HLT: return "HLT";
+        case OpCode::SYNC: return "SYNC";
+        case OpCode::CONV: return "CONV";
+    }
+    return "???";
+}
+
+const char* state_name(ControllerState state) {
+    switch (state) {
+        case ControllerState::FETCH:                   return "Fetch";
+        case ControllerState::DECODE:                  return "Decode";
+        case ControllerState::EXECUTE_RHM_READ_HOST:   return "RHM read host";
+        case ControllerState::EXECUTE_RHM_WRITE_UB:    return "RHM write UB";
+        case ControllerState::EXECUTE_RW_READ_HOST:    return "RW read host";
+        case ControllerState::EXECUTE_RW_LOAD_FIFO:    return "RW load FIFO";
+        case ControllerState::EXECUTE_MMC_READ_UB:     return "MMC read UB";
+        case ControllerState::EXECUTE_MMC_READ_FIFO:   return "MMC read FIFO";
+        case ControllerState::EXECUTE_MMC_EXECUTE:     return "MMC execute";
+        case ControllerState::EXECUTE_MMC_WRITE_ACC:   return "MMC write ACC";
+        case ControllerState::EXECUTE_ACT_RUN:         return "ACT run";
+        case ControllerState::EXECUTE_ACT_WRITE_UB:    return "ACT write UB";
+        case ControllerState::EXECUTE_WHM_READ_ACC:    return "WHM read ACC";
+        case ControllerState::EXECUTE_WHM_WRITE_HOST:  return "WHM write host";
+        case ControllerState::HALTED:                  return "Halted";
+    }
+    return "???";
+}
 
-TPU::TPU(size_t host_memory_size_mb) 
-    : controller_state(ControllerState::FETCH), instruction_pointer(0),
-      host_mem_state(HostMemState::IDLE), host_mem_cycles_remaining(0) {
-    host_memory.resize(host_memory_size_mb * 1024 * 1024, 0); 
-    std::cout << "--- Booting C++ TPU Simulator ---" << std::endl;
+namespace {
+
+const char* const QUEUED_STATE = "Queued";
+const char* const UNIT_NAMES[STALL_UNITS] = {"Host Memory", "Unified Buffer", "Matrix Unit", "Accumulator",
+                                             "Weight FIFO", "Issue (hazard)", "Issue (queue full)", "Sync barrier"};
+const char* const UNIT_KEYS[STALL_UNITS] = {"host_memory", "unified_buffer", "matrix_unit", "accumulator",
+                                            "weight_fifo", "issue_hazard", "issue_queue_full", "sync"};
+const char* const UNIT_TRACE_NAMES[4] = {"Host DMA busy", "UB busy", "MXU busy", "ACC busy"};
+const int FIRST_UNIT_TRACK = 1;
+const int FIRST_SLOT_TRACK = FIRST_UNIT_TRACK + 4;
+
+// Nonzero stall_breakdown entries as (cycles, flattened key), largest first.
+std::vector<std::pair<uint64_t, int>> sorted_stalls(const uint64_t* breakdown) {
+    std::vector<std::pair<uint64_t, int>> out;
+    for (int key = 0; key < OPCODE_KINDS * CONTROLLER_STATES * STALL_UNITS; ++key) {
+        if (breakdown[key]) out.emplace_back(breakdown[key], key);
+    }
+    std::sort(out.begin(), out.end(), [](const std::pair<uint64_t, int>& a, const std::pair<uint64_t, int>& b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    });
+    return out;
+}
+
+const OpCode OPCODE_BY_INDEX[OPCODE_KINDS] = {OpCode::RHM, OpCode::WHM, OpCode::RW, OpCode::MMC,
+                                              OpCode::ACT, OpCode::CFG, OpCode::HLT, OpCode::SYNC, OpCode::CONV};
+
+// Upper bound of the histogram bucket holding the q-quantile.
+uint64_t latency_quantile(const TPU::PerformanceStats::LatencyHistogram& h, double q) {
+    uint64_t seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+        seen += h.buckets[b];
+        if (seen >= q * h.count) return b == 0 ? 0 : std::min(h.max, (uint64_t(1) << b) - 1);
+    }
+    return h.max;
+}
+
+std::vector<TPU::PerformanceStats::SlowInstruction> sorted_slowest(const TPU::PerformanceStats& stats) {
+    std::vector<TPU::PerformanceStats::SlowInstruction> out(stats.slowest, stats.slowest + stats.slowest_count);
+    std::sort(out.begin(), out.end(), [](const TPU::PerformanceStats::SlowInstruction& a,
+                                         const TPU::PerformanceStats::SlowInstruction& b) {
+        return a.latency > b.latency || (a.latency == b.latency && a.issue_cycle < b.issue_cycle);
+    });
+    return out;
+}
+
+} // namespace
+
+TPU::TPU(const TPUConfig& config) 
+    : config(config),
+      unified_buffer(config.ub_size_kb, config.latency_ub_read, config.latency_ub_write),
+      weight_fifo(config.weight_fifo_depth),
+      systolic_array(config.array_size, config.latency_mxu),
+      accumulator(config.acc_entries, config.latency_acc_read, config.latency_acc_write, config.latency_activate,
+                  config.latency_acc_accumulate),
+      last_conv_fmap(0), controller_state(ControllerState::FETCH), instruction_pointer(0), current_op(nullptr), in_order(false),
+      weight_tiles_decoded(0), weight_pops_decoded(0), mmcs_decoded(0),
+      weight_tiles_loaded(0), weight_tiles_popped(0), mmcs_executed(0), fetch_limit(UINT64_MAX),
+      host_memory(&own_host_memory), dma(config.dma), barrier(nullptr), sync_arrived(false), sync_generation(0),
+      fast_forward(true), tick_progress(false),
+      tick_unit_stalls(), stall_opcode(0), stall_state(0), fetch_cycle(0), front_trace_state(nullptr), front_trace_since(0),
+      unit_traced_busy(), unit_trace_since() {
+    host_memory->resize(config.host_memory_mb * 1024 * 1024);
+    // Size every transfer buffer for the largest MXU result up front so
+    // that swapping them between components never has to grow them.
+    const size_t result_bytes = max_result_bytes();
+    unified_buffer.reserve_buffers(result_bytes);
+    weight_fifo.reserve_buffers(result_bytes);
+    weight_scratch.reserve(result_bytes);
+    systolic_array.reserve_buffers(result_bytes);
+    accumulator.reserve_buffers(result_bytes);
+    systolic_array.set_timing_model(config.mxu_timing);
+    systolic_array.set_zero_skip(config.mxu_zero_skip);
+    set_issue_queue_depth(config.issue_queue_depth);
+    if (config.verbose) std::cout << "--- Booting C++ TPU Simulator ---" << std::endl;
+}
+
+void TPU::attach_to_chip(HostMemory& shared_memory, HostPort& port, SyncBarrier& chip_barrier) {
+    own_host_memory.resize(0);
+    host_memory = &shared_memory;
+    dma.attach_port(&port);
+    barrier = &chip_barrier;
+}
+
+void TPU::set_mxu_timing(MxuTiming model) {
+    config.mxu_timing = model;
+    systolic_array.set_timing_model(model);
+}
+
+void TPU::set_dma_config(const DmaConfig& dma_config) {
+    config.dma = dma_config;
+    dma.configure(dma_config);
+}
+
+void TPU::set_issue_queue_depth(size_t depth) {
+    config.issue_queue_depth = depth;
+    in_order = depth == 0;
+    const size_t result_bytes = max_result_bytes();
+    slots.resize(in_order ? 1 : depth);
+    for (auto& slot : slots) {
+        slot.active = false;
+        slot.buffer_a.reserve(result_bytes);
+        slot.buffer_b.reserve(result_bytes);
+    }
+    issue_order.clear();
+    issue_order.reserve(slots.size());
+    tick_stall_keys.reserve(slots.size() + 1);
 }
 
 void TPU::load_program(const std::string& filepath) {
@@ -23,182 +176,1160 @@ void TPU::load_program(const std::string& filepath) {
         std::cerr << "ERROR: Program file size is wrong!" << std::endl;
         return;
     }
-    program.resize(size / sizeof(Instruction));
-    if (!file.read(reinterpret_cast<char*>(program.data()), size)) {
+    std::vector<Instruction> instructions(size / sizeof(Instruction));
+    if (!file.read(reinterpret_cast<char*>(instructions.data()), size)) {
         std::cerr << "ERROR: Failed to read program file." << std::endl;
     }
+    predecode(instructions);
 }
 
-void TPU::load_host_memory(const std::string& filepath) {
-    std::ifstream file(filepath, std::ios::binary | std::ios::ate);
-    if (!file.is_open()) { std::cerr << "ERROR: Bad memory file: " << filepath << std::endl; return; }
-    std::streamsize size = file.tellg();
-    file.seekg(0, std::ios::beg);
-    if (size > host_memory.size()) { std::cerr << "ERROR: Memory file too big!" << std::endl; return; }
-    if (!file.read(reinterpret_cast<char*>(host_memory.data()), size)) {
-        std::cerr << "ERROR: Failed to read memory file." << std::endl;
+void TPU::load_program(const std::vector<Instruction>& instructions) {
+    predecode(instructions);
+}
+
+namespace {
+
+// Byte ranges each opcode reads and writes on host memory, the UB and the
+// accumulator.
+Claims claims_of(const Instruction& instr) {
+    Claims claims;
+    switch (instr.opcode) {
+        case OpCode::RHM:
+            claims.host_read = AddressRange(host_address(instr), instr.length);
+            claims.ub_write = AddressRange(instr.data_addr, instr.length);
+            break;
+        case OpCode::RW:
+            claims.host_read = AddressRange(host_address(instr), instr.length);
+            break;
+        case OpCode::MMC:
+            claims.ub_read = AddressRange(instr.data_addr, instr.length);
+            claims.acc_write = AddressRange(instr.host_addr, static_cast<uint64_t>(instr.length) * sizeof(int32_t));
+            if (instr.flags & FLAG_MMC_ACCUMULATE) claims.acc_read = claims.acc_write;
+            break;
+        case OpCode::CONV:
+            // The feature map's size comes from CFG registers; until decode
+            // narrows it, assume it runs to the end of the UB.
+            claims.ub_read = AddressRange(instr.data_addr, UINT32_MAX);
+            claims.acc_write = AddressRange(instr.host_addr, static_cast<uint64_t>(instr.length) * sizeof(int32_t));
+            if (instr.flags & FLAG_MMC_ACCUMULATE) claims.acc_read = claims.acc_write;
+            break;
+        case OpCode::ACT:
+            claims.acc_read = AddressRange(instr.data_addr, static_cast<uint64_t>(instr.length) * sizeof(int32_t));
+            if (instr.flags & FLAG_ACT_TO_UB) {
+                claims.ub_write = AddressRange(instr.host_addr, instr.length);
+            } else {
+                claims.acc_write = claims.acc_read;
+            }
+            break;
+        case OpCode::WHM:
+            claims.acc_read = AddressRange(instr.data_addr, instr.length);
+            claims.host_write = AddressRange(host_address(instr), instr.length);
+            break;
+        default:
+            break;
     }
+    return claims;
+}
+
+const uint64_t SAMPLE_SEED = 0x5eed;   // run_sampled's window offsets
+
+// Two-sided 95 % Student t quantile; with few windows the normal 1.96
+// understates the interval.
+double t95(uint64_t degrees) {
+    static const double TABLE[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                   2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                   2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    return degrees >= 1 && degrees <= 30 ? TABLE[degrees - 1] : 1.96;
+}
+
+const uint32_t HAZARD_WINDOW = 64;   // bits in MicroOp::hazard_mask
+
+// CFG: the activation registers, then the convolution ones.
+bool set_cfg_register(ActivationParams& act, ConvParams& conv, uint32_t reg, int32_t value) {
+    return reg < CFG_CONV_HEIGHT ? act.set(reg, value) : conv.set(reg, value);
 }
 
-void TPU::tick_host_memory() {
-    if (host_mem_state == HostMemState::BUSY) {
-        host_mem_cycles_remaining--;
-        if (host_mem_cycles_remaining <= 0) {
-            host_mem_state = HostMemState::IDLE;
+} // namespace
+
+void TPU::predecode(const std::vector<Instruction>& instructions) {
+    micro_ops.assign(instructions.size(), MicroOp());
+    for (size_t pc = 0; pc < instructions.size(); ++pc) {
+        MicroOp& op = micro_ops[pc];
+        const Instruction& instr = instructions[pc];
+        op.instr = instr;
+        op.kind = DecodeKind::ISSUE;
+        op.first_stage = ControllerState::FETCH;
+        op.error = nullptr;
+        op.hazard_mask = 0;
+        switch (instr.opcode) {
+            case OpCode::RHM: op.first_stage = ControllerState::EXECUTE_RHM_READ_HOST; break;
+            case OpCode::WHM: op.first_stage = ControllerState::EXECUTE_WHM_READ_ACC;  break;
+            case OpCode::RW:  op.first_stage = ControllerState::EXECUTE_RW_READ_HOST;  break;
+            case OpCode::MMC: op.first_stage = ControllerState::EXECUTE_MMC_READ_UB;   break;
+            // CONV differs from MMC only in how the UB builds its input rows.
+            case OpCode::CONV: op.first_stage = ControllerState::EXECUTE_MMC_READ_UB;  break;
+            case OpCode::ACT:
+                op.first_stage = ControllerState::EXECUTE_ACT_RUN;
+                if ((instr.flags & ACT_FUNC_MASK) >= ACT_FUNC_COUNT) {
+                    op.kind = DecodeKind::ERROR;
+                    op.error = "Unknown activation function";
+                }
+                break;
+            case OpCode::CFG: {
+                ActivationParams act_scratch;
+                ConvParams conv_scratch;
+                op.kind = DecodeKind::CFG;
+                if (!set_cfg_register(act_scratch, conv_scratch, instr.data_addr, static_cast<int32_t>(instr.host_addr))) {
+                    op.kind = DecodeKind::ERROR;
+                    op.error = "Bad CFG register or value";
+                }
+                break;
+            }
+            case OpCode::HLT: op.kind = DecodeKind::HLT; break;
+            case OpCode::SYNC: op.kind = DecodeKind::SYNC; break;
+            default:
+                op.kind = DecodeKind::ERROR;
+                op.error = "Unknown opcode";
+                break;
+        }
+        if (op.kind != DecodeKind::ISSUE) {
+            op.superblock_start = static_cast<uint32_t>(pc + 1);
+            continue;
         }
+        op.claims = claims_of(instr);
+        op.superblock_start = pc > 0 && micro_ops[pc - 1].kind == DecodeKind::ISSUE
+                                  ? micro_ops[pc - 1].superblock_start : static_cast<uint32_t>(pc);
+        for (uint32_t distance = 1; distance <= HAZARD_WINDOW && distance <= pc - op.superblock_start; ++distance) {
+            if (op.claims.conflicts_with(micro_ops[pc - distance].claims)) op.hazard_mask |= uint64_t(1) << (distance - 1);
+        }
+    }
+}
+
+// The file is mapped, not read: nothing is loaded until the program
+// touches it, and nothing is copied until it writes.
+void TPU::load_host_memory(const std::string& filepath) {
+    HostMemory::Image image = HostImage::map_file(filepath);
+    if (image) map_host_image(image);
+}
+
+void TPU::load_host_memory(const uint8_t* data, size_t length) {
+    if (length > host_memory->size()) { std::cerr << "ERROR: Memory image too big!" << std::endl; return; }
+    host_memory->resize(host_memory->size());
+    host_memory->write(0, data, length);
+}
+
+void TPU::map_host_image(const HostMemory::Image& image) {
+    if (image->size() > host_memory->size()) { std::cerr << "ERROR: Memory image too big!" << std::endl; return; }
+    host_memory->map_image(image);
+}
+
+void TPU::read_host_memory(uint64_t addr, uint8_t* out, size_t length) const {
+    host_memory->read(addr, out, length);
+}
+
+void TPU::write_host_memory(uint64_t addr, const uint8_t* data, size_t length) {
+    host_memory->write(addr, data, length);
+}
+
+// Idle means the issue queue is empty and every unit has finished, so the
+// slots, the weight FIFO counters and the units are already as a fresh
+// start would need them.
+void TPU::restart(uint32_t entry) {
+    controller_state = ControllerState::FETCH;
+    instruction_pointer = entry;
+    current_op = nullptr;
+    last_conv = ConvParams();
+}
+
+namespace {
+
+const char CHECKPOINT_MAGIC[8] = {'T', 'P', 'U', 'C', 'K', 'P', 'T', '1'};
+
+// Everything a checkpoint's layout depends on; timing parameters may differ.
+struct CheckpointShape {
+    int32_t array_size;
+    uint64_t ub_size_kb;
+    uint64_t acc_entries;
+    uint64_t weight_fifo_depth;
+    uint64_t host_memory_bytes;
+    uint64_t issue_slots;
+    bool in_order;
+    uint64_t program_length;
+    uint64_t program_fingerprint;
+
+    // Zeroes the padding too, so checkpoints are byte-for-byte deterministic.
+    CheckpointShape() { std::memset(this, 0, sizeof(*this)); }
+    CheckpointShape(const TPUConfig& config, uint64_t fifo_depth, uint64_t memory_bytes, uint64_t slots,
+                    bool in_order, uint64_t length, uint64_t fingerprint)
+        : CheckpointShape() {
+        array_size = config.array_size;
+        ub_size_kb = config.ub_size_kb;
+        acc_entries = config.acc_entries;
+        weight_fifo_depth = fifo_depth;
+        host_memory_bytes = memory_bytes;
+        issue_slots = slots;
+        this->in_order = in_order;
+        program_length = length;
+        program_fingerprint = fingerprint;
+    }
+
+    bool operator==(const CheckpointShape& o) const {
+        return array_size == o.array_size && ub_size_kb == o.ub_size_kb && acc_entries == o.acc_entries &&
+               weight_fifo_depth == o.weight_fifo_depth && host_memory_bytes == o.host_memory_bytes &&
+               issue_slots == o.issue_slots && in_order == o.in_order && program_length == o.program_length &&
+               program_fingerprint == o.program_fingerprint;
     }
+};
+
+} // namespace
+
+// FNV-1a over the instruction words.
+uint64_t TPU::program_fingerprint() const {
+    uint64_t hash = 1469598103934665603ull;
+    for (const MicroOp& op : micro_ops) {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&op.instr);
+        for (size_t i = 0; i < sizeof(Instruction); ++i) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+void TPU::save_state(std::vector<uint8_t>& out) const {
+    out.clear();
+    SnapshotWriter w(out);
+    w.raw(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    CheckpointShape shape(config, weight_fifo.depth(), host_memory->size(), slots.size(), in_order, micro_ops.size(),
+                          program_fingerprint());
+    w.pod(shape);
+
+    w.pod(controller_state);
+    w.pod(instruction_pointer);
+    w.pod(static_cast<int64_t>(current_op ? current_op - micro_ops.data() : -1));
+    w.pod(fetch_cycle);
+    w.pod(fetch_limit);
+    w.pod(act_registers);
+    w.pod(conv_registers);
+    w.pod(last_conv);
+    w.pod(last_conv_fmap);
+    w.pod(sync_arrived);
+    w.pod(sync_generation);
+    for (const InFlight& slot : slots) {
+        w.pod(slot.active);
+        if (!slot.active) continue;
+        w.pod(slot.dispatched);
+        w.pod(slot.issued_this_cycle);
+        w.pod(slot.result_taken);
+        w.pod(slot.instr);
+        w.pod(slot.stage);
+        w.pod(slot.ticket);
+        w.pod(static_cast<const Claims&>(slot));
+        w.pod(slot.weight_seq);
+        w.pod(slot.mxu_seq);
+        w.pod(slot.act_params);
+        w.pod(slot.conv_params);
+        w.pod(slot.issue_cycle);
+        w.pod(slot.seq);
+        w.pod(slot.pc);
+        w.pod(slot.fetch_cycle);
+        w.bytes(slot.buffer_a);
+        w.bytes(slot.buffer_b);
+    }
+    w.pod(static_cast<uint64_t>(issue_order.size()));
+    for (size_t idx : issue_order) w.pod(static_cast<uint64_t>(idx));
+    w.pod(weight_tiles_decoded);
+    w.pod(weight_pops_decoded);
+    w.pod(mmcs_decoded);
+    w.pod(weight_tiles_loaded);
+    w.pod(weight_tiles_popped);
+    w.pod(mmcs_executed);
+    w.pod(static_cast<uint64_t>(weight_backlog.size()));
+    for (const auto& tile : weight_backlog) w.bytes(tile);
+    w.pod(stats);
+
+    unified_buffer.save(w);
+    weight_fifo.save(w);
+    systolic_array.save(w);
+    accumulator.save(w);
+    dma.save(w);
+    host_memory->save(w);
 }
 
-bool TPU::host_read_request(uint32_t addr, uint32_t length) {
-    if (host_mem_state == HostMemState::BUSY) return false;
-    host_mem_state = HostMemState::BUSY;
-    host_mem_cycles_remaining = LATENCY_HOST_MEM_READ;
-    data_buffer_a.clear();
-    data_buffer_a.resize(length, 0);
-    for (uint32_t i = 0; i < length; ++i) {
-        if (addr + i < host_memory.size()) data_buffer_a[i] = host_memory[addr + i];
+bool TPU::restore_state(const std::vector<uint8_t>& snapshot) {
+    SnapshotReader r(snapshot.data(), snapshot.size());
+    char magic[sizeof(CHECKPOINT_MAGIC)];
+    r.raw(magic, sizeof(magic));
+    if (!r.ok() || std::memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0) {
+        std::cerr << "ERROR: Not a TPU checkpoint" << std::endl;
+        return false;
+    }
+    CheckpointShape shape(config, weight_fifo.depth(), host_memory->size(), slots.size(), in_order, micro_ops.size(),
+                          program_fingerprint());
+    if (!(r.get<CheckpointShape>() == shape)) {
+        std::cerr << "ERROR: Checkpoint does not match this TPU's sizes, issue queue or program" << std::endl;
+        return false;
+    }
+
+    r.pod(controller_state);
+    r.pod(instruction_pointer);
+    int64_t current = r.get<int64_t>();
+    current_op = current >= 0 && static_cast<uint64_t>(current) < micro_ops.size() ? &micro_ops[current] : nullptr;
+    r.pod(fetch_cycle);
+    r.pod(fetch_limit);
+    r.pod(act_registers);
+    r.pod(conv_registers);
+    r.pod(last_conv);
+    r.pod(last_conv_fmap);
+    r.pod(sync_arrived);
+    r.pod(sync_generation);
+    for (InFlight& slot : slots) {
+        r.pod(slot.active);
+        if (!slot.active) continue;
+        r.pod(slot.dispatched);
+        r.pod(slot.issued_this_cycle);
+        r.pod(slot.result_taken);
+        r.pod(slot.instr);
+        r.pod(slot.stage);
+        r.pod(slot.ticket);
+        r.pod(static_cast<Claims&>(slot));
+        r.pod(slot.weight_seq);
+        r.pod(slot.mxu_seq);
+        r.pod(slot.act_params);
+        r.pod(slot.conv_params);
+        r.pod(slot.issue_cycle);
+        r.pod(slot.seq);
+        r.pod(slot.pc);
+        r.pod(slot.fetch_cycle);
+        r.bytes(slot.buffer_a);
+        r.bytes(slot.buffer_b);
+    }
+    uint64_t in_flight = r.get<uint64_t>();
+    if (in_flight > slots.size()) r.fail();
+    issue_order.clear();
+    for (uint64_t i = 0; i < in_flight && r.ok(); ++i) {
+        uint64_t idx = r.get<uint64_t>();
+        if (idx >= slots.size() || !slots[idx].active) r.fail();
+        issue_order.push_back(static_cast<size_t>(idx));
+    }
+    r.pod(weight_tiles_decoded);
+    r.pod(weight_pops_decoded);
+    r.pod(mmcs_decoded);
+    r.pod(weight_tiles_loaded);
+    r.pod(weight_tiles_popped);
+    r.pod(mmcs_executed);
+    uint64_t backlog = r.get<uint64_t>();
+    weight_backlog.clear();
+    for (uint64_t i = 0; i < backlog && r.ok(); ++i) {
+        weight_backlog.emplace_back();
+        r.bytes(weight_backlog.back());
+    }
+    r.pod(stats);
+
+    unified_buffer.load(r);
+    weight_fifo.load(r);
+    systolic_array.load(r);
+    accumulator.load(r);
+    dma.load(r);
+    host_memory->load(r);
+    if (!r.ok() || !r.at_end() || (controller_state == ControllerState::DECODE && !current_op)) {
+        std::cerr << "ERROR: Corrupt TPU checkpoint" << std::endl;
+        return false;
+    }
+
+    // Tracing restarts from here.
+    uint64_t now = stats.total_cycles;
+    front_trace_state = nullptr;
+    std::fill(std::begin(unit_traced_busy), std::end(unit_traced_busy), false);
+    for (InFlight& slot : slots) {
+        slot.trace_state = slot.dispatched ? state_name(slot.stage) : QUEUED_STATE;
+        slot.trace_since = now;
     }
     return true;
 }
 
-bool TPU::host_write_request(uint32_t addr, const std::vector<uint8_t>& data) {
-    if (host_mem_state == HostMemState::BUSY) return false;
-    host_mem_state = HostMemState::BUSY;
-    host_mem_cycles_remaining = LATENCY_HOST_MEM_WRITE;
-    for (size_t i = 0; i < data.size(); ++i) {
-        if (addr + i < host_memory.size()) host_memory[addr + i] = data[i];
+bool TPU::save_checkpoint(const std::string& filepath) const {
+    std::vector<uint8_t> snapshot;
+    save_state(snapshot);
+    std::ofstream file(filepath, std::ios::binary);
+    if (!file || !file.write(reinterpret_cast<const char*>(snapshot.data()), snapshot.size())) {
+        std::cerr << "ERROR: Cannot write " << filepath << std::endl;
+        return false;
     }
     return true;
 }
 
+bool TPU::load_checkpoint(const std::string& filepath) {
+    std::ifstream file(filepath, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) { std::cerr << "ERROR: Bad checkpoint file: " << filepath << std::endl; return false; }
+    std::vector<uint8_t> snapshot(static_cast<size_t>(file.tellg()));
+    file.seekg(0, std::ios::beg);
+    if (!file.read(reinterpret_cast<char*>(snapshot.data()), snapshot.size())) {
+        std::cerr << "ERROR: Failed to read checkpoint file." << std::endl;
+        return false;
+    }
+    return restore_state(snapshot);
+}
+
+// Data moves when the descriptor is queued; the DMA engine only decides when
+// the transfer completes. Hazard claims keep anyone from observing the early
+// copy.
+uint64_t TPU::host_read_request(uint64_t addr, uint32_t length, std::vector<uint8_t>& out) {
+    uint64_t ticket = dma.submit(length);
+    if (ticket == 0) return 0;
+    out.resize(length);
+    host_memory->read(addr, out.data(), length);
+    return ticket;
+}
+
+uint64_t TPU::host_write_request(uint64_t addr, const std::vector<uint8_t>& data) {
+    uint64_t ticket = dma.submit(static_cast<uint32_t>(data.size()));
+    if (ticket == 0) return 0;
+    host_memory->write(addr, data.data(), data.size());
+    return ticket;
+}
+
 void TPU::tick() {
+    // Copy-on-write page copies are host-memory faults, not the loop's own
+    // allocations; they are counted on their own.
+    uint64_t allocations_before = heap_allocation_count() - host_memory->page_copy_allocations();
+    size_t pages_before = host_memory->private_pages();
+    bool in_mmc = false;
+    for (size_t idx : issue_order) {
+        in_mmc |= slots[idx].instr.opcode == OpCode::MMC || slots[idx].instr.opcode == OpCode::CONV;
+    }
     stats.total_cycles++;
     if (unified_buffer.get_state() == CompState::BUSY) stats.ub_busy_cycles++;
     if (systolic_array.get_state() == CompState::BUSY) stats.mxu_busy_cycles++;
     if (accumulator.get_state() == CompState::BUSY) stats.acc_busy_cycles++;
-    if (host_mem_state == HostMemState::BUSY) stats.host_mem_busy_cycles++;
+    if (dma.get_state() == CompState::BUSY) stats.host_mem_busy_cycles++;
 
     unified_buffer.tick();
     weight_fifo.tick();
     systolic_array.tick();
     accumulator.tick();
-    tick_host_memory();
+    dma.tick();
 
+    // The front end goes first so an instruction issued this cycle starts its
+    // first execute stage next cycle, as it did when decode handed over
+    // directly to the execute states. In-flight instructions then advance
+    // oldest first, which is also their priority for contended units.
+    tick_progress = false;
+    std::fill(std::begin(tick_unit_stalls), std::end(tick_unit_stalls), 0);
+    tick_stall_keys.clear();
     switch (controller_state) {
         case ControllerState::FETCH:   tick_fetch();   break;
         case ControllerState::DECODE:  tick_decode();  break;
-        case ControllerState::HALTED:  break;
-        default:                       tick_execute(); break;
+        default:                       break;
+    }
+    tick_execute();
+    if (TPU_TRACING(tracer)) trace_tick();
+
+    bool stalled = !tick_progress && controller_state != ControllerState::HALTED;
+    if (stalled) stats.stall_cycles++;
+    for (int u = 0; u < static_cast<int>(StallUnit::COUNT); ++u) stats.unit_stall_cycles[u] += tick_unit_stalls[u];
+    for (uint32_t key : tick_stall_keys) (&stats.stall_breakdown[0][0][0])[key]++;
+    if (fast_forward && stalled) skip_cycles(stalled_cycles_ahead());
+
+    uint64_t allocations = heap_allocation_count() - host_memory->page_copy_allocations() - allocations_before;
+    stats.host_page_copies += host_memory->private_pages() - pages_before;
+    stats.heap_allocations += allocations;
+    if (in_mmc) stats.mmc_heap_allocations += allocations;
+}
+
+// If nothing in the controller advanced this cycle, nothing it waits on can
+// change until the earliest busy unit completes, so every cycle before that
+// one is an identical stall cycle: account for them in bulk instead of
+// ticking them.
+int TPU::stalled_cycles_ahead() const {
+    if (tick_progress || controller_state == ControllerState::HALTED) return 0;
+    int skip = -1;
+    auto consider = [&skip](bool busy, int remaining) {
+        if (busy && (skip < 0 || remaining - 1 < skip)) skip = remaining - 1;
+    };
+    consider(unified_buffer.get_state() == CompState::BUSY, unified_buffer.get_cycles_remaining());
+    consider(systolic_array.get_state() == CompState::BUSY, systolic_array.get_cycles_remaining());
+    consider(accumulator.get_state() == CompState::BUSY, accumulator.get_cycles_remaining());
+    consider(dma.get_state() == CompState::BUSY, dma.get_cycles_remaining());
+    return skip;
+}
+
+void TPU::skip_cycles(int skip) {
+    if (skip <= 0) return;
+    stats.total_cycles += skip;
+    stats.stall_cycles += skip;
+    for (int u = 0; u < static_cast<int>(StallUnit::COUNT); ++u) stats.unit_stall_cycles[u] += tick_unit_stalls[u] * skip;
+    for (uint32_t key : tick_stall_keys) (&stats.stall_breakdown[0][0][0])[key] += skip;
+    if (unified_buffer.get_state() == CompState::BUSY) stats.ub_busy_cycles += skip;
+    if (systolic_array.get_state() == CompState::BUSY) stats.mxu_busy_cycles += skip;
+    if (accumulator.get_state() == CompState::BUSY) stats.acc_busy_cycles += skip;
+    if (dma.get_state() == CompState::BUSY) stats.host_mem_busy_cycles += skip;
+
+    unified_buffer.skip_cycles(skip);
+    systolic_array.skip_cycles(skip);
+    accumulator.skip_cycles(skip);
+    dma.skip_cycles(skip);
+}
+
+void TPU::enable_trace(size_t max_spans) {
+    tracer.reset(new Tracer(max_spans));
+    front_trace_state = nullptr;
+    std::fill(std::begin(unit_traced_busy), std::end(unit_traced_busy), false);
+}
+
+// Spans are closed at the end of the cycle in which a state changed.
+void TPU::trace_tick() {
+    uint64_t now = stats.total_cycles;
+    const bool busy[4] = {dma.get_state() == CompState::BUSY, unified_buffer.get_state() == CompState::BUSY,
+                          systolic_array.get_state() == CompState::BUSY, accumulator.get_state() == CompState::BUSY};
+    for (int u = 0; u < 4; ++u) {
+        if (busy[u] == unit_traced_busy[u]) continue;
+        if (unit_traced_busy[u]) tracer->span(FIRST_UNIT_TRACK + u, UNIT_TRACE_NAMES[u], unit_trace_since[u], now);
+        unit_traced_busy[u] = busy[u];
+        unit_trace_since[u] = now;
+    }
+    const char* front = state_name(controller_state);
+    if (front != front_trace_state) {
+        if (front_trace_state && front_trace_since < now) tracer->span(0, front_trace_state, front_trace_since, now);
+        front_trace_state = front;
+        front_trace_since = now;
+    }
+}
+
+void TPU::trace_slot(InFlight& slot, bool retiring) {
+    uint64_t now = stats.total_cycles;
+    const char* state = slot.dispatched ? state_name(slot.stage) : QUEUED_STATE;
+    if (!retiring && state == slot.trace_state) return;
+    uint32_t track = FIRST_SLOT_TRACK + static_cast<uint32_t>(&slot - slots.data());
+    if (slot.trace_since < now) tracer->span(track, slot.trace_state, slot.trace_since, now, slot.pc);
+    slot.trace_state = state;
+    slot.trace_since = now;
+    if (retiring) tracer->async_span(opcode_name(slot.instr.opcode), slot.seq, slot.fetch_cycle, now, slot.pc);
+}
+
+std::vector<std::string> TPU::trace_track_names() const {
+    std::vector<std::string> names = {"Controller"};
+    for (const char* unit : UNIT_TRACE_NAMES) names.push_back(std::string(unit, std::strlen(unit) - 5));
+    for (size_t i = 0; i < slots.size(); ++i) names.push_back("Issue slot " + std::to_string(i));
+    return names;
+}
+
+bool TPU::write_trace(const std::string& filepath) {
+    if (!tracer) {
+        std::cerr << "ERROR: Tracing is not enabled" << std::endl;
+        return false;
+    }
+    uint64_t now = stats.total_cycles;
+    for (int u = 0; u < 4; ++u) {
+        if (unit_traced_busy[u]) tracer->span(FIRST_UNIT_TRACK + u, UNIT_TRACE_NAMES[u], unit_trace_since[u], now);
+        unit_trace_since[u] = now;
     }
+    if (front_trace_state && front_trace_since < now) tracer->span(0, front_trace_state, front_trace_since, now);
+    front_trace_since = now;
+    for (auto& slot : slots) {
+        if (!slot.active) continue;
+        uint32_t track = FIRST_SLOT_TRACK + static_cast<uint32_t>(&slot - slots.data());
+        if (slot.trace_since < now) tracer->span(track, slot.trace_state, slot.trace_since, now, slot.pc);
+        slot.trace_since = now;
+    }
+    return tracer->write_chrome_json(filepath, trace_track_names(), config.clock_mhz);
+}
+
+void TPU::stall_on(StallUnit unit) {
+    tick_unit_stalls[static_cast<int>(unit)]++;
+    tick_stall_keys.push_back((stall_opcode * CONTROLLER_STATES + stall_state) * STALL_UNITS + static_cast<int>(unit));
+}
+
+void TPU::set_stall_context(OpCode opcode, ControllerState state) {
+    stall_opcode = std::max(opcode_index(opcode), 0);
+    stall_state = static_cast<int>(state);
 }
 
 void TPU::tick_fetch() {
-    if (instruction_pointer >= program.size()) {
-        controller_state = ControllerState::HALTED;
+    // The in-order controller fetches only once the previous instruction has
+    // finished; the decoupled one keeps fetching while instructions are in flight.
+    if (in_order && !issue_order.empty()) return;
+    if (instruction_pointer >= micro_ops.size()) {
+        if (issue_order.empty()) {
+            controller_state = ControllerState::HALTED;
+            tick_progress = true;
+        }
         return;
     }
-    current_instruction = program[instruction_pointer];
+    if (instruction_pointer >= fetch_limit) return;
+    current_op = &micro_ops[instruction_pointer];
     instruction_pointer++;
     stats.instruction_count++;
+    fetch_cycle = stats.total_cycles - 1;
     controller_state = ControllerState::DECODE;
+    tick_progress = true;
 }
 
 void TPU::tick_decode() {
-    switch (current_instruction.opcode) {
-        case OpCode::RHM: controller_state = ControllerState::EXECUTE_RHM_READ_HOST; break;
-        case OpCode::WHM: controller_state = ControllerState::EXECUTE_WHM_READ_ACC;  break;
-        case OpCode::RW:  controller_state = ControllerState::EXECUTE_RW_READ_HOST;  break;
-        case OpCode::MMC: 
-                    controller_state = ControllerState::EXECUTE_MMC_READ_UB;
-                    stats.mmc_count++;
-                    break;        
-        case OpCode::ACT: controller_state = ControllerState::EXECUTE_ACT_RUN;       break;
-        case OpCode::HLT: 
-            std::cout << "CYCLE " << stats.total_cycles << ": DECODE -> HLT" << std::endl;
-            controller_state = ControllerState::HALTED;
+    const MicroOp& op = *current_op;
+    switch (op.kind) {
+        case DecodeKind::ISSUE:
             break;
-        default:
-            std::cout << "CYCLE " << stats.total_cycles << ": ERROR: Unknown opcode" << std::endl;
+        case DecodeKind::CFG:
+            // Needs no unit: later ACTs snapshot the registers at decode.
+            set_cfg_register(act_registers, conv_registers, op.instr.data_addr, static_cast<int32_t>(op.instr.host_addr));
+            if (TPU_TRACING(tracer)) {
+                tracer->async_span("CFG", stats.instruction_count, fetch_cycle, stats.total_cycles, instruction_pointer - 1);
+            }
+            controller_state = ControllerState::FETCH;
+            tick_progress = true;
+            return;
+        case DecodeKind::HLT:
+            // HLT waits for everything in flight to finish.
+            if (!issue_order.empty()) return;
+            if (config.verbose) std::cout << "CYCLE " << stats.total_cycles << ": DECODE -> HLT" << std::endl;
+            if (TPU_TRACING(tracer)) {
+                tracer->async_span("HLT", stats.instruction_count, fetch_cycle, stats.total_cycles, instruction_pointer - 1);
+            }
             controller_state = ControllerState::HALTED;
-            break;
+            tick_progress = true;
+            return;
+        case DecodeKind::SYNC:
+            // Everything in flight finishes first, host writes included, so
+            // other cores see them once the barrier releases.
+            set_stall_context(OpCode::SYNC, ControllerState::DECODE);
+            if (!sync_arrived) {
+                if (!pipeline_drained()) { stall_on(StallUnit::SYNC); return; }
+                if (barrier) {
+                    sync_arrived = true;
+                    sync_generation = barrier->generation;
+                    barrier->arrived++;
+                    tick_progress = true;
+                    return;
+                }
+            } else if (barrier->generation == sync_generation) {
+                stall_on(StallUnit::SYNC);
+                return;
+            }
+            sync_arrived = false;
+            if (TPU_TRACING(tracer)) {
+                tracer->async_span("SYNC", stats.instruction_count, fetch_cycle, stats.total_cycles, instruction_pointer - 1);
+            }
+            controller_state = ControllerState::FETCH;
+            tick_progress = true;
+            return;
+        case DecodeKind::ERROR:
+            halt_with_error(op.error);
+            return;
+    }
+
+    const Instruction& instr = op.instr;
+    if (instr.opcode == OpCode::CONV && !conv_valid(instr, conv_registers)) {
+        halt_with_error("Bad CONV geometry");
+        return;
+    }
+    InFlight* free_slot = nullptr;
+    for (auto& slot : slots) {
+        if (!slot.active) { free_slot = &slot; break; }
+    }
+    if (!free_slot) {
+        set_stall_context(instr.opcode, ControllerState::DECODE);
+        stall_on(StallUnit::ISSUE_QUEUE_FULL);
+        return;
+    }
+    static_cast<Claims&>(*free_slot) = op.claims;
+    free_slot->active = true;
+    free_slot->dispatched = false;
+    free_slot->issued_this_cycle = true;
+    free_slot->result_taken = false;
+    free_slot->instr = instr;
+    free_slot->stage = op.first_stage;
+    free_slot->issue_cycle = stats.total_cycles;
+    free_slot->seq = stats.instruction_count;
+    free_slot->pc = instruction_pointer - 1;
+    free_slot->fetch_cycle = fetch_cycle;
+    free_slot->trace_state = QUEUED_STATE;
+    free_slot->trace_since = stats.total_cycles;
+    issue_order.push_back(free_slot - slots.data());
+    if (instr.opcode == OpCode::RW) free_slot->weight_seq = weight_tiles_decoded++;
+    if (instr.opcode == OpCode::ACT) free_slot->act_params = act_registers;
+    if (instr.opcode == OpCode::CONV) {
+        free_slot->conv_params = conv_registers;
+        free_slot->ub_read = AddressRange(instr.data_addr, conv_registers.feature_map_bytes());
+        count_conv(instr, conv_registers);
+    }
+    if (instr.opcode == OpCode::MMC || instr.opcode == OpCode::CONV) {
+        if (instr.opcode == OpCode::MMC) stats.mmc_count++;
+        free_slot->mxu_seq = mmcs_decoded++;
+        if (!(instr.flags & FLAG_MMC_REUSE_WEIGHTS)) free_slot->weight_seq = weight_pops_decoded++;
+    }
+    controller_state = ControllerState::FETCH;
+    tick_progress = true;
+}
+
+// RAW, WAR and WAW checks of a queued instruction against every older one,
+// dispatched or not.
+bool TPU::has_hazard(const InFlight& candidate) const {
+    const MicroOp& op = micro_ops[candidate.pc];
+    for (size_t idx : issue_order) {
+        const InFlight& older = slots[idx];
+        if (&older == &candidate) break;
+        // Claims only shrink after decode, so an older instruction the
+        // pre-decoded mask clears cannot conflict now.
+        uint32_t distance = candidate.pc - older.pc;
+        if (older.pc >= op.superblock_start && distance <= HAZARD_WINDOW &&
+            !((op.hazard_mask >> (distance - 1)) & 1)) continue;
+        if (candidate.conflicts_with(older)) return true;
+    }
+    return false;
+}
+
+void TPU::record_latency(const InFlight& slot) {
+    int op = opcode_index(slot.instr.opcode);
+    if (op < 0) return;
+    uint64_t latency = stats.total_cycles - slot.issue_cycle;
+    PerformanceStats::LatencyHistogram& h = stats.latency[op];
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (uint64_t(1) << bucket) <= latency) bucket++;
+    h.buckets[bucket]++;
+    h.count++;
+    h.total += latency;
+    h.max = std::max(h.max, latency);
+
+    // Keep the TOP_SLOWEST longest; replace the shortest once full.
+    PerformanceStats::SlowInstruction entry = {latency, slot.issue_cycle, slot.pc, slot.instr.opcode};
+    if (stats.slowest_count < TOP_SLOWEST) {
+        stats.slowest[stats.slowest_count++] = entry;
+        return;
+    }
+    PerformanceStats::SlowInstruction* shortest = &stats.slowest[0];
+    for (auto& s : stats.slowest) {
+        if (s.latency < shortest->latency) shortest = &s;
     }
+    if (latency > shortest->latency) *shortest = entry;
 }
 
+bool TPU::conv_valid(const Instruction& instr, const ConvParams& conv) const {
+    return conv.valid(instr.data_addr, instr.host_addr_hi, instr.length, config.array_size, unified_buffer.size());
+}
+
+// A layer's CONVs are consecutive, so a change of geometry or feature map
+// starts the next one.
+void TPU::count_conv(const Instruction& instr, const ConvParams& conv) {
+    stats.conv_count++;
+    stats.conv_patch_bytes += instr.length;
+    if (conv.same_layer(last_conv) && instr.data_addr == last_conv_fmap) return;
+    last_conv = conv;
+    last_conv_fmap = instr.data_addr;
+    stats.conv_im2col_bytes += conv.out_pixels() * conv.patch_bytes();
+    stats.conv_feature_map_bytes += conv.feature_map_bytes();
+}
+
+// Swaps the tile a compressed RW read for the dense tile it stands for.
+// False if it is malformed.
+bool TPU::expand_weights(std::vector<uint8_t>& buffer) {
+    if (!expand_weight_tile(buffer.data(), buffer.size(), config.array_size, weight_scratch)) return false;
+    stats.compressed_tiles++;
+    stats.compressed_tile_bytes += buffer.size();
+    buffer.swap(weight_scratch);
+    return true;
+}
+
+void TPU::halt_with_error(const char* message) {
+    std::cout << "CYCLE " << stats.total_cycles << ": ERROR: " << message << std::endl;
+    controller_state = ControllerState::HALTED;
+    tick_progress = true;
+}
+
+void TPU::retire(InFlight& slot) {
+    if (TPU_TRACING(tracer)) trace_slot(slot, true);
+    record_latency(slot);
+    slot.active = false;
+    issue_order.erase(std::find(issue_order.begin(), issue_order.end(), static_cast<size_t>(&slot - slots.data())));
+}
+
+// Queued instructions dispatch as soon as they are clear of hazards with
+// everything older, so independent work can pass a blocked instruction.
+// Dispatch alone does not count as progress: a dispatched instruction whose
+// first stage stalls leaves the controller exactly as stuck as before.
 void TPU::tick_execute() {
-    switch (controller_state) {
+    for (size_t i = 0; i < issue_order.size();) {
+        InFlight& slot = slots[issue_order[i]];
+        if (slot.issued_this_cycle) {
+            slot.issued_this_cycle = false;
+            ++i;
+            continue;
+        }
+        set_stall_context(slot.instr.opcode, slot.stage);
+        if (!slot.dispatched) {
+            if (has_hazard(slot)) {
+                stall_on(StallUnit::ISSUE_HAZARD);
+                ++i;
+                continue;
+            }
+            slot.dispatched = true;
+        }
+        tick_slot(slot);
+        if (slot.active) {
+            if (TPU_TRACING(tracer)) trace_slot(slot, false);
+            ++i;
+        }
+    }
+}
+
+void TPU::tick_slot(InFlight& slot) {
+    const Instruction& instr = slot.instr;
+    switch (slot.stage) {
         case ControllerState::EXECUTE_RHM_READ_HOST:
-            if (host_mem_state == HostMemState::IDLE) {
-                host_read_request(current_instruction.host_addr, current_instruction.length);
-                controller_state = ControllerState::EXECUTE_RHM_WRITE_UB;
-            } else { stats.stall_cycles++; }
+            if (dma.can_accept()) {
+                slot.ticket = host_read_request(host_address(instr), instr.length, slot.buffer_a);
+                slot.host_read = AddressRange();
+                slot.stage = ControllerState::EXECUTE_RHM_WRITE_UB;
+            } else { stall_on(StallUnit::HOST_MEM); return; }
             break;
         case ControllerState::EXECUTE_RHM_WRITE_UB:
-            if (host_mem_state == HostMemState::IDLE && unified_buffer.get_state() == CompState::IDLE) {
-                unified_buffer.write_request(current_instruction.data_addr, data_buffer_a);
-                controller_state = ControllerState::FETCH;
-            } else { stats.stall_cycles++; }
+            if (!host_op_done(slot.ticket)) { stall_on(StallUnit::HOST_MEM); return; }
+            if (unified_buffer.get_state() == CompState::IDLE) {
+                unified_buffer.write_request(instr.data_addr, slot.buffer_a);
+                retire(slot);
+            } else { stall_on(StallUnit::UB); return; }
             break;
         case ControllerState::EXECUTE_RW_READ_HOST:
-            if (host_mem_state == HostMemState::IDLE) {
-                host_read_request(current_instruction.host_addr, current_instruction.length);
-                controller_state = ControllerState::FETCH; 
-                weight_fifo.load(data_buffer_a); 
-            } else { stats.stall_cycles++; }
+            if (in_order && weight_fifo.full()) {
+                // Nothing else is in flight to drain it.
+                halt_with_error("RW with the weight FIFO full");
+                return;
+            }
+            if (dma.can_accept()) {
+                slot.ticket = host_read_request(host_address(instr), instr.length, slot.buffer_a);
+                slot.host_read = AddressRange();
+                stats.weight_bytes += instr.length;
+                if ((instr.flags & FLAG_RW_COMPRESSED) && !expand_weights(slot.buffer_a)) {
+                    halt_with_error("Bad compressed weight tile");
+                    return;
+                }
+                if (in_order) {
+                    weight_fifo.load(slot.buffer_a);
+                    weight_tiles_loaded++;
+                    retire(slot);
+                } else {
+                    slot.stage = ControllerState::EXECUTE_RW_LOAD_FIFO;
+                }
+            } else { stall_on(StallUnit::HOST_MEM); return; }
+            break;
+        case ControllerState::EXECUTE_RW_LOAD_FIFO:
+            // Tiles enter the FIFO in program order, each as soon as its
+            // host read has landed and a slot is free.
+            if (!host_op_done(slot.ticket)) { stall_on(StallUnit::HOST_MEM); return; }
+            if (weight_tiles_loaded == slot.weight_seq && !weight_fifo.full()) {
+                weight_fifo.load(slot.buffer_a);
+                weight_tiles_loaded++;
+                retire(slot);
+            } else { stall_on(StallUnit::WEIGHT_FIFO); return; }
             break;
         case ControllerState::EXECUTE_MMC_READ_UB:
             if (unified_buffer.get_state() == CompState::IDLE) {
-                unified_buffer.read_request(current_instruction.data_addr, current_instruction.length);
-                controller_state = ControllerState::EXECUTE_MMC_READ_FIFO;
-            } else { stats.stall_cycles++; }
+                if (instr.opcode == OpCode::CONV) {
+                    unified_buffer.patch_read_request(instr.data_addr, slot.conv_params, instr.host_addr_hi,
+                                                      config.array_size, instr.length);
+                } else {
+                    unified_buffer.read_request(instr.data_addr, instr.length);
+                }
+                slot.ticket = unified_buffer.get_issued_ops();
+                slot.ub_read = AddressRange();
+                slot.stage = ControllerState::EXECUTE_MMC_READ_FIFO;
+            } else { stall_on(StallUnit::UB); return; }
             break;
         case ControllerState::EXECUTE_MMC_READ_FIFO:
-            if (unified_buffer.get_state() == CompState::IDLE) { 
-                data_buffer_a = unified_buffer.get_read_result();
-                data_buffer_b = weight_fifo.read();
-                controller_state = ControllerState::EXECUTE_MMC_EXECUTE;
-            } else { stats.stall_cycles++; }
+            // Take the UB read as soon as it lands so a younger MMC's read
+            // cannot overwrite it while this one waits for its weight tile.
+            if (!slot.result_taken) {
+                if (unified_buffer.get_completed_ops() < slot.ticket) { stall_on(StallUnit::UB); return; }
+                unified_buffer.take_read_result(slot.buffer_a);
+                slot.result_taken = true;
+            }
+            if (!(instr.flags & FLAG_MMC_REUSE_WEIGHTS)) {
+                // Wait for this MMC's tile unless no RW before it will ever
+                // supply one; popping an empty FIFO yields no weights, as in
+                // the in-order controller.
+                bool tile_coming = !in_order && weight_tiles_decoded > slot.weight_seq;
+                if (weight_tiles_popped != slot.weight_seq || (tile_coming && weight_fifo.size() == 0)) {
+                    stall_on(StallUnit::WEIGHT_FIFO);
+                    return;
+                }
+                weight_fifo.read(slot.buffer_b);
+                weight_tiles_popped++;
+            }
+            slot.stage = ControllerState::EXECUTE_MMC_EXECUTE;
             break;
         case ControllerState::EXECUTE_MMC_EXECUTE:
-            if (systolic_array.get_state() == CompState::IDLE) {
-                systolic_array.execute_request(data_buffer_a, data_buffer_b);
-                controller_state = ControllerState::EXECUTE_MMC_WRITE_ACC;
-            } else { stats.stall_cycles++; }
+            if (mmcs_executed == slot.mxu_seq && systolic_array.can_accept()) {
+                if (instr.flags & FLAG_MMC_REUSE_WEIGHTS) {
+                    systolic_array.execute_request(slot.buffer_a);
+                } else {
+                    systolic_array.execute_request(slot.buffer_a, slot.buffer_b);
+                }
+                mmcs_executed++;
+                slot.stage = ControllerState::EXECUTE_MMC_WRITE_ACC;
+            } else { stall_on(StallUnit::MXU); return; }
             break;
         case ControllerState::EXECUTE_MMC_WRITE_ACC:
-            if (systolic_array.get_state() == CompState::IDLE && accumulator.get_state() == CompState::IDLE) {
-                data_buffer_a = systolic_array.get_result();
-                accumulator.write_request(current_instruction.host_addr, data_buffer_a);
-                controller_state = ControllerState::FETCH;
-            } else { stats.stall_cycles++; }
+            // MXU results come back in issue order, so the oldest waiting
+            // MMC always owns the next one.
+            if (!systolic_array.result_ready()) { stall_on(StallUnit::MXU); return; }
+            if (accumulator.get_state() == CompState::IDLE) {
+                systolic_array.take_result(slot.buffer_a);
+                if (instr.flags & FLAG_MMC_ACCUMULATE) {
+                    accumulator.accumulate_request(instr.host_addr, slot.buffer_a);
+                } else {
+                    accumulator.write_request(instr.host_addr, slot.buffer_a);
+                }
+                retire(slot);
+            } else { stall_on(StallUnit::ACC); return; }
             break;
         case ControllerState::EXECUTE_ACT_RUN:
             if (accumulator.get_state() == CompState::IDLE) {
-                accumulator.activate_request(current_instruction.data_addr, current_instruction.length);
-                controller_state = ControllerState::FETCH;
-            } else { stats.stall_cycles++; }
+                bool to_ub = instr.flags & FLAG_ACT_TO_UB;
+                accumulator.activate_request(instr.data_addr, instr.length, instr.flags & ACT_FUNC_MASK,
+                                             slot.act_params, to_ub);
+                if (to_ub) {
+                    slot.ticket = accumulator.get_issued_ops();
+                    slot.acc_read = AddressRange();
+                    slot.stage = ControllerState::EXECUTE_ACT_WRITE_UB;
+                } else {
+                    retire(slot);
+                }
+            } else { stall_on(StallUnit::ACC); return; }
+            break;
+        case ControllerState::EXECUTE_ACT_WRITE_UB:
+            // Requantized int8 results go straight to the UB, where the next
+            // layer's MMC can read them without a round trip to the host.
+            if (!slot.result_taken) {
+                if (accumulator.get_completed_ops() < slot.ticket) { stall_on(StallUnit::ACC); return; }
+                accumulator.take_read_result(slot.buffer_a);
+                slot.result_taken = true;
+            }
+            if (unified_buffer.get_state() == CompState::IDLE) {
+                stats.act_ub_bytes += slot.buffer_a.size();
+                unified_buffer.write_request(instr.host_addr, slot.buffer_a);
+                retire(slot);
+            } else { stall_on(StallUnit::UB); return; }
             break;
         case ControllerState::EXECUTE_WHM_READ_ACC:
             if (accumulator.get_state() == CompState::IDLE) {
-                accumulator.read_request(current_instruction.data_addr, current_instruction.length);
-                controller_state = ControllerState::EXECUTE_WHM_WRITE_HOST;
-            } else { stats.stall_cycles++; }
+                accumulator.read_request(instr.data_addr, instr.length);
+                slot.ticket = accumulator.get_issued_ops();
+                slot.acc_read = AddressRange();
+                slot.stage = ControllerState::EXECUTE_WHM_WRITE_HOST;
+            } else { stall_on(StallUnit::ACC); return; }
             break;
         case ControllerState::EXECUTE_WHM_WRITE_HOST:
-            if (accumulator.get_state() == CompState::IDLE && host_mem_state == HostMemState::IDLE) {
-                data_buffer_a = accumulator.get_read_result();
-                host_write_request(current_instruction.host_addr, data_buffer_a);
-                if (data_buffer_a.size() >= 4) {
+            // Collect the read as soon as it lands so a younger accumulator
+            // read cannot overwrite it while the host port is still busy.
+            if (!slot.result_taken) {
+                if (accumulator.get_completed_ops() < slot.ticket) { stall_on(StallUnit::ACC); return; }
+                accumulator.take_read_result(slot.buffer_a);
+                slot.result_taken = true;
+            }
+            if (dma.can_accept()) {
+                host_write_request(host_address(instr), slot.buffer_a);
+                if (config.verbose && slot.buffer_a.size() >= 4) {
                     int32_t first_result;
-                    std::memcpy(&first_result, data_buffer_a.data(), sizeof(int32_t));
+                    std::memcpy(&first_result, slot.buffer_a.data(), sizeof(int32_t));
                     std::cout << "CYCLE " << stats.total_cycles << ": WHM Issued. First 32-bit result: " << first_result << std::endl;
                 }
-                controller_state = ControllerState::FETCH;
-            } else { stats.stall_cycles++; }
+                retire(slot);
+            } else { stall_on(StallUnit::HOST_MEM); return; }
             break;
         default:
-            controller_state = ControllerState::HALTED;
+            retire(slot);
             break;
     }
+    tick_progress = true;
+}
+
+// Same data movement as the execute stages, in program order and at once.
+// The weight and MXU sequence counters advance too, so detailed timing can
+// pick up where functional execution left off.
+bool TPU::step_functional() {
+    if (controller_state == ControllerState::HALTED) return false;
+    if (instruction_pointer >= micro_ops.size()) {
+        controller_state = ControllerState::HALTED;
+        return false;
+    }
+    const MicroOp& op = micro_ops[instruction_pointer];
+    const Instruction& instr = op.instr;
+    instruction_pointer++;
+    stats.instruction_count++;
+    if (op.kind == DecodeKind::ERROR) {
+        halt_with_error(op.error);
+        return false;
+    }
+    std::vector<uint8_t>& buffer_a = slots[0].buffer_a;
+    std::vector<uint8_t>& buffer_b = slots[0].buffer_b;
+    switch (instr.opcode) {
+        case OpCode::RHM:
+            buffer_a.resize(instr.length);
+            host_memory->read(host_address(instr), buffer_a.data(), instr.length);
+            unified_buffer.write(instr.data_addr, buffer_a);
+            break;
+        case OpCode::RW:
+            if (in_order && weight_fifo.full()) {
+                halt_with_error("RW with the weight FIFO full");
+                return false;
+            }
+            buffer_a.resize(instr.length);
+            host_memory->read(host_address(instr), buffer_a.data(), instr.length);
+            stats.weight_bytes += instr.length;
+            if ((instr.flags & FLAG_RW_COMPRESSED) && !expand_weights(buffer_a)) {
+                halt_with_error("Bad compressed weight tile");
+                return false;
+            }
+            if (weight_fifo.full()) {
+                weight_backlog.emplace_back();
+                weight_backlog.back().swap(buffer_a);
+            } else {
+                weight_fifo.load(buffer_a);
+            }
+            weight_tiles_decoded++;
+            weight_tiles_loaded++;
+            break;
+        case OpCode::MMC:
+        case OpCode::CONV:
+            if (instr.opcode == OpCode::CONV) {
+                if (!conv_valid(instr, conv_registers)) {
+                    halt_with_error("Bad CONV geometry");
+                    return false;
+                }
+                count_conv(instr, conv_registers);
+                unified_buffer.read_patches(instr.data_addr, conv_registers, instr.host_addr_hi, config.array_size,
+                                            instr.length, buffer_a);
+            } else {
+                stats.mmc_count++;
+                unified_buffer.read(instr.data_addr, instr.length, buffer_a);
+            }
+            if (instr.flags & FLAG_MMC_REUSE_WEIGHTS) {
+                systolic_array.execute_now(buffer_a);
+            } else {
+                weight_fifo.read(buffer_b);
+                if (!weight_backlog.empty()) {
+                    weight_fifo.load(weight_backlog.front());
+                    weight_backlog.pop_front();
+                }
+                weight_pops_decoded++;
+                weight_tiles_popped++;
+                systolic_array.execute_now(buffer_a, buffer_b);
+            }
+            mmcs_decoded++;
+            mmcs_executed++;
+            if (instr.flags & FLAG_MMC_ACCUMULATE) {
+                accumulator.accumulate(instr.host_addr, buffer_a);
+            } else {
+                accumulator.write(instr.host_addr, buffer_a);
+            }
+            break;
+        case OpCode::ACT: {
+            bool to_ub = instr.flags & FLAG_ACT_TO_UB;
+            accumulator.activate(instr.data_addr, instr.length, instr.flags & ACT_FUNC_MASK, act_registers, to_ub);
+            if (to_ub) {
+                accumulator.take_read_result(buffer_a);
+                stats.act_ub_bytes += buffer_a.size();
+                unified_buffer.write(instr.host_addr, buffer_a);
+            }
+            break;
+        }
+        case OpCode::CFG:
+            set_cfg_register(act_registers, conv_registers, instr.data_addr, static_cast<int32_t>(instr.host_addr));
+            break;
+        case OpCode::SYNC:
+            // Nothing is ever in flight here, and there are no other cores.
+            break;
+        case OpCode::WHM:
+            accumulator.read(instr.data_addr, instr.length, buffer_a);
+            host_memory->write(host_address(instr), buffer_a.data(), buffer_a.size());
+            if (config.verbose && buffer_a.size() >= 4) {
+                int32_t first_result;
+                std::memcpy(&first_result, buffer_a.data(), sizeof(int32_t));
+                std::cout << "PC " << instruction_pointer - 1 << ": WHM Executed. First 32-bit result: " << first_result << std::endl;
+            }
+            break;
+        default:   // HLT
+            controller_state = ControllerState::HALTED;
+            return false;
+    }
+    return true;
+}
+
+TPU::SampledTiming TPU::run_sampled(uint64_t interval, uint64_t window, uint64_t warmup, uint64_t max_cycles) {
+    SampledTiming result = {};
+    double cpi_sum = 0.0, cpi_sum_sq = 0.0;
+    uint64_t functional_instructions = 0;
+    auto running = [this, max_cycles]() { return !is_halted() && stats.total_cycles <= max_cycles; };
+    // Functional up to instruction until, and on until no RW tile is left
+    // waiting for FIFO space, which the pipeline has no room for.
+    auto run_functional_to = [&](uint64_t until) {
+        while ((instruction_pointer < until || !weight_backlog.empty()) && step_functional()) {
+            functional_instructions++;
+        }
+    };
+
+    // With fewer than two windows there is no confidence interval, so a
+    // program that short runs in full detail instead.
+    uint64_t span = std::max(interval, warmup + window);
+    uint64_t remaining = micro_ops.size() - std::min<uint64_t>(instruction_pointer, micro_ops.size());
+    bool sampling = interval > warmup + window && remaining / interval >= 2;
+    // Each window starts at a random offset into its interval, so the windows
+    // neither all see the program's cold start nor lock onto one phase of
+    // its tile loops. The seed is fixed: a rerun gives the same estimate.
+    std::mt19937_64 rng(SAMPLE_SEED);
+    uint64_t start_cycle = stats.total_cycles;
+    while (sampling && running()) {
+        uint64_t interval_start = instruction_pointer;
+        run_functional_to(interval_start + rng() % (span - warmup - window + 1));
+        if (!running()) break;
+
+        // Detailed: warm up the pipeline, then measure the window from its
+        // first fetch until the pipeline has drained, since an instruction's
+        // cost includes finishing it. Fetching stops after the window.
+        uint64_t measure_from = instruction_pointer + warmup;
+        fetch_limit = measure_from + window;
+        uint64_t ticked_before = stats.total_cycles;
+        while (running() && instruction_pointer < measure_from) tick();
+        // What is in flight when measuring starts finishes inside the
+        // measurement, so it counts with the window.
+        uint64_t in_flight = issue_order.size() + (controller_state == ControllerState::DECODE ? 1 : 0);
+        uint64_t cycles_from = stats.total_cycles, instructions_from = instruction_pointer;
+        while (running() && instruction_pointer < fetch_limit) tick();
+        uint64_t instructions = instruction_pointer - instructions_from + in_flight;
+        while (running() && !pipeline_empty()) tick();
+        uint64_t cycles = stats.total_cycles - cycles_from;
+        fetch_limit = UINT64_MAX;
+        result.detailed_cycles += stats.total_cycles - ticked_before;
+        if (instructions > 0) {
+            double cpi = static_cast<double>(cycles) / instructions;
+            cpi_sum += cpi;
+            cpi_sum_sq += cpi * cpi;
+            result.windows++;
+            result.measured_instructions += instructions;
+            result.measured_cycles += cycles;
+        }
+
+        run_functional_to(interval_start + span);
+    }
+    if (!sampling) {
+        while (running()) tick();
+        result.detailed_cycles = stats.total_cycles - start_cycle;
+    }
+
+    result.complete = is_halted();
+    result.instructions = stats.instruction_count;
+    result.exact = functional_instructions == 0;
+    if (result.exact) {
+        // Too short to sample: everything ran in detail, so the count is exact.
+        result.estimated_cycles = stats.total_cycles;
+        result.cpi = result.instructions ? static_cast<double>(stats.total_cycles) / result.instructions : 0.0;
+    } else if (result.measured_instructions > 0) {
+        result.cpi = static_cast<double>(result.measured_cycles) / result.measured_instructions;
+        result.estimated_cycles = static_cast<uint64_t>(result.cpi * result.instructions + 0.5);
+    }
+    if (functional_instructions > 0 && result.windows > 1 && result.cpi > 0.0) {
+        double n = static_cast<double>(result.windows);
+        double variance = std::max(0.0, (cpi_sum_sq - cpi_sum * cpi_sum / n) / (n - 1));
+        result.cpi_error = t95(result.windows - 1) * std::sqrt(variance / n) / (cpi_sum / n);
+    }
+    return result;
 }
 
 void TPU::print_performance_report() {
@@ -216,6 +1347,37 @@ void TPU::print_performance_report() {
     double stall_percent = (double)stats.stall_cycles / stats.total_cycles * 100.0;
     std::cout << "\nStall Analysis:" << std::endl;
     std::cout << "  Controller Stall Cycles: " << stats.stall_cycles << " (" << stall_percent << " % of total)" << std::endl;
+    std::cout << "  Controller Mode:    " << (in_order ? "in-order" : "decoupled, issue queue " + std::to_string(slots.size())) << std::endl;
+    std::cout << "  Blocked Instruction-Cycles by Unit:" << std::endl;
+    for (int u = 0; u < static_cast<int>(StallUnit::COUNT); ++u) {
+        std::cout << "    " << std::left << std::setw(20) << UNIT_NAMES[u] << std::right
+                  << stats.unit_stall_cycles[u] << std::endl;
+    }
+    std::vector<std::pair<uint64_t, int>> reasons = sorted_stalls(&stats.stall_breakdown[0][0][0]);
+    if (!reasons.empty()) {
+        std::cout << "  Top Stall Reasons (opcode / state / waiting on):" << std::endl;
+        for (size_t i = 0; i < reasons.size() && i < 5; ++i) {
+            int key = reasons[i].second;
+            std::cout << "    " << std::left << std::setw(4) << opcode_name(OPCODE_BY_INDEX[key / (CONTROLLER_STATES * STALL_UNITS)])
+                      << std::setw(16) << state_name(static_cast<ControllerState>(key / STALL_UNITS % CONTROLLER_STATES))
+                      << std::setw(20) << UNIT_NAMES[key % STALL_UNITS] << std::right << reasons[i].first << std::endl;
+        }
+    }
+
+    std::cout << "\nInstruction Latency (decode to retire, cycles):" << std::endl;
+    for (int op = 0; op < OPCODE_KINDS; ++op) {
+        const PerformanceStats::LatencyHistogram& h = stats.latency[op];
+        if (!h.count) continue;
+        std::cout << "  " << std::left << std::setw(4) << opcode_name(OPCODE_BY_INDEX[op]) << std::right
+                  << h.count << " retired, mean " << (double)h.total / h.count
+                  << ", p50 <= " << latency_quantile(h, 0.5) << ", p99 <= " << latency_quantile(h, 0.99)
+                  << ", max " << h.max << std::endl;
+    }
+    std::vector<PerformanceStats::SlowInstruction> slowest = sorted_slowest(stats);
+    for (size_t i = 0; i < slowest.size() && i < 5; ++i) {
+        std::cout << "  Slowest #" << i + 1 << ": " << opcode_name(slowest[i].opcode) << " at pc " << slowest[i].pc
+                  << ", " << slowest[i].latency << " cycles from cycle " << slowest[i].issue_cycle << std::endl;
+    }
 
     double host_util = (double)stats.host_mem_busy_cycles / stats.total_cycles * 100.0;
     double ub_util = (double)stats.ub_busy_cycles / stats.total_cycles * 100.0;
@@ -227,9 +1389,97 @@ void TPU::print_performance_report() {
     std::cout << "  Accumulator (ACC): " << stats.acc_busy_cycles << " cycles (" << acc_util << " %)" << std::endl;
     std::cout << "  Matrix Unit (MXU): " << stats.mxu_busy_cycles << " cycles (" << mxu_util << " %)" << std::endl;
 
-    const double OPS_PER_MMC = 16.0 * 16.0 * 16.0 * 2.0;
-    const double CLOCK_SPEED_MHZ = 500.0; 
-    double total_ops = (double)stats.mmc_count * OPS_PER_MMC;
+    const DmaConfig& dma_config = dma.get_config();
+    const double CLOCK_SPEED_MHZ = config.clock_mhz;
+    double achieved_bw = (double)dma.get_bytes_moved() / stats.total_cycles;
+    std::cout << "\nHost DMA (" << dma_config.base_latency << " cycle latency, "
+              << dma_config.max_outstanding << " outstanding";
+    if (dma_config.bytes_per_cycle) {
+        std::cout << ", " << dma_config.burst_bytes << " B bursts";
+    }
+    std::cout << "):" << std::endl;
+    std::cout << "  Bytes Transferred:  " << dma.get_bytes_moved() << std::endl;
+    std::cout << "  Achieved Bandwidth: " << achieved_bw << " B/cycle ("
+              << achieved_bw * CLOCK_SPEED_MHZ * 1e6 / 1e9 << " GB/s)" << std::endl;
+    if (dma_config.bytes_per_cycle) {
+        std::cout << "  Peak Bandwidth:     " << (double)dma_config.bytes_per_cycle << " B/cycle ("
+                  << dma_config.bytes_per_cycle * CLOCK_SPEED_MHZ * 1e6 / 1e9 << " GB/s), "
+                  << (double)achieved_bw / dma_config.bytes_per_cycle * 100.0 << " % achieved" << std::endl;
+        std::cout << "  Data Channel Busy:  " << dma.get_channel_busy_cycles() << " cycles" << std::endl;
+    } else {
+        std::cout << "  Peak Bandwidth:     unlimited (flat latency model)" << std::endl;
+    }
+    if (stats.act_ub_bytes) {
+        std::cout << "  Activations Kept On Chip: " << stats.act_ub_bytes << " bytes (ACT to UB)" << std::endl;
+    }
+
+    bool wavefront = systolic_array.get_timing_model() == MxuTiming::WAVEFRONT;
+    double array_pes = (double)systolic_array.get_size() * systolic_array.get_size();
+    double pe_util = stats.mxu_busy_cycles ? systolic_array.get_pe_active_cycles() / (array_pes * stats.mxu_busy_cycles) * 100.0 : 0.0;
+    std::cout << "\nMXU Dataflow (" << (wavefront ? "wavefront" : "fixed latency") << " model):" << std::endl;
+    std::cout << "  PE MAC-Cycles:      " << systolic_array.get_pe_active_cycles() << std::endl;
+    std::cout << "  PE Utilization:     " << pe_util << " % of MXU busy cycles, "
+              << systolic_array.get_pe_active_cycles() / (array_pes * stats.total_cycles) * 100.0 << " % of total" << std::endl;
+    if (wavefront) {
+        std::cout << "  Fill/Drain Overlap: " << systolic_array.get_overlap_cycles() << " cycles" << std::endl;
+    }
+
+    uint64_t weight_loads = systolic_array.get_weight_loads();
+    uint64_t weight_reuses = systolic_array.get_weight_reuses();
+    std::cout << "\nWeights (FIFO depth " << weight_fifo.depth() << "):" << std::endl;
+    std::cout << "  Tiles Loaded into MXU: " << weight_loads << std::endl;
+    std::cout << "  MMCs Reusing Weights:  " << weight_reuses << " ("
+              << (weight_loads + weight_reuses ? 100.0 * weight_reuses / (weight_loads + weight_reuses) : 0.0)
+              << " % of MMCs)" << std::endl;
+    std::cout << "  Weight Bytes from Host: " << stats.weight_bytes << " ("
+              << (dma.get_bytes_moved() ? 100.0 * stats.weight_bytes / dma.get_bytes_moved() : 0.0)
+              << " % of host traffic)" << std::endl;
+
+    if (systolic_array.get_zero_skip() || stats.compressed_tiles) {
+        // Savings are against the same tiles, dense.
+        const int size = systolic_array.get_size();
+        std::cout << "\nZero-Block Skipping (" << sparse_block_rows(size) << "-row blocks, "
+                  << (systolic_array.get_zero_skip() ? "on" : "off") << "):" << std::endl;
+        if (stats.compressed_tiles) {
+            uint64_t dense_bytes = stats.compressed_tiles * static_cast<uint64_t>(size) * size;
+            std::cout << "  Compressed RW Tiles:  " << stats.compressed_tiles << ", " << stats.compressed_tile_bytes
+                      << " host bytes for " << dense_bytes << " dense ("
+                      << 100.0 * (1.0 - (double)stats.compressed_tile_bytes / dense_bytes) << " % saved)" << std::endl;
+        }
+        if (systolic_array.get_zero_skip()) {
+            uint64_t blocks = weight_loads * sparse_blocks(size);
+            uint64_t macs = systolic_array.get_pe_active_cycles() + systolic_array.get_skipped_macs();
+            std::cout << "  Zero Blocks Skipped:  " << systolic_array.get_zero_blocks() << " of " << blocks << " ("
+                      << (blocks ? 100.0 * systolic_array.get_zero_blocks() / blocks : 0.0) << " %)" << std::endl;
+            std::cout << "  MACs Skipped:         " << systolic_array.get_skipped_macs() << " ("
+                      << (macs ? 100.0 * systolic_array.get_skipped_macs() / macs : 0.0) << " % of dense)" << std::endl;
+            std::cout << "  MXU Cycles Saved:     " << systolic_array.get_saved_cycles()
+                      << " (MMC latency, against dense tiles)" << std::endl;
+        }
+    }
+
+    if (stats.conv_count) {
+        // With host im2col, RHM would bring in the whole patch matrix of
+        // every layer instead of its feature map.
+        std::cout << "\nConvolution (patches built in the UB):" << std::endl;
+        std::cout << "  CONV Instructions:  " << stats.conv_count << std::endl;
+        std::cout << "  Patch Bytes Built:  " << stats.conv_patch_bytes << std::endl;
+        std::cout << "  Feature Map Bytes:  " << stats.conv_feature_map_bytes << std::endl;
+        std::cout << "  Host im2col Bytes:  " << stats.conv_im2col_bytes << std::endl;
+        std::cout << "  Host Bytes Saved:   "
+                  << static_cast<int64_t>(stats.conv_im2col_bytes - stats.conv_feature_map_bytes) << " ("
+                  << (stats.conv_feature_map_bytes ? (double)stats.conv_im2col_bytes / stats.conv_feature_map_bytes : 0.0)
+                  << "x less input traffic)" << std::endl;
+    }
+
+    std::cout << "\nHost Simulation:" << std::endl;
+    std::cout << "  MXU Kernel:          " << gemm_isa_name(systolic_array.get_kernel_isa()) << std::endl;
+    std::cout << "  Heap Allocations (sim loop): " << stats.heap_allocations << std::endl;
+    std::cout << "  Heap Allocations during MMC: " << stats.mmc_heap_allocations << std::endl;
+    std::cout << "  Host Page Copies (sim loop): " << stats.host_page_copies << std::endl;
+
+    // Two operations (multiply and add) per PE MAC-cycle.
+    double total_ops = (double)systolic_array.get_pe_active_cycles() * 2.0;
     double total_time_sec = (double)stats.total_cycles / (CLOCK_SPEED_MHZ * 1e6);
     double gops = (total_ops / total_time_sec) / 1e9;
 
@@ -239,3 +1489,56 @@ void TPU::print_performance_report() {
     std::cout << "  Effective GOPS:      " << gops << std::endl;
     std::cout << "--- END OF REPORT ---" << std::endl;
 }
+
+bool TPU::write_stats_json(const std::string& filepath) const {
+    std::ofstream out(filepath);
+    if (!out) {
+        std::cerr << "ERROR: Cannot write " << filepath << std::endl;
+        return false;
+    }
+    out << std::fixed << std::setprecision(2);
+    out << "{\n  \"cycles\": " << stats.total_cycles << ",\n  \"instructions\": " << stats.instruction_count
+        << ",\n  \"stall_cycles\": " << stats.stall_cycles << ",\n";
+    out << "  \"busy_cycles\": {\"host_memory\": " << stats.host_mem_busy_cycles << ", \"unified_buffer\": "
+        << stats.ub_busy_cycles << ", \"matrix_unit\": " << stats.mxu_busy_cycles << ", \"accumulator\": "
+        << stats.acc_busy_cycles << "},\n";
+    out << "  \"blocked_by_unit\": {";
+    for (int u = 0; u < STALL_UNITS; ++u) {
+        out << (u ? ", " : "") << "\"" << UNIT_KEYS[u] << "\": " << stats.unit_stall_cycles[u];
+    }
+    out << "},\n  \"stalls\": [";
+    std::vector<std::pair<uint64_t, int>> reasons = sorted_stalls(&stats.stall_breakdown[0][0][0]);
+    for (size_t i = 0; i < reasons.size(); ++i) {
+        int key = reasons[i].second;
+        out << (i ? "," : "") << "\n    {\"opcode\": \"" << opcode_name(OPCODE_BY_INDEX[key / (CONTROLLER_STATES * STALL_UNITS)])
+            << "\", \"state\": \"" << state_name(static_cast<ControllerState>(key / STALL_UNITS % CONTROLLER_STATES))
+            << "\", \"unit\": \"" << UNIT_KEYS[key % STALL_UNITS] << "\", \"cycles\": " << reasons[i].first << "}";
+    }
+    out << "\n  ],\n  \"latency\": {";
+    bool first = true;
+    for (int op = 0; op < OPCODE_KINDS; ++op) {
+        const PerformanceStats::LatencyHistogram& h = stats.latency[op];
+        if (!h.count) continue;
+        out << (first ? "" : ",") << "\n    \"" << opcode_name(OPCODE_BY_INDEX[op]) << "\": {\"count\": " << h.count
+            << ", \"mean\": " << (double)h.total / h.count << ", \"p50\": " << latency_quantile(h, 0.5)
+            << ", \"p99\": " << latency_quantile(h, 0.99) << ", \"max\": " << h.max << ", \"buckets\": [";
+        // Each bucket as [lowest latency it holds, count], nonzero ones only.
+        bool first_bucket = true;
+        for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+            if (!h.buckets[b]) continue;
+            out << (first_bucket ? "" : ", ") << "[" << (b == 0 ? 0 : uint64_t(1) << (b - 1)) << ", " << h.buckets[b] << "]";
+            first_bucket = false;
+        }
+        out << "]}";
+        first = false;
+    }
+    out << "\n  },\n  \"slowest\": [";
+    std::vector<PerformanceStats::SlowInstruction> slowest = sorted_slowest(stats);
+    for (size_t i = 0; i < slowest.size(); ++i) {
+        out << (i ? "," : "") << "\n    {\"opcode\": \"" << opcode_name(slowest[i].opcode) << "\", \"pc\": "
+            << slowest[i].pc << ", \"issue_cycle\": " << slowest[i].issue_cycle << ", \"latency\": "
+            << slowest[i].latency << "}";
+    }
+    out << "\n  ]\n}\n";
+    return out.good();
+}
@@ -1,20 +1,92 @@
 #pragma once
 #include "isa.h"
 #include "tpu_components.h"
+#include "tpu_config.h"
+#include "host_memory.h"
+#include "trace.h"
+#include <algorithm>
+#include <deque>
+#include <memory>
 #include <vector>
 #include <string>
 
 enum class ControllerState {
     FETCH, DECODE,
     EXECUTE_RHM_READ_HOST, EXECUTE_RHM_WRITE_UB,
-    EXECUTE_RW_READ_HOST,
+    EXECUTE_RW_READ_HOST, EXECUTE_RW_LOAD_FIFO,
     EXECUTE_MMC_READ_UB, EXECUTE_MMC_READ_FIFO, EXECUTE_MMC_EXECUTE, EXECUTE_MMC_WRITE_ACC,
-    EXECUTE_ACT_RUN,
+    EXECUTE_ACT_RUN, EXECUTE_ACT_WRITE_UB,
     EXECUTE_WHM_READ_ACC, EXECUTE_WHM_WRITE_HOST,
     HALTED
 };
 
-enum class HostMemState { IDLE, BUSY };
+// What an in-flight instruction (or the issue stage) was waiting on in a
+// cycle where it could not advance.
+enum class StallUnit {
+    HOST_MEM, UB, MXU, ACC,
+    WEIGHT_FIFO,        // RW waiting for a free FIFO slot, or MMC for its tile
+    ISSUE_HAZARD,       // queued instruction conflicts with an older one
+    ISSUE_QUEUE_FULL,   // every issue slot is occupied
+    SYNC,               // SYNC draining this core or waiting for the others
+    COUNT
+};
+
+const int OPCODE_KINDS = 9;   // RHM, WHM, RW, MMC, ACT, CFG, HLT, SYNC, CONV
+const int CONTROLLER_STATES = static_cast<int>(ControllerState::HALTED) + 1;
+const int STALL_UNITS = static_cast<int>(StallUnit::COUNT);
+const int LATENCY_BUCKETS = 32;
+const size_t TOP_SLOWEST = 10;
+
+// Index of opcode in per-opcode tables (0..OPCODE_KINDS-1, in the order
+// above), or -1 for an unknown opcode.
+int opcode_index(OpCode opcode);
+const char* opcode_name(OpCode opcode);
+const char* state_name(ControllerState state);
+
+// Half-open byte range [begin, end) claimed on one memory by an in-flight
+// instruction. Empty ranges never conflict.
+struct AddressRange {
+    uint64_t begin;
+    uint64_t end;
+    AddressRange() : begin(0), end(0) {}
+    AddressRange(uint64_t addr, uint64_t length) : begin(addr), end(addr + length) {}
+    bool overlaps(const AddressRange& other) const { return begin < other.end && other.begin < end; }
+};
+
+// Byte ranges an instruction reads and writes on host memory, the UB and the
+// accumulator.
+struct Claims {
+    AddressRange host_read, host_write;
+    AddressRange ub_read, ub_write;
+    AddressRange acc_read, acc_write;
+
+    // RAW, WAR or WAW against an older instruction's claims.
+    bool conflicts_with(const Claims& older) const {
+        return host_write.overlaps(older.host_read) || host_write.overlaps(older.host_write) ||
+               host_read.overlaps(older.host_write) || ub_write.overlaps(older.ub_read) ||
+               ub_write.overlaps(older.ub_write) || ub_read.overlaps(older.ub_write) ||
+               acc_write.overlaps(older.acc_read) || acc_write.overlaps(older.acc_write) ||
+               acc_read.overlaps(older.acc_write);
+    }
+};
+
+// Where the cores of a chip meet at SYNC. A core arrives once everything it
+// had in flight has finished, and all of them leave together in the cycle
+// after the last one arrives. Halted cores no longer take part.
+struct SyncBarrier {
+    uint32_t cores;        // cores still running
+    uint32_t arrived;
+    uint64_t generation;   // bumped on every release
+
+    explicit SyncBarrier(uint32_t cores = 1) : cores(cores), arrived(0), generation(0) {}
+    // Called once every core has ticked; returns true if it released them.
+    bool end_cycle() {
+        if (arrived == 0 || arrived < cores) return false;
+        arrived = 0;
+        generation++;
+        return true;
+    }
+};
 
 class TPU {
 public:
@@ -27,45 +99,291 @@ public:
         uint64_t acc_busy_cycles;
         uint64_t mxu_busy_cycles;
         uint64_t mmc_count;
-        
+        // CONV: instructions, bytes of input rows the UB generated from
+        // patches, and for the layers they computed, the bytes of the
+        // im2col matrices a host lowering would have to read and the
+        // bytes of their feature maps.
+        uint64_t conv_count;
+        uint64_t conv_patch_bytes;
+        uint64_t conv_im2col_bytes;
+        uint64_t conv_feature_map_bytes;
+        uint64_t weight_bytes;     // host bytes read by RW
+        // RW with FLAG_RW_COMPRESSED: tiles, and the host bytes they took.
+        uint64_t compressed_tiles;
+        uint64_t compressed_tile_bytes;
+        uint64_t act_ub_bytes;     // int8 activations ACT wrote to the UB
+        uint64_t heap_allocations;
+        uint64_t mmc_heap_allocations;   // both leave out host page copies
+        uint64_t host_page_copies;       // copy-on-write faults in the sim loop
+        uint64_t unit_stall_cycles[static_cast<int>(StallUnit::COUNT)];
+        // The same blocked instruction-cycles, split by the waiting
+        // instruction's opcode (see opcode_index) and controller state.
+        uint64_t stall_breakdown[OPCODE_KINDS][CONTROLLER_STATES][STALL_UNITS];
+
+        // Decode-to-retire latency of one opcode. Bucket 0 counts latency 0,
+        // bucket b > 0 counts latencies in [2^(b-1), 2^b).
+        struct LatencyHistogram {
+            uint64_t count;
+            uint64_t total;
+            uint64_t max;
+            uint64_t buckets[LATENCY_BUCKETS];
+        };
+        LatencyHistogram latency[OPCODE_KINDS];
+
+        struct SlowInstruction {
+            uint64_t latency;
+            uint64_t issue_cycle;
+            uint32_t pc;
+            OpCode opcode;
+        };
+        SlowInstruction slowest[TOP_SLOWEST];   // unsorted
+        size_t slowest_count;
+
         PerformanceStats() : total_cycles(0), instruction_count(0), stall_cycles(0),
                              host_mem_busy_cycles(0), ub_busy_cycles(0), acc_busy_cycles(0),
-                             mxu_busy_cycles(0), mmc_count(0) {}
+                             mxu_busy_cycles(0), mmc_count(0), conv_count(0), conv_patch_bytes(0),
+                             conv_im2col_bytes(0), conv_feature_map_bytes(0), weight_bytes(0), compressed_tiles(0),
+                             compressed_tile_bytes(0), act_ub_bytes(0), heap_allocations(0),
+                             mmc_heap_allocations(0), host_page_copies(0), unit_stall_cycles(), stall_breakdown(), latency(),
+                             slowest(), slowest_count(0) {}
+    };
+
+    // Result of run_sampled. The estimate is the measured windows' CPI
+    // (their cycles, drain included, over their instructions) times every
+    // instruction run.
+    struct SampledTiming {
+        uint64_t windows;
+        uint64_t measured_instructions;
+        uint64_t measured_cycles;
+        uint64_t detailed_cycles;     // everything ticked, including warmup and drain
+        uint64_t instructions;
+        double cpi;
+        double cpi_error;             // 95 % confidence half-width, relative to cpi
+        uint64_t estimated_cycles;
+        bool complete;                // false if max_cycles ran out first
+        bool exact;                   // ran entirely in detail; the estimate is the count
     };
 
-    TPU(size_t host_memory_size_mb = 4);
+    TPU(const TPUConfig& config = TPUConfig());
+    // Cores of a chip point into each other's shared state; never copy or move.
+    TPU(const TPU&) = delete;
+    TPU& operator=(const TPU&) = delete;
+    const TPUConfig& get_config() const { return config; }
+    // Makes this a core of a chip (see Chip): it uses the chip's host memory
+    // in place of its own, reaches it through the shared port, and waits
+    // for the other cores at SYNC. Call before loading anything.
+    void attach_to_chip(HostMemory& shared_memory, HostPort& port, SyncBarrier& barrier);
     void load_program(const std::string& filepath);
+    void load_program(const std::vector<Instruction>& instructions);
     void load_host_memory(const std::string& filepath);
+    void load_host_memory(const uint8_t* data, size_t length);
+    // Maps an image shared with other TPUs instead of copying it; pages are
+    // copied on first write, so the image itself is never modified.
+    void map_host_image(const HostMemory::Image& image);
+    void read_host_memory(uint64_t addr, uint8_t* out, size_t length) const;
+    void write_host_memory(uint64_t addr, const uint8_t* data, size_t length);
+    // Checkpoints: the complete simulation state as a compact binary
+    // snapshot. That is the controller and issue queue, every unit's state
+    // machine, UB and accumulator contents, the weight FIFO, the host pages
+    // written so far and the statistics. Restore into a TPU with the same
+    // array, memory, FIFO and issue queue sizes that has loaded the same
+    // program and host image. Latencies, DMA and MXU timing may differ, so
+    // one snapshot can fan out into what-if runs. Tracing state is not
+    // saved. A failed restore leaves the TPU unusable.
+    void save_state(std::vector<uint8_t>& out) const;
+    bool restore_state(const std::vector<uint8_t>& snapshot);
+    bool save_checkpoint(const std::string& filepath) const;
+    bool load_checkpoint(const std::string& filepath);
     void tick();
-    bool is_halted() { return controller_state == ControllerState::HALTED; }
-    uint64_t get_cycle_count() { return stats.total_cycles; }
+    // Functional mode: executes the instruction at the program counter at
+    // once, straight through the units' data paths, with no cycle modeling.
+    // Host memory, the UB, the accumulator and the MXU weights end up exactly
+    // as after a cycle-accurate run. Call only between instructions, with
+    // nothing in flight (before the first tick, or after run_sampled).
+    // Returns false once halted.
+    bool step_functional();
+    void run_functional() { while (step_functional()) {} }
+    // SMARTS-style sampling: in every interval instructions, runs
+    // functionally up to a random offset, warms up for warmup instructions,
+    // measures window instructions with full timing (tick) until the
+    // pipeline drains, and runs the rest of the interval functionally. A
+    // program shorter than two intervals runs in full detail. Stops at HLT
+    // or once max_cycles have been ticked.
+    SampledTiming run_sampled(uint64_t interval, uint64_t window, uint64_t warmup, uint64_t max_cycles);
+    bool is_halted() const { return controller_state == ControllerState::HALTED; }
+    // Halted, and every unit has finished: the last host write has landed.
+    bool is_idle() const { return is_halted() && pipeline_drained(); }
+    // Serving: runs the loaded program again from entry on a warm TPU.
+    // Call once idle. The UB, accumulator, MXU weights, weight FIFO, CFG
+    // registers, host memory and statistics carry over; only the controller
+    // starts over, so nothing is reallocated. The cycle count keeps running.
+    void restart(uint32_t entry = 0);
+    uint64_t get_cycle_count() const { return stats.total_cycles; }
+    const PerformanceStats& get_stats() const { return stats; }
+    uint64_t get_mac_count() const { return systolic_array.get_pe_active_cycles(); }
+    uint64_t get_skipped_mac_count() const { return systolic_array.get_skipped_macs(); }
+    uint64_t get_dma_bytes() const { return dma.get_bytes_moved(); }
+    uint64_t get_dma_arbitration_cycles() const { return dma.get_arbitration_cycles(); }
+    // Fast-forward for cores ticked in lockstep: after a tick, how many of
+    // the following cycles are certain to be identical stalls (0 if it made
+    // progress, -1 if no busy unit bounds the stall), and accounting for
+    // that many without ticking them.
+    int stalled_cycles_ahead() const;
+    void skip_cycles(int cycles);
+    void set_fast_forward(bool enabled) { fast_forward = enabled; }
+    void set_mxu_timing(MxuTiming model);
+    void set_dma_config(const DmaConfig& dma_config);
+    // issue_queue_depth == 0 selects the original in-order controller: one
+    // instruction at a time, fetch waits for it to finish, and RW weights are
+    // visible to the next MMC as soon as the host read is issued.
+    void set_issue_queue_depth(size_t depth);
+    // Records a timeline of unit busy periods, controller and issue-slot
+    // states, and every instruction from fetch to retire, keeping the last
+    // max_spans spans. write_trace closes the open spans at the current
+    // cycle and writes Chrome trace-event JSON.
+    void enable_trace(size_t max_spans);
+    bool write_trace(const std::string& filepath);
     void print_performance_report();
+    // The report's counters, stall breakdown, latency histograms and
+    // slowest instructions as JSON.
+    bool write_stats_json(const std::string& filepath) const;
 
 private:
+    // A decoded instruction in the issue queue: waiting to dispatch, or
+    // working through its execute stages. It holds scoreboard claims on the
+    // ranges it touches; claims are dropped stage by stage once the unit that
+    // serializes the access has accepted the request. Weight tiles and MXU
+    // slots are handed out in program order by sequence number instead.
+    struct InFlight : Claims {
+        bool active;
+        bool dispatched;
+        bool issued_this_cycle;
+        bool result_taken;
+        Instruction instr;
+        ControllerState stage;
+        uint64_t ticket;
+        uint64_t weight_seq;   // RW: tile it loads; MMC: tile it pops
+        uint64_t mxu_seq;      // MMC: position in MXU issue order
+        ActivationParams act_params;  // ACT: CFG registers as of its decode
+        ConvParams conv_params;       // CONV: likewise
+        uint64_t issue_cycle;         // cycle it was decoded into the queue
+        uint64_t seq;                 // fetch order, for tracing
+        uint32_t pc;
+        uint64_t fetch_cycle;
+        const char* trace_state;      // state the open trace span is for
+        uint64_t trace_since;
+        std::vector<uint8_t> buffer_a;
+        std::vector<uint8_t> buffer_b;
+    };
+
+    TPUConfig config;
     UnifiedBuffer unified_buffer;
     WeightFIFO weight_fifo;
     SystolicArray systolic_array;
     Accumulator accumulator;
-    
+    // CFG writes these at decode, in program order; each ACT and CONV
+    // takes a copy.
+    ActivationParams act_registers;
+    ConvParams conv_registers;
+    // The layer and feature map of the last CONV decoded, to count each
+    // layer's im2col and feature map bytes once.
+    ConvParams last_conv;
+    uint32_t last_conv_fmap;
+
+    // An instruction as load_program pre-decodes it: everything decode needs
+    // that does not depend on machine state, worked out once per static
+    // instruction instead of once per decode attempt.
+    enum class DecodeKind : uint8_t { ISSUE, CFG, HLT, SYNC, ERROR };
+    struct MicroOp {
+        Instruction instr;
+        DecodeKind kind;
+        ControllerState first_stage;   // ISSUE
+        const char* error;             // ERROR: the message decode halts with
+        Claims claims;                 // ISSUE
+        // A superblock is a maximal run of ISSUE micro-ops. Bit k of
+        // hazard_mask is set if this one may conflict with the one k + 1
+        // before it in the same superblock; a clear bit lets the issue stage
+        // skip that older instruction. Older ones further back are checked
+        // at run time.
+        uint32_t superblock_start;
+        uint64_t hazard_mask;
+    };
+
     ControllerState controller_state;
     uint32_t instruction_pointer;
-    std::vector<Instruction> program;
-    Instruction current_instruction;
-    
-    std::vector<uint8_t> host_memory;
-    HostMemState host_mem_state;
-    int host_mem_cycles_remaining;
-    
-    std::vector<uint8_t> data_buffer_a;
-    std::vector<uint8_t> data_buffer_b;
+    std::vector<MicroOp> micro_ops;
+    const MicroOp* current_op;
+
+    bool in_order;
+    std::vector<InFlight> slots;
+    std::vector<size_t> issue_order;   // active slot indices, oldest first
+    uint64_t weight_tiles_decoded, weight_pops_decoded, mmcs_decoded;
+    uint64_t weight_tiles_loaded, weight_tiles_popped, mmcs_executed;
+    // Fetch stops here (run_sampled drains the pipeline this way).
+    uint64_t fetch_limit;
+    // Functional mode: tiles loaded by RW while the weight FIFO was full,
+    // which the decoupled controller would hold in RW's issue slot.
+    std::deque<std::vector<uint8_t>> weight_backlog;
+    // Where a compressed RW tile is expanded before it enters the FIFO.
+    std::vector<uint8_t> weight_scratch;
+
+    HostMemory own_host_memory;
+    HostMemory* host_memory;   // own_host_memory, or the chip's
+    DmaEngine dma;
+    // SYNC: null outside a chip. sync_generation is the barrier generation
+    // this core arrived in.
+    SyncBarrier* barrier;
+    bool sync_arrived;
+    uint64_t sync_generation;
 
     PerformanceStats stats;
+    bool fast_forward;
+    bool tick_progress;
+    uint64_t tick_unit_stalls[static_cast<int>(StallUnit::COUNT)];
+    // stall_breakdown entries (flattened) hit this tick, and the opcode
+    // and state the next stall_on is charged to.
+    std::vector<uint32_t> tick_stall_keys;
+    int stall_opcode;
+    int stall_state;
+
+    // Tracing: null unless enable_trace was called.
+    std::unique_ptr<Tracer> tracer;
+    uint64_t fetch_cycle;
+    const char* front_trace_state;
+    uint64_t front_trace_since;
+    bool unit_traced_busy[4];
+    uint64_t unit_trace_since[4];
 
+    size_t tile_result_bytes() const { return static_cast<size_t>(config.array_size) * config.array_size * sizeof(int32_t); }
+    // A batched MMC can fill the whole accumulator in one result.
+    size_t max_result_bytes() const { return std::max(tile_result_bytes(), config.acc_entries * sizeof(int32_t)); }
+    // Nothing in flight: instructions retire once their last unit has taken
+    // the request, so the UB, accumulator and DMA must have finished too.
+    bool pipeline_drained() const {
+        return issue_order.empty() && unified_buffer.get_state() == CompState::IDLE &&
+               accumulator.get_state() == CompState::IDLE && dma.get_state() == CompState::IDLE;
+    }
+    bool pipeline_empty() const { return controller_state == ControllerState::FETCH && pipeline_drained(); }
     void tick_fetch();
     void tick_decode();
     void tick_execute();
-    
-    bool host_read_request(uint32_t addr, uint32_t length);
-    bool host_write_request(uint32_t addr, const std::vector<uint8_t>& data);
-    void tick_host_memory();
+    void tick_slot(InFlight& slot);
+    void stall_on(StallUnit unit);
+    void retire(InFlight& slot);
+    void record_latency(const InFlight& slot);
+    void set_stall_context(OpCode opcode, ControllerState state);
+    void halt_with_error(const char* message);
+    bool conv_valid(const Instruction& instr, const ConvParams& conv) const;
+    void count_conv(const Instruction& instr, const ConvParams& conv);
+    bool expand_weights(std::vector<uint8_t>& buffer);
+    void predecode(const std::vector<Instruction>& instructions);
+    uint64_t program_fingerprint() const;
+    bool has_hazard(const InFlight& candidate) const;
+
+    uint64_t host_read_request(uint64_t addr, uint32_t length, std::vector<uint8_t>& out);
+    uint64_t host_write_request(uint64_t addr, const std::vector<uint8_t>& data);
+    bool host_op_done(uint64_t ticket) const { return dma.done(ticket); }
+    void trace_tick();
+    void trace_slot(InFlight& slot, bool retiring);
+    std::vector<std::string> trace_track_names() const;
 };
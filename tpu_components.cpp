@@ -1,151 +1,775 @@
 #include "tpu_components.h"
 #include <stdexcept>
 #include <cstring>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
 
-int LATENCY_SRAM_READ = 20;
-int LATENCY_SRAM_WRITE = 20;
-int LATENCY_ACC_READ = 5;
-int LATENCY_ACC_WRITE = 5;
-int LATENCY_ACTIVATE = 16;
-int LATENCY_MXU = 32;
+MemoryModel::MemoryModel(const std::string& name, size_t size_bytes) : name(name), bytes(size_bytes, 0) {}
 
-UnifiedBuffer::UnifiedBuffer(size_t size_kb) : state(CompState::IDLE), cycles_remaining(0) {
-    this->size_bytes = size_kb * 1024;
+void MemoryModel::check_range(uint32_t addr, size_t length) const {
+    if (addr > bytes.size() || length > bytes.size() - addr) {
+        throw std::out_of_range(name + ": access [" + std::to_string(addr) + ", " +
+                                std::to_string(static_cast<uint64_t>(addr) + length) +
+                                ") exceeds capacity of " + std::to_string(bytes.size()) + " bytes");
+    }
+}
+
+void MemoryModel::read(uint32_t addr, uint8_t* out, size_t length) const {
+    check_range(addr, length);
+    if (length > 0) std::memcpy(out, bytes.data() + addr, length);
+}
+
+void MemoryModel::write(uint32_t addr, const uint8_t* data, size_t length) {
+    check_range(addr, length);
+    if (length > 0) std::memcpy(bytes.data() + addr, data, length);
+}
+
+uint8_t* MemoryModel::range(uint32_t addr, size_t length) {
+    check_range(addr, length);
+    return bytes.data() + addr;
+}
+
+namespace {
+const size_t SNAPSHOT_PAGE_BYTES = 4096;
 }
 
+void MemoryModel::save(SnapshotWriter& out) const {
+    std::vector<uint64_t> nonzero;
+    for (size_t begin = 0; begin < bytes.size(); begin += SNAPSHOT_PAGE_BYTES) {
+        auto page_end = bytes.begin() + std::min(bytes.size(), begin + SNAPSHOT_PAGE_BYTES);
+        if (std::any_of(bytes.begin() + begin, page_end, [](uint8_t b) { return b != 0; })) nonzero.push_back(begin);
+    }
+    out.pod(static_cast<uint64_t>(bytes.size()));
+    out.pod(static_cast<uint64_t>(nonzero.size()));
+    for (uint64_t begin : nonzero) {
+        out.pod(begin);
+        out.raw(bytes.data() + begin, std::min(SNAPSHOT_PAGE_BYTES, bytes.size() - begin));
+    }
+}
+
+void MemoryModel::load(SnapshotReader& in) {
+    if (in.get<uint64_t>() != bytes.size()) {
+        in.fail();
+        return;
+    }
+    std::fill(bytes.begin(), bytes.end(), 0);
+    uint64_t pages = in.get<uint64_t>();
+    for (uint64_t i = 0; i < pages && in.ok(); ++i) {
+        uint64_t begin = in.get<uint64_t>();
+        if (begin % SNAPSHOT_PAGE_BYTES != 0 || begin >= bytes.size()) {
+            in.fail();
+            return;
+        }
+        in.raw(bytes.data() + begin, std::min(SNAPSHOT_PAGE_BYTES, bytes.size() - begin));
+    }
+}
+
+UnifiedBuffer::UnifiedBuffer(size_t size_kb, int read_latency, int write_latency)
+    : memory("UnifiedBuffer", size_kb * 1024), size_bytes(size_kb * 1024),
+      read_latency(read_latency), write_latency(write_latency), state(CompState::IDLE), cycles_remaining(0), pending_op(UbOp::READ),
+      op_addr(0), op_length(0), op_slice(0), op_row_bytes(0), ops_issued(0), ops_completed(0) {}
+
 void UnifiedBuffer::tick() {
     if (state == CompState::BUSY) {
         cycles_remaining--;
         if (cycles_remaining <= 0) {
-            if (!write_data_buffer.empty()) {
+            if (pending_op == UbOp::WRITE) {
                 write_internal();
+            } else if (pending_op == UbOp::PATCHES) {
+                gather_patches(op_addr, op_conv, op_slice, op_row_bytes, op_length, read_result_buffer);
             } else {
                 read_internal();
             }
+            ops_completed++;
             state = CompState::IDLE;
         }
     }
 }
 
+void UnifiedBuffer::skip_cycles(int cycles) {
+    if (state == CompState::BUSY) cycles_remaining -= cycles;
+}
+
 bool UnifiedBuffer::read_request(uint32_t addr, uint32_t length) {
     if (state == CompState::BUSY) return false;
     state = CompState::BUSY;
-    cycles_remaining = LATENCY_SRAM_READ;
+    ops_issued++;
+    cycles_remaining = read_latency;
+    pending_op = UbOp::READ;
     this->op_addr = addr;
     this->op_length = length;
-    this->write_data_buffer.clear();
     return true;
 }
 
-bool UnifiedBuffer::write_request(uint32_t addr, const std::vector<uint8_t>& data) {
+bool UnifiedBuffer::patch_read_request(uint32_t fmap_addr, const ConvParams& conv, uint32_t slice, uint32_t row_bytes,
+                                       uint32_t length) {
+    if (!read_request(fmap_addr, length)) return false;
+    pending_op = UbOp::PATCHES;
+    op_conv = conv;
+    op_slice = slice;
+    op_row_bytes = row_bytes;
+    return true;
+}
+
+bool UnifiedBuffer::write_request(uint32_t addr, std::vector<uint8_t>& data) {
     if (state == CompState::BUSY) return false;
     state = CompState::BUSY;
-    cycles_remaining = LATENCY_SRAM_WRITE;
+    ops_issued++;
+    cycles_remaining = write_latency;
+    pending_op = UbOp::WRITE;
     this->op_addr = addr;
-    this->write_data_buffer = data;
+    this->write_data_buffer.swap(data);
     return true;
 }
 
-std::vector<uint8_t> UnifiedBuffer::get_read_result() {
-    return this->read_result_buffer;
+void UnifiedBuffer::reserve_buffers(size_t bytes) {
+    write_data_buffer.reserve(bytes);
+    read_result_buffer.reserve(bytes);
+}
+
+void UnifiedBuffer::take_read_result(std::vector<uint8_t>& out) {
+    out.swap(this->read_result_buffer);
 }
 
 void UnifiedBuffer::write_internal() {
-    for (size_t i = 0; i < write_data_buffer.size(); ++i) { 
-        this->memory[op_addr + i] = write_data_buffer[i]; 
-    }
+    this->memory.write(op_addr, write_data_buffer.data(), write_data_buffer.size());
 }
 
 void UnifiedBuffer::read_internal() {
-    read_result_buffer.clear();
-    read_result_buffer.resize(op_length, 0);
-    for (uint32_t i = 0; i < op_length; ++i) {
-        auto it = this->memory.find(op_addr + i);
-        if (it != this->memory.end()) { read_result_buffer[i] = it->second; }
+    read_result_buffer.resize(op_length);
+    this->memory.read(op_addr, read_result_buffer.data(), op_length);
+}
+
+void UnifiedBuffer::gather_patches(uint32_t fmap_addr, const ConvParams& conv, uint32_t slice, uint32_t row_bytes,
+                                   uint32_t length, std::vector<uint8_t>& out) const {
+    out.resize(length);
+    // The slice is row_bytes channels at one kernel position.
+    const uint32_t channel_blocks = conv.channels / row_bytes;
+    const int32_t kh = slice / channel_blocks / conv.kernel_w, kw = slice / channel_blocks % conv.kernel_w;
+    const uint32_t channel = slice % channel_blocks * row_bytes;
+    const int32_t out_width = conv.out_width();
+    for (uint32_t r = 0; r < length / row_bytes; ++r) {
+        int32_t pixel = conv.first_pixel + static_cast<int32_t>(r);
+        int32_t y = pixel / out_width * conv.stride - conv.pad + kh;
+        int32_t x = pixel % out_width * conv.stride - conv.pad + kw;
+        uint8_t* row = out.data() + static_cast<size_t>(r) * row_bytes;
+        if (y < 0 || y >= conv.height || x < 0 || x >= conv.width) {
+            std::memset(row, 0, row_bytes);
+            continue;
+        }
+        memory.read(fmap_addr + (static_cast<uint32_t>(y * conv.width + x) * conv.channels + channel), row, row_bytes);
     }
 }
 
 void UnifiedBuffer::write(uint32_t addr, const std::vector<uint8_t>& data) {
-    for (size_t i = 0; i < data.size(); ++i) this->memory[addr + i] = data[i];
+    this->memory.write(addr, data.data(), data.size());
 }
 
 std::vector<uint8_t> UnifiedBuffer::read(uint32_t addr, uint32_t length) {
-    std::vector<uint8_t> data_out(length, 0);
-    for (uint32_t i = 0; i < length; ++i) {
-        auto it = this->memory.find(addr + i);
-        if (it != this->memory.end()) data_out[i] = it->second;
-    }
+    std::vector<uint8_t> data_out(length);
+    this->memory.read(addr, data_out.data(), length);
     return data_out;
 }
 
-WeightFIFO::WeightFIFO() : state(CompState::IDLE) {}
+void UnifiedBuffer::read(uint32_t addr, uint32_t length, std::vector<uint8_t>& out) const {
+    out.resize(length);
+    this->memory.read(addr, out.data(), length);
+}
+
+void UnifiedBuffer::save(SnapshotWriter& out) const {
+    memory.save(out);
+    out.pod(state);
+    out.pod(cycles_remaining);
+    out.pod(pending_op);
+    out.bytes(write_data_buffer);
+    out.bytes(read_result_buffer);
+    out.pod(op_addr);
+    out.pod(op_length);
+    out.pod(op_conv);
+    out.pod(op_slice);
+    out.pod(op_row_bytes);
+    out.pod(ops_issued);
+    out.pod(ops_completed);
+}
+
+void UnifiedBuffer::load(SnapshotReader& in) {
+    memory.load(in);
+    in.pod(state);
+    in.pod(cycles_remaining);
+    in.pod(pending_op);
+    in.bytes(write_data_buffer);
+    in.bytes(read_result_buffer);
+    in.pod(op_addr);
+    in.pod(op_length);
+    in.pod(op_conv);
+    in.pod(op_slice);
+    in.pod(op_row_bytes);
+    in.pod(ops_issued);
+    in.pod(ops_completed);
+}
+
+WeightFIFO::WeightFIFO(size_t depth) : slots(depth ? depth : 1), head(0), count(0), state(CompState::IDLE) {}
 void WeightFIFO::tick() {}
-void WeightFIFO::load(const std::vector<uint8_t>& weights) {
-    this->fifo.push(weights);
+void WeightFIFO::reserve_buffers(size_t bytes) {
+    for (auto& slot : slots) slot.reserve(bytes);
+}
+bool WeightFIFO::load(std::vector<uint8_t>& weights) {
+    if (full()) return false;
+    this->slots[(head + count) % slots.size()].swap(weights);
+    count++;
+    return true;
+}
+void WeightFIFO::read(std::vector<uint8_t>& out) {
+    if (count == 0) {
+        out.clear();
+        return;
+    }
+    out.swap(this->slots[head]);
+    head = (head + 1) % slots.size();
+    count--;
+}
+
+void WeightFIFO::save(SnapshotWriter& out) const {
+    out.pod(static_cast<uint64_t>(count));
+    for (size_t i = 0; i < count; ++i) out.bytes(slots[(head + i) % slots.size()]);
+}
+
+void WeightFIFO::load(SnapshotReader& in) {
+    uint64_t tiles = in.get<uint64_t>();
+    if (tiles > slots.size()) {
+        in.fail();
+        return;
+    }
+    head = 0;
+    count = static_cast<size_t>(tiles);
+    for (size_t i = 0; i < count; ++i) in.bytes(slots[i]);
+}
+
+DmaEngine::DmaEngine(const DmaConfig& config)
+    : port(nullptr), state(CompState::IDLE), now(0), channel_free_cycle(0), head(0), count(0),
+      ops_issued(0), ops_completed(0), bytes_moved(0), channel_busy_cycles(0), arbitration_cycles(0) {
+    configure(config);
+}
+
+void DmaEngine::configure(const DmaConfig& new_config) {
+    if (count > 0) {
+        std::cerr << "ERROR: Cannot reconfigure DMA with transfers outstanding." << std::endl;
+        return;
+    }
+    config = new_config;
+    if (config.max_outstanding == 0) config.max_outstanding = 1;
+    done_cycles.assign(config.max_outstanding, 0);
+    head = 0;
 }
-std::vector<uint8_t> WeightFIFO::read() {
-    if (this->fifo.empty()) {
-        return std::vector<uint8_t>();
+
+uint64_t DmaEngine::transfer_cycles(uint32_t length) const {
+    if (config.bytes_per_cycle == 0 || length == 0) return 0;
+    uint32_t burst = config.burst_bytes ? config.burst_bytes : length;
+    uint64_t cycles_per_burst = (burst + config.bytes_per_cycle - 1) / config.bytes_per_cycle;
+    uint64_t full_bursts = length / burst;
+    uint32_t tail = length % burst;
+    return full_bursts * cycles_per_burst + (tail + config.bytes_per_cycle - 1) / config.bytes_per_cycle;
+}
+
+void DmaEngine::tick() {
+    now++;
+    while (count > 0 && done_cycles[head] <= now) {
+        head = (head + 1) % done_cycles.size();
+        count--;
+        ops_completed++;
     }
-    std::vector<uint8_t> weights = this->fifo.front();
-    this->fifo.pop();
-    return weights;
+    state = count > 0 ? CompState::BUSY : CompState::IDLE;
 }
 
-SystolicArray::SystolicArray(int size) : size(size), state(CompState::IDLE), cycles_remaining(0) {}
+uint64_t DmaEngine::submit(uint32_t length) {
+    if (!can_accept()) return 0;
+    uint64_t xfer = transfer_cycles(length);
+    uint64_t data_start = std::max(now + config.base_latency, channel_free_cycle);
+    uint64_t done_cycle = data_start + xfer;
+    if (port) {
+        uint64_t port_end;
+        uint64_t granted = port->grant(data_start, length, port_end);
+        arbitration_cycles += granted - data_start;
+        data_start = granted;
+        done_cycle = std::max(data_start + xfer, port_end);
+    }
+    channel_free_cycle = data_start + xfer;
+    done_cycles[(head + count) % done_cycles.size()] = done_cycle;
+    count++;
+    state = CompState::BUSY;
+    bytes_moved += length;
+    channel_busy_cycles += xfer;
+    return ++ops_issued;
+}
+
+void DmaEngine::save(SnapshotWriter& out) const {
+    out.pod(state);
+    out.pod(now);
+    out.pod(channel_free_cycle);
+    out.pod(static_cast<uint64_t>(count));
+    for (size_t i = 0; i < count; ++i) out.pod(done_cycles[(head + i) % done_cycles.size()]);
+    out.pod(ops_issued);
+    out.pod(ops_completed);
+    out.pod(bytes_moved);
+    out.pod(channel_busy_cycles);
+    out.pod(arbitration_cycles);
+}
+
+// Outstanding transfers keep the completion cycles they were given; only
+// new ones see this engine's configuration. A checkpoint taken with more
+// outstanding descriptors than this engine allows keeps them all, and no new
+// transfer starts until they drain below the limit.
+void DmaEngine::load(SnapshotReader& in) {
+    in.pod(state);
+    in.pod(now);
+    in.pod(channel_free_cycle);
+    uint64_t outstanding = in.get<uint64_t>();
+    if (outstanding > in.remaining() / sizeof(uint64_t)) {
+        in.fail();
+        return;
+    }
+    if (outstanding > done_cycles.size()) done_cycles.resize(static_cast<size_t>(outstanding));
+    head = 0;
+    count = static_cast<size_t>(outstanding);
+    for (size_t i = 0; i < count; ++i) in.pod(done_cycles[i]);
+    in.pod(ops_issued);
+    in.pod(ops_completed);
+    in.pod(bytes_moved);
+    in.pod(channel_busy_cycles);
+    in.pod(arbitration_cycles);
+}
+
+uint64_t HostPort::grant(uint64_t ready, uint32_t length, uint64_t& end) {
+    uint64_t start = std::max(ready, free_cycle);
+    uint64_t hold = bytes_per_cycle ? (static_cast<uint64_t>(length) + bytes_per_cycle - 1) / bytes_per_cycle : 0;
+    end = start + hold;
+    if (bytes_per_cycle) free_cycle = end;
+    busy_cycles += hold;
+    wait_cycles += start - ready;
+    grants++;
+    return start;
+}
+
+int DmaEngine::get_cycles_remaining() const {
+    if (count == 0) return 0;
+    return static_cast<int>(done_cycles[head] - now);
+}
+
+SystolicArray::SystolicArray(int size, int fixed_latency)
+    : size(size), fixed_latency(fixed_latency), timing(MxuTiming::FIXED), state(CompState::IDLE), now(0), ops(2),
+      ops_head(0), ops_count(0), ops_completed(0), input_free_cycle(0), weights_free_cycle(0),
+      last_done_cycle(0), weights_latched(false), weight_loads(0), weight_reuses(0), zero_skip(false),
+      latched_blocks(~uint64_t(0)), latched_rows(size), zero_blocks(0), skipped_macs(0), saved_cycles(0),
+      profiled_rows(-1), profiled_depth(-1), profiled_pe_cycles(0), profiled_drain_cycles(0), pe_active_cycles(0), overlap_cycles(0) {
+    pe_valid.resize(static_cast<size_t>(size) * ((size + 63) / 64));
+    set_max_isa(GemmIsa::AVX512_VNNI);
+}
+
+void SystolicArray::set_max_isa(GemmIsa max_isa) {
+    kernel = select_gemm_kernel(size, max_isa);
+    packed_weights.resize(kernel.packed_weight_bytes);
+}
 
 void SystolicArray::tick() {
-    if (state == CompState::BUSY) {
-        cycles_remaining--;
-        if (cycles_remaining <= 0) {
-            execute_internal();
-            state = CompState::IDLE;
+    now++;
+    while (ops_completed < ops_count) {
+        MxuOp& op = ops[(ops_head + ops_completed) % ops.size()];
+        if (op.done_cycle > now) break;
+        pe_active_cycles += op.pe_cycles;
+        ops_completed++;
+    }
+    state = ops_completed < ops_count ? CompState::BUSY : CompState::IDLE;
+}
+
+void SystolicArray::save(SnapshotWriter& out) const {
+    out.pod(state);
+    out.pod(now);
+    out.pod(static_cast<uint64_t>(ops_count));
+    out.pod(static_cast<uint64_t>(ops_completed));
+    for (size_t i = 0; i < ops_count; ++i) {
+        const MxuOp& op = ops[(ops_head + i) % ops.size()];
+        out.pod(op.done_cycle);
+        out.pod(op.pe_cycles);
+        out.bytes(op.result);
+    }
+    out.pod(input_free_cycle);
+    out.pod(weights_free_cycle);
+    out.pod(last_done_cycle);
+    out.bytes(input_buffer);
+    out.bytes(weight_buffer);
+    out.pod(weights_latched);
+    out.pod(weight_loads);
+    out.pod(weight_reuses);
+    out.pod(pe_active_cycles);
+    out.pod(overlap_cycles);
+    out.pod(zero_blocks);
+    out.pod(skipped_macs);
+    out.pod(saved_cycles);
+}
+
+// The packed weights and the wavefront profile are rebuilt rather than saved.
+void SystolicArray::load(SnapshotReader& in) {
+    in.pod(state);
+    in.pod(now);
+    uint64_t in_flight = in.get<uint64_t>();
+    uint64_t completed = in.get<uint64_t>();
+    if (in_flight > ops.size() || completed > in_flight) {
+        in.fail();
+        return;
+    }
+    ops_head = 0;
+    ops_count = static_cast<size_t>(in_flight);
+    ops_completed = static_cast<size_t>(completed);
+    for (size_t i = 0; i < ops_count; ++i) {
+        in.pod(ops[i].done_cycle);
+        in.pod(ops[i].pe_cycles);
+        in.bytes(ops[i].result);
+    }
+    in.pod(input_free_cycle);
+    in.pod(weights_free_cycle);
+    in.pod(last_done_cycle);
+    in.bytes(input_buffer);
+    in.bytes(weight_buffer);
+    bool latched = in.get<bool>();
+    latch_weights();
+    if (latched != weights_latched) in.fail();
+    in.pod(weight_loads);
+    in.pod(weight_reuses);
+    in.pod(pe_active_cycles);
+    in.pod(overlap_cycles);
+    in.pod(zero_blocks);
+    in.pod(skipped_macs);
+    in.pod(saved_cycles);
+    profiled_rows = -1;
+}
+
+void SystolicArray::skip_cycles(int cycles) {
+    now += cycles;
+}
+
+int SystolicArray::get_cycles_remaining() const {
+    if (ops_completed == ops_count) return 0;
+    return static_cast<int>(ops[(ops_head + ops_completed) % ops.size()].done_cycle - now);
+}
+
+bool SystolicArray::can_accept() const {
+    if (timing == MxuTiming::FIXED) return state == CompState::IDLE && ops_count == 0;
+    return ops_count < max_in_flight();
+}
+
+// Bit-parallel model of one tile streaming through the array: bit c of
+// pe_valid row r is set while PE(r, c) holds a valid input. Each cycle the
+// inputs move one PE to the right and input row i enters PE row r at cycle
+// i + r (the diagonal skew). Only the first depth PE rows take part; the rest
+// hold zero blocks and are bypassed. Counts PE-cycles doing a MAC and the
+// cycles until the last partial sum leaves PE(depth-1, size-1).
+void SystolicArray::profile_wavefront(int rows, int depth) {
+    const size_t words = (size + 63) / 64;
+    const uint64_t top_mask = (size % 64) ? (uint64_t(1) << (size % 64)) - 1 : ~uint64_t(0);
+    std::fill(pe_valid.begin(), pe_valid.end(), 0);
+    uint64_t pe_cycles = 0;
+    int64_t last_active = -1;
+    for (int64_t t = 0;; ++t) {
+        bool any = false;
+        for (int r = 0; r < depth; ++r) {
+            uint64_t* row = &pe_valid[r * words];
+            for (size_t w = words; w-- > 0;) {
+                row[w] = (row[w] << 1) | (w > 0 ? row[w - 1] >> 63 : 0);
+            }
+            row[words - 1] &= top_mask;
+            if (t - r >= 0 && t - r < rows) row[0] |= 1;
+            for (size_t w = 0; w < words; ++w) {
+                if (row[w]) {
+                    pe_cycles += __builtin_popcountll(row[w]);
+                    any = true;
+                }
+            }
+        }
+        if (any) {
+            last_active = t;
+        } else if (t >= rows + size) {
+            break;
         }
     }
+    profiled_rows = rows;
+    profiled_depth = depth;
+    profiled_pe_cycles = pe_cycles;
+    profiled_drain_cycles = static_cast<uint64_t>(last_active + 1);
 }
 
-bool SystolicArray::execute_request(const std::vector<uint8_t>& inputs, const std::vector<uint8_t>& weights) {
-    if (state == CompState::BUSY) return false;
+void SystolicArray::set_zero_skip(bool enabled) {
+    zero_skip = enabled;
+    latch_weights();
+}
+
+void SystolicArray::latch_weights() {
+    const size_t tile_bytes = static_cast<size_t>(size) * size;
+    const int8_t* weights = reinterpret_cast<const int8_t*>(weight_buffer.data());
+    weights_latched = weight_buffer.size() == tile_bytes;
+    if (weights_latched) kernel.pack_weights(weights, packed_weights.data(), size);
+    latched_blocks = ~uint64_t(0);
+    latched_rows = size;
+    if (weights_latched && zero_skip) {
+        latched_blocks = nonzero_weight_blocks(weights, size);
+        latched_rows = nonzero_weight_rows(latched_blocks, size);
+    }
+}
+
+void SystolicArray::load_weights(std::vector<uint8_t>& weights) {
+    this->weight_buffer.swap(weights);
+    latch_weights();
+    weight_loads++;
+    if (weights_latched && zero_skip) zero_blocks += sparse_blocks(size) - __builtin_popcountll(latched_blocks);
+}
+
+bool SystolicArray::execute_request(std::vector<uint8_t>& inputs, std::vector<uint8_t>& weights) {
+    if (!can_accept()) return false;
+    this->input_buffer.swap(inputs);
+    load_weights(weights);
+    return start_op(true);
+}
+
+bool SystolicArray::execute_request(std::vector<uint8_t>& inputs) {
+    if (!can_accept()) return false;
+    this->input_buffer.swap(inputs);
+    weight_reuses++;
+    return start_op(false);
+}
+
+// Multiplies the input buffer by the latched weights into result; empty
+// unless weights are latched and the input is a whole number of rows.
+// Returns the number of input rows.
+int SystolicArray::multiply(std::vector<uint8_t>& result) {
+    // Any whole number of input rows streams through the latched weights;
+    // a batched MMC is just more rows.
+    int rows = static_cast<int>(this->input_buffer.size() / size);
+    if (weights_latched && rows > 0 && input_buffer.size() % size == 0) {
+        result.resize(input_buffer.size() * sizeof(int32_t));
+        if (latched_rows < size) {
+            kernel.multiply_blocks(reinterpret_cast<const int8_t*>(input_buffer.data()), packed_weights.data(),
+                                   reinterpret_cast<int32_t*>(result.data()), rows, size, latched_blocks);
+        } else {
+            kernel.multiply(reinterpret_cast<const int8_t*>(input_buffer.data()), packed_weights.data(),
+                            reinterpret_cast<int32_t*>(result.data()), rows, size);
+        }
+    } else {
+        result.clear();
+    }
+    return rows;
+}
+
+void SystolicArray::execute_now(std::vector<uint8_t>& inputs, std::vector<uint8_t>& weights) {
+    load_weights(weights);
+    multiply_now(inputs);
+}
+
+void SystolicArray::execute_now(std::vector<uint8_t>& inputs) {
+    weight_reuses++;
+    multiply_now(inputs);
+}
+
+void SystolicArray::multiply_now(std::vector<uint8_t>& inputs) {
+    this->input_buffer.swap(inputs);
+    int rows = multiply(inputs);
+    pe_active_cycles += static_cast<uint64_t>(rows) * latched_rows * size;
+    skipped_macs += static_cast<uint64_t>(rows) * (size - latched_rows) * size;
+}
+
+bool SystolicArray::start_op(bool new_weights) {
+    MxuOp& op = ops[(ops_head + ops_count) % ops.size()];
+    int rows = multiply(op.result);
+    // Zero blocks bypassed, the tile is only latched_rows PE rows deep.
+    const int depth = latched_rows;
+    skipped_macs += static_cast<uint64_t>(rows) * (size - depth) * size;
+    if (timing == MxuTiming::FIXED) {
+        // fixed_latency covers one size-row block (scaled down to the rows
+        // left after zero skipping); further rows follow one per cycle
+        // behind it.
+        int latency = depth < size ? std::max(1, (fixed_latency * depth + size - 1) / size) : fixed_latency;
+        saved_cycles += fixed_latency - latency;
+        op.done_cycle = now + latency + (rows > size ? rows - size : 0);
+        op.pe_cycles = static_cast<uint64_t>(rows) * depth * size;
+    } else {
+        if (rows != profiled_rows || depth != profiled_depth) profile_wavefront(rows, depth);
+        // A dense tile drains in rows + 2 * size - 2 cycles.
+        if (depth < size && rows > 0) {
+            saved_cycles += (new_weights ? size - depth : 0) + (rows + 2 * size - 2 - profiled_drain_cycles);
+        }
+        uint64_t input_start;
+        if (new_weights) {
+            // Only the rows of nonzero blocks shift in.
+            uint64_t shift_start = std::max(now, weights_free_cycle);
+            input_start = std::max(shift_start + depth, input_free_cycle);
+        } else {
+            input_start = std::max(now, input_free_cycle);
+        }
+        weights_free_cycle = input_start;
+        input_free_cycle = input_start + rows;
+        op.done_cycle = input_start + profiled_drain_cycles;
+        op.pe_cycles = profiled_pe_cycles;
+        if (last_done_cycle > input_start) {
+            overlap_cycles += last_done_cycle - input_start;
+        }
+    }
+    last_done_cycle = op.done_cycle;
+    ops_count++;
     state = CompState::BUSY;
-    cycles_remaining = LATENCY_MXU;
-    this->input_buffer = inputs;
-    this->weight_buffer = weights;
     return true;
 }
 
-std::vector<uint8_t> SystolicArray::get_result() {
-    return this->result_buffer;
+void SystolicArray::reserve_buffers(size_t bytes) {
+    input_buffer.reserve(bytes);
+    weight_buffer.reserve(bytes);
+    for (auto& op : ops) op.result.reserve(bytes);
 }
 
-void SystolicArray::execute_internal() {
-    this->result_buffer = execute(this->input_buffer, this->weight_buffer);
+void SystolicArray::take_result(std::vector<uint8_t>& out) {
+    if (ops_completed == 0) {
+        out.clear();
+        return;
+    }
+    out.swap(ops[ops_head].result);
+    ops_head = (ops_head + 1) % ops.size();
+    ops_count--;
+    ops_completed--;
+}
+
+void SystolicArray::execute(const std::vector<uint8_t>& inputs, const std::vector<uint8_t>& weights, std::vector<uint8_t>& results) {
+    const size_t tile_bytes = static_cast<size_t>(size) * size;
+    if (inputs.empty() || inputs.size() % size != 0 || weights.size() != tile_bytes) {
+        results.clear();
+        return;
+    }
+    results.resize(inputs.size() * sizeof(int32_t));
+    kernel.pack_weights(reinterpret_cast<const int8_t*>(weights.data()), packed_weights.data(), size);
+    kernel.multiply(reinterpret_cast<const int8_t*>(inputs.data()), packed_weights.data(),
+                    reinterpret_cast<int32_t*>(results.data()), static_cast<int>(inputs.size() / size), size);
 }
 
 std::vector<uint8_t> SystolicArray::execute(const std::vector<uint8_t>& inputs, const std::vector<uint8_t>& weights) {
-    const int MAT_SIZE = 16;
-    if (inputs.size() != 256 || weights.size() != 256) {
-        return std::vector<uint8_t>();
-    }
-    std::vector<int32_t> results_32bit(MAT_SIZE * MAT_SIZE, 0);
-    const int8_t* in_ptr = reinterpret_cast<const int8_t*>(inputs.data());
-    const int8_t* wt_ptr = reinterpret_cast<const int8_t*>(weights.data());
-    for (int i = 0; i < MAT_SIZE; ++i) {
-        for (int j = 0; j < MAT_SIZE; ++j) {
-            int32_t sum = 0;
-            for (int k = 0; k < MAT_SIZE; ++k) {
-                int8_t a = in_ptr[i * MAT_SIZE + k];
-                int8_t b = wt_ptr[k * MAT_SIZE + j];
-                sum += static_cast<int32_t>(a) * static_cast<int32_t>(b);
-            }
-            results_32bit[i * MAT_SIZE + j] = sum;
+    std::vector<uint8_t> results;
+    execute(inputs, weights, results);
+    return results;
+}
+
+bool ActivationParams::set(uint32_t reg, int32_t value) {
+    switch (reg) {
+        case CFG_ACT_MULTIPLIER:  multiplier = value; break;
+        case CFG_ACT_SHIFT:
+            if (value < 0 || value > 31) return false;
+            shift = value;
+            break;
+        case CFG_ACT_ZERO_POINT:  zero_point = value; break;
+        case CFG_ACT_CLIP_MIN:    clip_min = value; break;
+        case CFG_ACT_CLIP_MAX:    clip_max = value; break;
+        case CFG_ACT_RELU6_MAX:   relu6_max = value; break;
+        case CFG_ACT_LEAKY_SLOPE: leaky_slope = value; break;
+        default: return false;
+    }
+    return true;
+}
+
+bool ConvParams::set(uint32_t reg, int32_t value) {
+    // Sizes stay small enough that no UB offset overflows.
+    const int32_t MAX_DIM = 1 << 16;
+    if (value < 0 || value > MAX_DIM) return false;
+    switch (reg) {
+        case CFG_CONV_HEIGHT:      height = value; break;
+        case CFG_CONV_WIDTH:       width = value; break;
+        case CFG_CONV_CHANNELS:    channels = value; break;
+        case CFG_CONV_KERNEL_H:
+            if (value == 0) return false;
+            kernel_h = value;
+            break;
+        case CFG_CONV_KERNEL_W:
+            if (value == 0) return false;
+            kernel_w = value;
+            break;
+        case CFG_CONV_STRIDE:
+            if (value == 0) return false;
+            stride = value;
+            break;
+        case CFG_CONV_PAD:         pad = value; break;
+        case CFG_CONV_FIRST_PIXEL: first_pixel = value; break;
+        default: return false;
+    }
+    return true;
+}
+
+bool ConvParams::valid(uint32_t fmap_addr, uint32_t slice, uint32_t length, uint32_t row_bytes, size_t ub_bytes) const {
+    if (height == 0 || width == 0 || channels == 0 || row_bytes == 0 || channels % row_bytes != 0) return false;
+    if (height + 2 * pad < kernel_h || width + 2 * pad < kernel_w || length % row_bytes != 0) return false;
+    if (slice >= patch_bytes() / row_bytes) return false;
+    if (static_cast<uint64_t>(first_pixel) + length / row_bytes > out_pixels()) return false;
+    return fmap_addr <= ub_bytes && feature_map_bytes() <= ub_bytes - fmap_addr;
+}
+
+bool ConvParams::same_layer(const ConvParams& other) const {
+    return height == other.height && width == other.width && channels == other.channels &&
+           kernel_h == other.kernel_h && kernel_w == other.kernel_w && stride == other.stride && pad == other.pad;
+}
+
+namespace {
+
+// Sigmoid and tanh of q/16 for every int8 q, in their int8 output formats.
+struct ActivationTables {
+    std::array<int8_t, 256> sigmoid;
+    std::array<int8_t, 256> tanh;
+
+    ActivationTables() {
+        for (int q = -128; q < 128; ++q) {
+            double x = q / 16.0;
+            long s = std::lround(256.0 / (1.0 + std::exp(-x))) - 128;
+            long t = std::lround(128.0 * std::tanh(x));
+            sigmoid[q + 128] = static_cast<int8_t>(std::min(127L, std::max(-128L, s)));
+            tanh[q + 128] = static_cast<int8_t>(std::min(127L, std::max(-128L, t)));
         }
     }
-    std::vector<uint8_t> results_bytes(MAT_SIZE * MAT_SIZE * sizeof(int32_t));
-    std::memcpy(results_bytes.data(), results_32bit.data(), results_bytes.size());
-    return results_bytes;
+};
+
+const ActivationTables& activation_tables() {
+    static const ActivationTables tables;
+    return tables;
+}
+
+} // namespace
+
+int8_t requantize(int32_t value, const ActivationParams& params) {
+    int64_t scaled = static_cast<int64_t>(value) * params.multiplier;
+    if (params.shift > 0) scaled = (scaled + (int64_t(1) << (params.shift - 1))) >> params.shift;
+    scaled += params.zero_point;
+    return static_cast<int8_t>(std::min<int64_t>(127, std::max<int64_t>(-128, scaled)));
+}
+
+int32_t apply_activation(int32_t value, uint8_t func, const ActivationParams& params) {
+    switch (func) {
+        case ACT_RELU:       return std::max(value, 0);
+        case ACT_RELU6:      return std::min(std::max(value, 0), params.relu6_max);
+        case ACT_CLIP:       return std::min(std::max(value, params.clip_min), params.clip_max);
+        case ACT_LEAKY_RELU:
+            if (value >= 0) return value;
+            return static_cast<int32_t>((static_cast<int64_t>(value) * params.leaky_slope) >> 16);
+        case ACT_SIGMOID:    return activation_tables().sigmoid[requantize(value, params) + 128];
+        case ACT_TANH:       return activation_tables().tanh[requantize(value, params) + 128];
+        default:             return value;
+    }
+}
+
+int8_t activate_to_int8(int32_t value, uint8_t func, const ActivationParams& params) {
+    int32_t activated = apply_activation(value, func, params);
+    // Table lookups already produce the int8 result.
+    if (func == ACT_SIGMOID || func == ACT_TANH) return static_cast<int8_t>(activated);
+    return requantize(activated, params);
 }
 
-Accumulator::Accumulator(size_t entries) : size(entries), state(CompState::IDLE), cycles_remaining(0) {}
+Accumulator::Accumulator(size_t entries, int read_latency, int write_latency, int activate_latency,
+                         int accumulate_latency)
+    : memory("Accumulator", entries * sizeof(int32_t)), size(entries), read_latency(read_latency),
+      write_latency(write_latency), activate_latency(activate_latency), accumulate_latency(accumulate_latency),
+      state(CompState::IDLE), cycles_remaining(0), pending_op(AccOp::READ), op_func(ACT_RELU), op_to_int8(false),
+      ops_issued(0), ops_completed(0) {}
 
 void Accumulator::tick() {
     if (state == CompState::BUSY) {
@@ -155,26 +779,82 @@ void Accumulator::tick() {
                 case AccOp::WRITE:    write_internal();    break;
                 case AccOp::READ:     read_internal();     break;
                 case AccOp::ACTIVATE: activate_internal(); break;
+                case AccOp::ACCUMULATE: accumulate_internal(); break;
             }
+            ops_completed++;
             state = CompState::IDLE;
         }
     }
 }
 
-bool Accumulator::write_request(uint32_t addr, const std::vector<uint8_t>& data) {
+void Accumulator::save(SnapshotWriter& out) const {
+    memory.save(out);
+    out.pod(state);
+    out.pod(cycles_remaining);
+    out.pod(pending_op);
+    out.bytes(write_data_buffer);
+    out.bytes(read_result_buffer);
+    out.pod(op_addr);
+    out.pod(op_length_or_elements);
+    out.pod(op_func);
+    out.pod(op_to_int8);
+    out.pod(op_params);
+    out.pod(ops_issued);
+    out.pod(ops_completed);
+}
+
+void Accumulator::load(SnapshotReader& in) {
+    memory.load(in);
+    in.pod(state);
+    in.pod(cycles_remaining);
+    in.pod(pending_op);
+    in.bytes(write_data_buffer);
+    in.bytes(read_result_buffer);
+    in.pod(op_addr);
+    in.pod(op_length_or_elements);
+    in.pod(op_func);
+    in.pod(op_to_int8);
+    in.pod(op_params);
+    in.pod(ops_issued);
+    in.pod(ops_completed);
+}
+
+void Accumulator::skip_cycles(int cycles) {
+    if (state == CompState::BUSY) cycles_remaining -= cycles;
+}
+
+void Accumulator::reserve_buffers(size_t bytes) {
+    write_data_buffer.reserve(bytes);
+    read_result_buffer.reserve(bytes);
+}
+
+bool Accumulator::write_request(uint32_t addr, std::vector<uint8_t>& data) {
     if (state == CompState::BUSY) return false;
     state = CompState::BUSY;
-    cycles_remaining = LATENCY_ACC_WRITE;
+    ops_issued++;
+    cycles_remaining = write_latency;
     pending_op = AccOp::WRITE;
     op_addr = addr;
-    write_data_buffer = data;
+    write_data_buffer.swap(data);
+    return true;
+}
+
+bool Accumulator::accumulate_request(uint32_t addr, std::vector<uint8_t>& data) {
+    if (state == CompState::BUSY) return false;
+    state = CompState::BUSY;
+    ops_issued++;
+    cycles_remaining = accumulate_latency;
+    pending_op = AccOp::ACCUMULATE;
+    op_addr = addr;
+    write_data_buffer.swap(data);
     return true;
 }
 
 bool Accumulator::read_request(uint32_t addr, uint32_t length) {
     if (state == CompState::BUSY) return false;
     state = CompState::BUSY;
-    cycles_remaining = LATENCY_ACC_READ;
+    ops_issued++;
+    cycles_remaining = read_latency;
     pending_op = AccOp::READ;
     op_addr = addr;
     op_length_or_elements = length;
@@ -182,66 +862,96 @@ bool Accumulator::read_request(uint32_t addr, uint32_t length) {
 }
 
 bool Accumulator::activate_request(uint32_t addr, uint32_t num_elements) {
+    return activate_request(addr, num_elements, ACT_RELU, ActivationParams(), false);
+}
+
+bool Accumulator::activate_request(uint32_t addr, uint32_t num_elements, uint8_t func,
+                                   const ActivationParams& params, bool to_int8) {
     if (state == CompState::BUSY) return false;
     state = CompState::BUSY;
-    cycles_remaining = LATENCY_ACTIVATE;
+    ops_issued++;
+    cycles_remaining = activate_latency;
     pending_op = AccOp::ACTIVATE;
     op_addr = addr;
     op_length_or_elements = num_elements;
+    op_func = func;
+    op_params = params;
+    op_to_int8 = to_int8;
     return true;
 }
 
-std::vector<uint8_t> Accumulator::get_read_result() {
-    return this->read_result_buffer;
+void Accumulator::take_read_result(std::vector<uint8_t>& out) {
+    out.swap(this->read_result_buffer);
 }
 
 void Accumulator::write_internal() {
-    for (size_t i = 0; i < write_data_buffer.size(); ++i) { 
-        this->memory[op_addr + i] = write_data_buffer[i]; 
-    }
+    this->memory.write(op_addr, write_data_buffer.data(), write_data_buffer.size());
 }
 
 void Accumulator::read_internal() {
-    read_result_buffer.clear();
-    read_result_buffer.resize(op_length_or_elements, 0);
-    for (uint32_t i = 0; i < op_length_or_elements; ++i) {
-        auto it = this->memory.find(op_addr + i);
-        if (it != this->memory.end()) { read_result_buffer[i] = it->second; }
-    }
+    read_result_buffer.resize(op_length_or_elements);
+    this->memory.read(op_addr, read_result_buffer.data(), op_length_or_elements);
 }
 
 void Accumulator::activate_internal() {
     uint32_t num_elements = op_length_or_elements;
-    uint32_t length_bytes = num_elements * sizeof(int32_t);
-    std::vector<uint8_t> data_bytes(length_bytes, 0);
-    for (uint32_t i = 0; i < length_bytes; ++i) {
-        auto it = this->memory.find(op_addr + i);
-        if (it != this->memory.end()) { data_bytes[i] = it->second; }
-    }
-    std::vector<int32_t> elements(num_elements);
-    std::memcpy(elements.data(), data_bytes.data(), length_bytes);
+    uint8_t* data_bytes = this->memory.range(op_addr, static_cast<size_t>(num_elements) * sizeof(int32_t));
+    if (op_to_int8) read_result_buffer.resize(num_elements);
     for (uint32_t i = 0; i < num_elements; ++i) {
-        if (elements[i] < 0) {
-            elements[i] = 0;
+        int32_t element;
+        std::memcpy(&element, data_bytes + i * sizeof(int32_t), sizeof(int32_t));
+        if (op_to_int8) {
+            read_result_buffer[i] = static_cast<uint8_t>(activate_to_int8(element, op_func, op_params));
+        } else {
+            int32_t activated = apply_activation(element, op_func, op_params);
+            if (activated != element) std::memcpy(data_bytes + i * sizeof(int32_t), &activated, sizeof(int32_t));
         }
     }
-    std::memcpy(data_bytes.data(), elements.data(), length_bytes);
-    for (size_t i = 0; i < length_bytes; ++i) { 
-        this->memory[op_addr + i] = data_bytes[i]; 
+}
+
+void Accumulator::accumulate_internal() {
+    size_t num_elements = write_data_buffer.size() / sizeof(int32_t);
+    uint8_t* data_bytes = this->memory.range(op_addr, num_elements * sizeof(int32_t));
+    for (size_t i = 0; i < num_elements; ++i) {
+        // Two's-complement wraparound, as a hardware adder would.
+        uint32_t sum, partial;
+        std::memcpy(&sum, data_bytes + i * sizeof(int32_t), sizeof(int32_t));
+        std::memcpy(&partial, write_data_buffer.data() + i * sizeof(int32_t), sizeof(int32_t));
+        sum += partial;
+        std::memcpy(data_bytes + i * sizeof(int32_t), &sum, sizeof(int32_t));
     }
 }
 
 void Accumulator::write(uint32_t addr, const std::vector<uint8_t>& data) {
-    for (size_t i = 0; i < data.size(); ++i) this->memory[addr + i] = data[i];
+    this->memory.write(addr, data.data(), data.size());
 }
 std::vector<uint8_t> Accumulator::read(uint32_t addr, uint32_t length) {
-    std::vector<uint8_t> data_out(length, 0);
-    for (uint32_t i = 0; i < length; ++i) {
-        auto it = this->memory.find(addr + i);
-        if (it != this->memory.end()) data_out[i] = it->second;
-    }
+    std::vector<uint8_t> data_out(length);
+    this->memory.read(addr, data_out.data(), length);
     return data_out;
 }
 void Accumulator::activate(uint32_t addr, uint32_t num_elements) {
+    activate(addr, num_elements, ACT_RELU, ActivationParams(), false);
+}
+
+void Accumulator::read(uint32_t addr, uint32_t length, std::vector<uint8_t>& out) const {
+    out.resize(length);
+    this->memory.read(addr, out.data(), length);
+}
+
+void Accumulator::accumulate(uint32_t addr, std::vector<uint8_t>& data) {
+    op_addr = addr;
+    write_data_buffer.swap(data);
+    accumulate_internal();
+    write_data_buffer.swap(data);
+}
+
+void Accumulator::activate(uint32_t addr, uint32_t num_elements, uint8_t func, const ActivationParams& params,
+                           bool to_int8) {
+    op_addr = addr;
+    op_length_or_elements = num_elements;
+    op_func = func;
+    op_params = params;
+    op_to_int8 = to_int8;
     activate_internal();
 }
@@ -1,98 +1,441 @@
 #pragma once
 #include <iostream>
 #include <vector>
-#include <map>
-#include <queue>
+#include <cstdint>
+#include <string>
+#include "mxu_kernels.h"
+#include "isa.h"
+#include "snapshot.h"
 
-using MemoryModel = std::map<uint32_t, uint8_t>;
+// Flat, preallocated on-chip SRAM. Every access is bounds-checked against the
+// declared capacity and moves whole ranges with memcpy.
+class MemoryModel {
+private:
+    std::string name;
+    std::vector<uint8_t> bytes;
+
+    void check_range(uint32_t addr, size_t length) const;
+
+public:
+    MemoryModel(const std::string& name, size_t size_bytes);
+    size_t size() const { return bytes.size(); }
+    void read(uint32_t addr, uint8_t* out, size_t length) const;
+    void write(uint32_t addr, const uint8_t* data, size_t length);
+    uint8_t* range(uint32_t addr, size_t length);
+    // Only pages holding a nonzero byte go into a checkpoint.
+    void save(SnapshotWriter& out) const;
+    void load(SnapshotReader& in);
+};
 
 enum class CompState {
     IDLE,
     BUSY
 };
 
+// Data moves between the controller and the components by swapping vectors
+// rather than copying them: a *_request(..., std::vector<uint8_t>& data) call
+// takes ownership of the bytes in `data` and hands back a recycled buffer in
+// its place, and take_*() swaps a result out the same way. Once every buffer
+// has grown to the transfer size, steady-state execution never allocates.
+//
+// Each component can save() its state into a checkpoint and load() it back.
+// Latencies and other configuration are not saved: they come from the
+// config of the TPU that loads the checkpoint.
+
+// Values of the CFG_CONV_* control registers: the geometry of the
+// convolution CONV computes. Output pixel p is (p / out_width(), p %
+// out_width()); its patch is kernel_h x kernel_w x channels bytes of the
+// feature map in (kh, kw, c) order, zero where it hangs over the padding.
+struct ConvParams {
+    int32_t height;
+    int32_t width;
+    int32_t channels;
+    int32_t kernel_h;
+    int32_t kernel_w;
+    int32_t stride;
+    int32_t pad;
+    int32_t first_pixel;
+
+    ConvParams()
+        : height(0), width(0), channels(0), kernel_h(1), kernel_w(1), stride(1), pad(0), first_pixel(0) {}
+    // Returns false for an unknown register or out-of-range value.
+    bool set(uint32_t reg, int32_t value);
+    int32_t out_height() const { return (height + 2 * pad - kernel_h) / stride + 1; }
+    int32_t out_width() const { return (width + 2 * pad - kernel_w) / stride + 1; }
+    uint64_t out_pixels() const { return static_cast<uint64_t>(out_height()) * out_width(); }
+    uint64_t feature_map_bytes() const { return static_cast<uint64_t>(height) * width * channels; }
+    uint64_t patch_bytes() const { return static_cast<uint64_t>(kernel_h) * kernel_w * channels; }
+    // Whether a CONV with this geometry, row_bytes-wide rows, the given
+    // patch slice and length, and its feature map at fmap_addr fits in a
+    // ub_bytes UB.
+    bool valid(uint32_t fmap_addr, uint32_t slice, uint32_t length, uint32_t row_bytes, size_t ub_bytes) const;
+    // The layer: everything but first_pixel.
+    bool same_layer(const ConvParams& other) const;
+};
+
 class UnifiedBuffer {
 private:
     MemoryModel memory;
     size_t size_bytes;
+    int read_latency;
+    int write_latency;
     CompState state;
     int cycles_remaining;
+    enum class UbOp { WRITE, READ, PATCHES };
+    UbOp pending_op;
     std::vector<uint8_t> write_data_buffer;
     std::vector<uint8_t> read_result_buffer;
     uint32_t op_addr;
     uint32_t op_length;
+    ConvParams op_conv;       // PATCHES
+    uint32_t op_slice;
+    uint32_t op_row_bytes;
+    uint64_t ops_issued;
+    uint64_t ops_completed;
 
     void write_internal();
     void read_internal();
+    void gather_patches(uint32_t fmap_addr, const ConvParams& conv, uint32_t slice, uint32_t row_bytes,
+                        uint32_t length, std::vector<uint8_t>& out) const;
 
 public:
-    UnifiedBuffer(size_t size_kb = 256);
-    void tick(); 
+    UnifiedBuffer(size_t size_kb = 256, int read_latency = 20, int write_latency = 20);
+    void tick();
+    void save(SnapshotWriter& out) const;
+    void load(SnapshotReader& in);
+    void reserve_buffers(size_t bytes);
     bool read_request(uint32_t addr, uint32_t length);
-    bool write_request(uint32_t addr, const std::vector<uint8_t>& data);
-    std::vector<uint8_t> get_read_result();
+    // CONV's address generator: a read of length bytes that builds each
+    // row_bytes row from the feature map at fmap_addr, in the read latency.
+    // Row r is the given slice of output pixel conv.first_pixel + r's patch.
+    bool patch_read_request(uint32_t fmap_addr, const ConvParams& conv, uint32_t slice, uint32_t row_bytes,
+                            uint32_t length);
+    bool write_request(uint32_t addr, std::vector<uint8_t>& data);
+    const std::vector<uint8_t>& get_read_result() const { return read_result_buffer; }
+    void take_read_result(std::vector<uint8_t>& out);
     std::vector<uint8_t> read(uint32_t addr, uint32_t length);
+    // Immediate read into out (resized to length), for functional execution.
+    void read(uint32_t addr, uint32_t length, std::vector<uint8_t>& out) const;
+    void read_patches(uint32_t fmap_addr, const ConvParams& conv, uint32_t slice, uint32_t row_bytes, uint32_t length,
+                      std::vector<uint8_t>& out) const {
+        gather_patches(fmap_addr, conv, slice, row_bytes, length, out);
+    }
     void write(uint32_t addr, const std::vector<uint8_t>& data);
-    CompState get_state() { return state; }
+    size_t size() const { return size_bytes; }
+    CompState get_state() const { return state; }
+    // Requests are numbered from 1 in issue order; a request has finished once
+    // get_completed_ops() reaches the value get_issued_ops() had after it.
+    uint64_t get_issued_ops() const { return ops_issued; }
+    uint64_t get_completed_ops() const { return ops_completed; }
+    int get_cycles_remaining() const { return cycles_remaining; }
+    void skip_cycles(int cycles); // fast-forward; caller guarantees the op does not complete
 };
 
+// Bounded ring of weight tiles waiting to be shifted into the MXU. Slots keep
+// their storage when popped, so loading and reading tiles recycles the same
+// buffers instead of allocating new ones.
 class WeightFIFO {
 private:
-    std::queue<std::vector<uint8_t>> fifo;
+    std::vector<std::vector<uint8_t>> slots;
+    size_t head;
+    size_t count;
     CompState state;
 public:
-    WeightFIFO();
+    WeightFIFO(size_t depth = 4);
     void tick();
-    void load(const std::vector<uint8_t>& weights);
-    std::vector<uint8_t> read(); 
-    CompState get_state() { return state; }
+    void save(SnapshotWriter& out) const;
+    void load(SnapshotReader& in);
+    void reserve_buffers(size_t bytes);
+    bool load(std::vector<uint8_t>& weights); // false when full
+    void read(std::vector<uint8_t>& out);
+    size_t size() const { return count; }
+    size_t depth() const { return slots.size(); }
+    bool full() const { return count == slots.size(); }
+    CompState get_state() const { return state; }
 };
 
+// How the MXU charges time for an MMC.
+//   FIXED:     every MMC takes a flat fixed_latency cycles, one at a time,
+//              plus one cycle per input row beyond the first size rows.
+//   WAVEFRONT: weight-stationary dataflow. Weights shift in one row per cycle
+//              into a shadow buffer, input rows enter with a one-cycle skew
+//              per PE row, partial sums move down the columns and drain out of
+//              the bottom. Shift-in and fill of the next MMC overlap the
+//              drain of the previous one; an MMC that reuses the latched
+//              weights has no shift-in at all.
+enum class MxuTiming { FIXED, WAVEFRONT };
+
 class SystolicArray {
 private:
+    struct MxuOp {
+        uint64_t done_cycle;
+        uint64_t pe_cycles;
+        std::vector<uint8_t> result;
+    };
+
     int size;
+    int fixed_latency;
+    MxuTiming timing;
     CompState state;
-    int cycles_remaining;
+    uint64_t now;
+    // Ring of in-flight MMCs in issue order; the first ops_completed of them
+    // have finished and are waiting for take_result().
+    std::vector<MxuOp> ops;
+    size_t ops_head;
+    size_t ops_count;
+    size_t ops_completed;
+    uint64_t input_free_cycle;
+    uint64_t weights_free_cycle;
+    uint64_t last_done_cycle;
+
     std::vector<uint8_t> input_buffer;
     std::vector<uint8_t> weight_buffer;
-    std::vector<uint8_t> result_buffer; 
+    GemmKernel kernel;
+    // Weights stay latched (already packed for the kernel) until the next
+    // MMC that brings a new tile.
+    std::vector<uint8_t> packed_weights;
+    bool weights_latched;
+    uint64_t weight_loads;
+    uint64_t weight_reuses;
+
+    // Zero-block skipping: the latched tile's nonzero row blocks and the
+    // weight rows they hold. With it off every block counts as nonzero.
+    bool zero_skip;
+    uint64_t latched_blocks;
+    int latched_rows;
+    uint64_t zero_blocks;
+    uint64_t skipped_macs;
+    uint64_t saved_cycles;
 
-    void execute_internal();
+    // Wavefront occupancy for the last tile shape seen, simulated with one
+    // bit per PE (see profile_wavefront).
+    std::vector<uint64_t> pe_valid;
+    int profiled_rows;
+    int profiled_depth;
+    uint64_t profiled_pe_cycles;
+    uint64_t profiled_drain_cycles;
+
+    uint64_t pe_active_cycles;
+    uint64_t overlap_cycles;
+
+    void profile_wavefront(int rows, int depth);
+    void latch_weights();
+    void load_weights(std::vector<uint8_t>& weights);
+    bool start_op(bool new_weights);
+    int multiply(std::vector<uint8_t>& result);
+    void multiply_now(std::vector<uint8_t>& inputs);
+    size_t max_in_flight() const { return timing == MxuTiming::FIXED ? 1 : 2; }
 public:
-    SystolicArray(int size = 16);
+    SystolicArray(int size = 16, int fixed_latency = 32);
     void tick();
-    bool execute_request(const std::vector<uint8_t>& inputs, const std::vector<uint8_t>& weights);
-    std::vector<uint8_t> get_result(); 
+    void save(SnapshotWriter& out) const;
+    void load(SnapshotReader& in);
+    void reserve_buffers(size_t bytes);
+    void set_max_isa(GemmIsa max_isa);
+    GemmIsa get_kernel_isa() const { return kernel.isa; }
+    void set_timing_model(MxuTiming model) { timing = model; }
+    // Structured sparsity: the PE rows of a tile's all-zero row blocks are
+    // bypassed, so they take no MACs, no shift-in cycles and no wavefront
+    // depth, and the functional kernel skips them too.
+    void set_zero_skip(bool enabled);
+    bool get_zero_skip() const { return zero_skip; }
+    MxuTiming get_timing_model() const { return timing; }
+    int get_size() const { return size; }
+    bool can_accept() const;
+    // inputs is rows x size int8, row-major, for any whole number of rows;
+    // the result is rows x size int32.
+    bool execute_request(std::vector<uint8_t>& inputs, std::vector<uint8_t>& weights);
+    // Same, but multiplies by the weights latched by the previous MMC and
+    // skips weight shift-in.
+    bool execute_request(std::vector<uint8_t>& inputs);
+    // Functional mode: multiplies at once, with no timing, and swaps the
+    // result into inputs. Weights latch exactly as with execute_request; the
+    // MXU must have nothing in flight.
+    void execute_now(std::vector<uint8_t>& inputs, std::vector<uint8_t>& weights);
+    void execute_now(std::vector<uint8_t>& inputs);
+    bool has_weights() const { return weights_latched; }
+    uint64_t get_weight_loads() const { return weight_loads; }
+    uint64_t get_weight_reuses() const { return weight_reuses; }
+    bool result_ready() const { return ops_completed > 0; }
+    void take_result(std::vector<uint8_t>& out);
+    void execute(const std::vector<uint8_t>& inputs, const std::vector<uint8_t>& weights, std::vector<uint8_t>& results);
     std::vector<uint8_t> execute(const std::vector<uint8_t>& inputs, const std::vector<uint8_t>& weights);
-    CompState get_state() { return state; }
+    CompState get_state() const { return state; }
+    int get_cycles_remaining() const;
+    void skip_cycles(int cycles);
+    uint64_t get_pe_active_cycles() const { return pe_active_cycles; }
+    uint64_t get_overlap_cycles() const { return overlap_cycles; }
+    // Zero row blocks in the tiles loaded, the PE MAC-cycles they did not
+    // take and the MXU latency they saved (what each MMC would have taken
+    // with its tile dense). All zero unless zero skipping is on.
+    uint64_t get_zero_blocks() const { return zero_blocks; }
+    uint64_t get_skipped_macs() const { return skipped_macs; }
+    uint64_t get_saved_cycles() const { return saved_cycles; }
 };
 
+// Host-memory DMA timing. A transfer first waits base_latency cycles (these
+// overlap freely between outstanding descriptors), then moves its bytes over
+// a single data channel in bursts of burst_bytes, each taking
+// ceil(burst / bytes_per_cycle) cycles. The channel serves descriptors in
+// submission order. bytes_per_cycle == 0 means an unlimited channel, so
+// {100, 0, 0, 1} is the original flat 100-cycle, one-at-a-time host bus.
+struct DmaConfig {
+    int base_latency;
+    uint32_t bytes_per_cycle;
+    uint32_t burst_bytes;
+    size_t max_outstanding;
+
+    DmaConfig() : base_latency(80), bytes_per_cycle(16), burst_bytes(64), max_outstanding(4) {}
+    DmaConfig(int latency, uint32_t bandwidth, uint32_t burst, size_t outstanding)
+        : base_latency(latency), bytes_per_cycle(bandwidth), burst_bytes(burst), max_outstanding(outstanding) {}
+};
+
+// The host memory port the DMA engines of a chip's cores share. Transfers
+// are granted first come, first served, and each holds the port for
+// ceil(length / bytes_per_cycle) cycles after its data starts. The chip
+// rotates which core ticks first, so requests made in the same cycle are
+// granted round robin. bytes_per_cycle == 0 means the port never limits.
+class HostPort {
+public:
+    explicit HostPort(uint32_t bytes_per_cycle = 0)
+        : bytes_per_cycle(bytes_per_cycle), free_cycle(0), busy_cycles(0), wait_cycles(0), grants(0) {}
+    // Books the port for a transfer whose data could start at ready.
+    // Returns when it starts; end receives when it releases the port.
+    uint64_t grant(uint64_t ready, uint32_t length, uint64_t& end);
+    uint32_t get_bytes_per_cycle() const { return bytes_per_cycle; }
+    uint64_t get_busy_cycles() const { return busy_cycles; }
+    uint64_t get_wait_cycles() const { return wait_cycles; }
+    uint64_t get_grants() const { return grants; }
+
+private:
+    uint32_t bytes_per_cycle;
+    uint64_t free_cycle;
+    uint64_t busy_cycles;
+    uint64_t wait_cycles;
+    uint64_t grants;
+};
+
+class DmaEngine {
+private:
+    DmaConfig config;
+    HostPort* port;   // shared with other cores, or null
+    CompState state;
+    uint64_t now;
+    uint64_t channel_free_cycle;
+    // Completion cycles of outstanding descriptors, oldest first. The data
+    // channel is in order, so these are non-decreasing.
+    std::vector<uint64_t> done_cycles;
+    size_t head;
+    size_t count;
+    uint64_t ops_issued;
+    uint64_t ops_completed;
+    uint64_t bytes_moved;
+    uint64_t channel_busy_cycles;
+    uint64_t arbitration_cycles;   // data starts delayed by other cores' use of the port
+
+    uint64_t transfer_cycles(uint32_t length) const;
+
+public:
+    DmaEngine(const DmaConfig& config = DmaConfig());
+    void configure(const DmaConfig& config);
+    const DmaConfig& get_config() const { return config; }
+    // Routes every later transfer through a port shared with other engines.
+    void attach_port(HostPort* shared) { port = shared; }
+    void tick();
+    void save(SnapshotWriter& out) const;
+    void load(SnapshotReader& in);
+    bool can_accept() const { return count < config.max_outstanding; }
+    // Queues a descriptor and returns its ticket, or 0 if every descriptor
+    // slot is in use. Tickets complete in order.
+    uint64_t submit(uint32_t length);
+    bool done(uint64_t ticket) const { return ops_completed >= ticket; }
+    CompState get_state() const { return state; }
+    int get_cycles_remaining() const;
+    void skip_cycles(int cycles) { now += cycles; }
+    uint64_t get_bytes_moved() const { return bytes_moved; }
+    uint64_t get_channel_busy_cycles() const { return channel_busy_cycles; }
+    uint64_t get_arbitration_cycles() const { return arbitration_cycles; }
+};
+
+// Values of the CFG_ACT_* control registers.
+struct ActivationParams {
+    int32_t multiplier;
+    int32_t shift;
+    int32_t zero_point;
+    int32_t clip_min;
+    int32_t clip_max;
+    int32_t relu6_max;
+    int32_t leaky_slope;
+
+    ActivationParams()
+        : multiplier(1), shift(0), zero_point(0), clip_min(-128), clip_max(127), relu6_max(6), leaky_slope(655) {}
+    // Returns false for an unknown register or out-of-range value.
+    bool set(uint32_t reg, int32_t value);
+};
+
+int8_t requantize(int32_t value, const ActivationParams& params);
+// The ACT result for one accumulator value: int32 unless func is a table
+// lookup, whose int8 result is returned sign-extended.
+int32_t apply_activation(int32_t value, uint8_t func, const ActivationParams& params);
+// apply_activation followed by requantize, for ACT with FLAG_ACT_TO_UB.
+int8_t activate_to_int8(int32_t value, uint8_t func, const ActivationParams& params);
+
 class Accumulator {
 private:
     MemoryModel memory;
     size_t size;
+    int read_latency;
+    int write_latency;
+    int activate_latency;
+    int accumulate_latency;
     CompState state;
     int cycles_remaining;
-    enum class AccOp { WRITE, READ, ACTIVATE };
+    enum class AccOp { WRITE, READ, ACTIVATE, ACCUMULATE };
     AccOp pending_op;
     std::vector<uint8_t> write_data_buffer;
     std::vector<uint8_t> read_result_buffer;
     uint32_t op_addr;
     uint32_t op_length_or_elements;
+    uint8_t op_func;
+    bool op_to_int8;
+    ActivationParams op_params;
+    uint64_t ops_issued;
+    uint64_t ops_completed;
 
     void write_internal();
     void read_internal();
     void activate_internal();
+    void accumulate_internal();
 
 public:
-    Accumulator(size_t entries = 4096);
+    Accumulator(size_t entries = 4096, int read_latency = 5, int write_latency = 5, int activate_latency = 16,
+                int accumulate_latency = 10);
     void tick();
-    bool write_request(uint32_t addr, const std::vector<uint8_t>& data);
+    void save(SnapshotWriter& out) const;
+    void load(SnapshotReader& in);
+    void reserve_buffers(size_t bytes);
+    bool write_request(uint32_t addr, std::vector<uint8_t>& data);
+    // Adds int32 values in `data` to the entries at addr; swaps like write_request.
+    bool accumulate_request(uint32_t addr, std::vector<uint8_t>& data);
     bool read_request(uint32_t addr, uint32_t length);
     bool activate_request(uint32_t addr, uint32_t num_elements);
-    std::vector<uint8_t> get_read_result();
+    // Applies func to num_elements entries, in place, or with to_int8 into
+    // an int8 read result (take_read_result) leaving the entries untouched.
+    bool activate_request(uint32_t addr, uint32_t num_elements, uint8_t func, const ActivationParams& params,
+                          bool to_int8);
+    const std::vector<uint8_t>& get_read_result() const { return read_result_buffer; }
+    void take_read_result(std::vector<uint8_t>& out);
     std::vector<uint8_t> read(uint32_t addr, uint32_t length);
     void write(uint32_t addr, const std::vector<uint8_t>& data);
     void activate(uint32_t addr, uint32_t num_elements);
-    CompState get_state() { return state; }
+    // Immediate forms of read_request, accumulate_request and the full
+    // activate_request, for functional execution.
+    void read(uint32_t addr, uint32_t length, std::vector<uint8_t>& out) const;
+    void accumulate(uint32_t addr, std::vector<uint8_t>& data);
+    void activate(uint32_t addr, uint32_t num_elements, uint8_t func, const ActivationParams& params, bool to_int8);
+    CompState get_state() const { return state; }
+    uint64_t get_issued_ops() const { return ops_issued; }
+    uint64_t get_completed_ops() const { return ops_completed; }
+    int get_cycles_remaining() const { return cycles_remaining; }
+    void skip_cycles(int cycles);
 };
@@ -0,0 +1,139 @@
+#include "tpu_config.h"
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+
+namespace {
+
+std::string trim(const std::string& s) {
+    size_t begin = s.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) return "";
+    size_t end = s.find_last_not_of(" \t\r");
+    return s.substr(begin, end - begin + 1);
+}
+
+bool parse_bool(const std::string& value, bool& out) {
+    if (value == "1" || value == "true" || value == "on") { out = true; return true; }
+    if (value == "0" || value == "false" || value == "off") { out = false; return true; }
+    return false;
+}
+
+// A well-formed value outside the range a key allows; what() names the range.
+struct OutOfRange : std::runtime_error {
+    explicit OutOfRange(const std::string& range) : std::runtime_error(range) {}
+};
+
+// Upper bounds that keep a typo from asking for terabytes of simulated
+// memory or an issue queue nothing could fill.
+const int MAX_ARRAY_SIZE = 1024;               // a million PEs
+const size_t MAX_UB_SIZE_KB = 1024 * 1024;      // 1 GB
+const size_t MAX_ACC_ENTRIES = size_t(1) << 28;  // 1 GB of int32
+const size_t MAX_ISSUE_QUEUE_DEPTH = 1024;
+const size_t MAX_WEIGHT_FIFO_DEPTH = 1024;
+
+} // namespace
+
+bool set_config_value(TPUConfig& config, const std::string& key, const std::string& value) {
+    try {
+        size_t used = 0;
+        auto as_int = [&]() { int v = std::stoi(value, &used); if (used != value.size()) throw std::invalid_argument(key); return v; };
+        // stoull would wrap "-1" around to a huge size.
+        auto as_size = [&](unsigned long long max = SIZE_MAX) {
+            size_t first = value.find_first_not_of(" \t");
+            if (first != std::string::npos && value[first] == '-') throw std::invalid_argument(key);
+            unsigned long long v = std::stoull(value, &used);
+            if (used != value.size()) throw std::invalid_argument(key);
+            if (v > max) throw OutOfRange("at most " + std::to_string(max));
+            return static_cast<size_t>(v);
+        };
+        auto as_latency = [&]() {
+            int v = as_int();
+            if (v < 0) throw OutOfRange("a latency must not be negative");
+            return v;
+        };
+
+        if (key == "array_size") {
+            int n = as_int();
+            if (n > MAX_ARRAY_SIZE) throw OutOfRange("at most " + std::to_string(MAX_ARRAY_SIZE));
+            config.array_size = n;
+        } else if (key == "ub_size_kb")          config.ub_size_kb = as_size(MAX_UB_SIZE_KB);
+        else if (key == "acc_entries")         config.acc_entries = as_size(MAX_ACC_ENTRIES);
+        else if (key == "weight_fifo_depth")   config.weight_fifo_depth = as_size(MAX_WEIGHT_FIFO_DEPTH);
+        else if (key == "host_memory_mb")      config.host_memory_mb = as_size();
+        else if (key == "latency_ub_read")     config.latency_ub_read = as_latency();
+        else if (key == "latency_ub_write")    config.latency_ub_write = as_latency();
+        else if (key == "latency_acc_read")    config.latency_acc_read = as_latency();
+        else if (key == "latency_acc_write")   config.latency_acc_write = as_latency();
+        else if (key == "latency_activate")    config.latency_activate = as_latency();
+        else if (key == "latency_acc_accumulate") config.latency_acc_accumulate = as_latency();
+        else if (key == "latency_mxu")         config.latency_mxu = as_latency();
+        else if (key == "issue_queue_depth")   config.issue_queue_depth = as_size(MAX_ISSUE_QUEUE_DEPTH);
+        else if (key == "dma_base_latency")    config.dma.base_latency = as_latency();
+        else if (key == "dma_bytes_per_cycle") config.dma.bytes_per_cycle = static_cast<uint32_t>(as_size(UINT32_MAX));
+        else if (key == "dma_burst_bytes")     config.dma.burst_bytes = static_cast<uint32_t>(as_size(UINT32_MAX));
+        else if (key == "dma_max_outstanding") {
+            config.dma.max_outstanding = as_size();
+            if (config.dma.max_outstanding < 1) throw OutOfRange("at least 1");
+        } else if (key == "clock_mhz") {
+            double mhz = std::stod(value, &used);
+            if (used != value.size()) throw std::invalid_argument(key);
+            if (!(mhz > 0.0) || std::isinf(mhz)) throw OutOfRange("must be positive");
+            config.clock_mhz = mhz;
+        } else if (key == "mxu_timing") {
+            if (value == "fixed") config.mxu_timing = MxuTiming::FIXED;
+            else if (value == "wavefront") config.mxu_timing = MxuTiming::WAVEFRONT;
+            else throw std::invalid_argument(key);
+        } else if (key == "mxu_zero_skip") {
+            if (!parse_bool(value, config.mxu_zero_skip)) throw std::invalid_argument(key);
+        } else if (key == "verbose") {
+            if (!parse_bool(value, config.verbose)) throw std::invalid_argument(key);
+        } else {
+            std::cerr << "ERROR: Unknown config key: " << key << std::endl;
+            return false;
+        }
+    } catch (const OutOfRange& e) {
+        std::cerr << "ERROR: Bad value for config key " << key << ": " << value << " (" << e.what() << ")" << std::endl;
+        return false;
+    } catch (const std::exception&) {
+        std::cerr << "ERROR: Bad value for config key " << key << ": " << value << std::endl;
+        return false;
+    }
+    if (config.array_size <= 0) {
+        std::cerr << "ERROR: array_size must be positive" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool parse_count(const std::string& text, uint64_t max, uint64_t& value) {
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos) return false;
+    uint64_t v = 0;
+    for (char c : text) {
+        uint64_t digit = static_cast<uint64_t>(c - '0');
+        if (digit > max || v > (max - digit) / 10) return false;
+        v = v * 10 + digit;
+    }
+    value = v;
+    return true;
+}
+
+bool load_config_file(const std::string& filepath, TPUConfig& config) {
+    std::ifstream file(filepath);
+    if (!file.is_open()) { std::cerr << "ERROR: Bad config file: " << filepath << std::endl; return false; }
+    std::string line;
+    int line_number = 0;
+    while (std::getline(file, line)) {
+        line_number++;
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) continue;
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            std::cerr << "ERROR: " << filepath << ":" << line_number << ": expected key = value" << std::endl;
+            return false;
+        }
+        if (!set_config_value(config, trim(line.substr(0, eq)), trim(line.substr(eq + 1)))) return false;
+    }
+    return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include "tpu_components.h"
+#include <string>
+
+// Everything that describes one simulated TPU. Each TPU instance owns a copy,
+// so differently configured TPUs can run side by side in one process.
+struct TPUConfig {
+    int array_size;              // MXU is array_size x array_size PEs
+    size_t ub_size_kb;
+    size_t acc_entries;          // 32-bit accumulator entries
+    size_t weight_fifo_depth;    // weight tiles
+    size_t host_memory_mb;
+
+    int latency_ub_read;
+    int latency_ub_write;
+    int latency_acc_read;
+    int latency_acc_write;
+    int latency_activate;
+    int latency_acc_accumulate;  // read-modify-write of an MMC_ACCUMULATE result
+    int latency_mxu;             // per MMC under MxuTiming::FIXED
+
+    MxuTiming mxu_timing;
+    bool mxu_zero_skip;          // skip all-zero weight row blocks (SystolicArray::set_zero_skip)
+    size_t issue_queue_depth;    // 0 = original in-order controller
+    DmaConfig dma;
+
+    double clock_mhz;            // only used to convert cycles to time in the report
+    bool verbose;                // per-instruction and boot messages on stdout
+
+    TPUConfig()
+        : array_size(16), ub_size_kb(256), acc_entries(4096), weight_fifo_depth(4), host_memory_mb(4),
+          latency_ub_read(20), latency_ub_write(20), latency_acc_read(5), latency_acc_write(5),
+          latency_activate(16), latency_acc_accumulate(10), latency_mxu(32), mxu_timing(MxuTiming::FIXED),
+          mxu_zero_skip(false), issue_queue_depth(4), dma(), clock_mhz(500.0), verbose(true) {}
+};
+
+// Sets one field by its config-file key (the member name, e.g. "latency_mxu",
+// "dma_bytes_per_cycle", "mxu_timing=wavefront"). Prints an error and
+// returns false for unknown keys, malformed values and values out of range
+// (negative sizes or latencies, clock_mhz <= 0, dma_max_outstanding < 1,
+// oversized array, UB, accumulator, weight FIFO or issue queue).
+bool set_config_value(TPUConfig& config, const std::string& key, const std::string& value);
+
+// Reads "key = value" lines into config; blank lines and '#' comments are
+// ignored. Keys not in the file keep their current values.
+bool load_config_file(const std::string& filepath, TPUConfig& config);
+
+// Parses a whole decimal number in [0, max] for command-line options like
+// --cores=N. Returns false for anything else: signs, blanks, trailing text.
+bool parse_count(const std::string& text, uint64_t max, uint64_t& value);
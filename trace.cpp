@@ -0,0 +1,42 @@
+#include "trace.h"
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+Tracer::Tracer(size_t capacity) : spans(capacity > 0 ? capacity : 1), next(0), count(0), dropped(0) {}
+
+bool Tracer::write_chrome_json(const std::string& filepath, const std::vector<std::string>& track_names,
+                               double clock_mhz) const {
+    std::ofstream out(filepath);
+    if (!out) {
+        std::cerr << "ERROR: Cannot write " << filepath << std::endl;
+        return false;
+    }
+    out << std::fixed << std::setprecision(4);
+    out << "{\"displayTimeUnit\": \"ns\", \"otherData\": {\"dropped_spans\": " << dropped << "},\n"
+        << "\"traceEvents\": [\n";
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"args\": {\"name\": \"TPU\"}}";
+    for (size_t t = 0; t < track_names.size(); ++t) {
+        out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << t
+            << ", \"args\": {\"name\": \"" << track_names[t] << "\"}}";
+        out << ",\n{\"name\": \"thread_sort_index\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << t
+            << ", \"args\": {\"sort_index\": " << t << "}}";
+    }
+    auto us = [clock_mhz](uint64_t cycle) { return cycle / clock_mhz; };
+    size_t first = count < spans.size() ? 0 : next;
+    for (size_t i = 0; i < count; ++i) {
+        const Span& s = spans[(first + i) % spans.size()];
+        std::string args = s.arg >= 0 ? ", \"args\": {\"pc\": " + std::to_string(s.arg) + "}" : "";
+        if (s.async) {
+            out << ",\n{\"name\": \"" << s.name << "\", \"cat\": \"instruction\", \"ph\": \"b\", \"id\": " << s.id
+                << ", \"pid\": 0, \"tid\": 0, \"ts\": " << us(s.begin) << args << "}";
+            out << ",\n{\"name\": \"" << s.name << "\", \"cat\": \"instruction\", \"ph\": \"e\", \"id\": " << s.id
+                << ", \"pid\": 0, \"tid\": 0, \"ts\": " << us(s.end) << "}";
+        } else {
+            out << ",\n{\"name\": \"" << s.name << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << s.track
+                << ", \"ts\": " << us(s.begin) << ", \"dur\": " << us(s.end - s.begin) << args << "}";
+        }
+    }
+    out << "\n]}\n";
+    return out.good();
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Compile with -DTPU_NO_TRACE to remove every tracing hook from the
+// simulation loop; otherwise each hook costs one null-pointer test while no
+// tracer is attached.
+#ifdef TPU_NO_TRACE
+#define TPU_TRACING(tracer) false
+#else
+#define TPU_TRACING(tracer) ((tracer) != nullptr)
+#endif
+
+// Timeline of spans in simulated cycles, kept in a ring buffer allocated up
+// front so recording never touches the heap. Once the buffer is full the
+// oldest spans are overwritten. Span names must be string literals (or
+// otherwise outlive the tracer).
+class Tracer {
+public:
+    struct Span {
+        uint64_t begin;
+        uint64_t end;
+        const char* name;
+        uint32_t track;    // complete spans: the track they belong on
+        bool async;        // async spans may overlap each other; id tells them apart
+        int64_t id;
+        int64_t arg;       // shown as "pc" when >= 0
+    };
+
+    explicit Tracer(size_t capacity);
+
+    // A span on one track; spans on a track must nest or be disjoint.
+    void span(uint32_t track, const char* name, uint64_t begin, uint64_t end, int64_t arg = -1) {
+        push(Span{begin, end, name, track, false, 0, arg});
+    }
+    // A span that may overlap others of the same name, e.g. an instruction
+    // from fetch to retire.
+    void async_span(const char* name, int64_t id, uint64_t begin, uint64_t end, int64_t arg = -1) {
+        push(Span{begin, end, name, 0, true, id, arg});
+    }
+
+    size_t size() const { return count; }
+    uint64_t get_dropped() const { return dropped; }
+
+    // Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev). Track i
+    // is shown as a thread named track_names[i]; timestamps are converted
+    // from cycles to microseconds at clock_mhz.
+    bool write_chrome_json(const std::string& filepath, const std::vector<std::string>& track_names,
+                           double clock_mhz) const;
+
+private:
+    std::vector<Span> spans;
+    size_t next;
+    size_t count;
+    uint64_t dropped;
+
+    void push(const Span& s) {
+        spans[next] = s;
+        next = next + 1 == spans.size() ? 0 : next + 1;
+        if (count < spans.size()) count++; else dropped++;
+    }
+};
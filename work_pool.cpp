@@ -0,0 +1,88 @@
+#include "work_pool.h"
+
+WorkStealingPool::WorkStealingPool(size_t threads)
+    : current_task(nullptr), generation(0), stopping(false), finished_workers(0) {
+    if (threads == 0) threads = std::thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+    for (size_t i = 0; i < threads; ++i) queues.emplace_back(new TaskQueue());
+    for (size_t i = 0; i < threads; ++i) workers.emplace_back(&WorkStealingPool::worker_loop, this, i);
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> guard(state_lock);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (auto& worker : workers) worker.join();
+}
+
+void WorkStealingPool::run(size_t count, const std::function<void(size_t)>& task) {
+    if (count == 0) return;
+    std::unique_lock<std::mutex> lock(state_lock);
+    size_t n = queues.size();
+    for (size_t q = 0; q < n; ++q) {
+        std::lock_guard<std::mutex> guard(queues[q]->lock);
+        for (size_t i = count * q / n; i < count * (q + 1) / n; ++i) queues[q]->tasks.push_back(i);
+    }
+    current_task = &task;
+    first_error = nullptr;
+    finished_workers = 0;
+    generation++;
+    work_ready.notify_all();
+    // Every worker takes part in every round and reports back once it finds
+    // all deques empty, so none can still be holding this round's task when
+    // the next round is queued.
+    work_done.wait(lock, [this] { return finished_workers == queues.size(); });
+    current_task = nullptr;
+    if (first_error) std::rethrow_exception(first_error);
+}
+
+bool WorkStealingPool::take(size_t self, size_t& index) {
+    {
+        TaskQueue& own = *queues[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty()) {
+            index = own.tasks.back();
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t k = 1; k < queues.size(); ++k) {
+        TaskQueue& victim = *queues[(self + k) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            index = victim.tasks.front();
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::worker_loop(size_t self) {
+    uint64_t seen = 0;
+    for (;;) {
+        const std::function<void(size_t)>* task;
+        {
+            std::unique_lock<std::mutex> lock(state_lock);
+            work_ready.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            task = current_task;
+        }
+        // Every task of this round was queued before the generation bump, so
+        // once all deques are empty this worker has nothing left to do.
+        size_t index;
+        while (take(self, index)) {
+            try {
+                (*task)(index);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(state_lock);
+                if (!first_error) first_error = std::current_exception();
+            }
+        }
+        std::lock_guard<std::mutex> guard(state_lock);
+        if (++finished_workers == queues.size()) work_done.notify_all();
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads with one task deque each. run() deals the
+// task indices out in contiguous blocks; a worker pops from the back of its
+// own deque and, once that is empty, steals from the front of the others, so
+// uneven task costs still keep every core busy.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(size_t threads = 0); // 0 = one per hardware thread
+    ~WorkStealingPool();
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    size_t size() const { return workers.size(); }
+    // Calls task(i) for every i in [0, count) and returns when all are done.
+    // The first exception thrown by a task is rethrown here.
+    void run(size_t count, const std::function<void(size_t)>& task);
+
+private:
+    struct TaskQueue {
+        std::mutex lock;
+        std::deque<size_t> tasks;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<TaskQueue>> queues;
+    std::mutex state_lock;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    const std::function<void(size_t)>* current_task;
+    uint64_t generation;
+    bool stopping;
+    size_t finished_workers;
+    std::exception_ptr first_error;
+
+    void worker_loop(size_t self);
+    bool take(size_t self, size_t& index);
+};